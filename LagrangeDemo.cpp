@@ -13,15 +13,19 @@
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/ext.hpp>
 
+#include "simulation.h"
+#include "snapshot.h"
+#include "trajectory.h"
+
 #define WINDOW_WIDTH 1200
 #define WINDOW_HEIGHT 800
 
-#define MAX_CELESTIAL_BODIES 50
-
 #define FOCUSED_CAMERA_DIST 25.0
-#define LINE_WIDTH 500.0
+#define LINE_WIDTH 2.0f // pixels
+#define LINE_TOLERANCE 2000.0f // a path strays at most the camera distance over this (about half a pixel) from where its body went
 #define MIN_ZOOM 800.0
 #define NUM_ZOOM_LEVELS 20
+#define SNAPSHOT_PATH "lagrange.snapshot"
 
 #define POLL_GL_ERROR poll_gl_error(__FILE__, __LINE__)
 
@@ -30,7 +34,6 @@
  * - Add saturn's ring.
  * - Add Uranus and Neptune.
  * - Add relative path drawing.
- * - Add better lines. (check https://www.labri.fr/perso/nrougier/python-opengl/#rendering-lines)
  * - Add bloom.
  * - Add stars in the background (maybe skybox?)
  * - Add GUI with celestial body info.
@@ -53,48 +56,102 @@ struct Sphere {
     int num_elements;
 };
 
-struct Line {
-    GLfloat vertices[2 * 3]; // triangle strip
+// what a trail point looks like on the GPU, the shader puts it where the rendering mode wants it
+struct LinePoint {
+    GLfloat relative[4]; // position relative to the anchor
+    GLfloat anchor[4]; // position of the anchor
 };
 
-struct CelestialBody;
+// where a path is in a TrailBuffer and how to draw it, the line shader gets it from a buffer texture too
+struct LinePathInfo {
+    GLfloat range[4]; // path_start, num_points, dist_scale, anchor_dist_scale
+    GLfloat color[4];
+    LinePoint head; // the last point, it follows the body so it's new every frame
+};
+
+// Every path taken in one buffer, path i at LINE_PATH_RING * i, all drawn with one glMultiDrawArrays.
+// The first vertex of draw i is 2 * MAX_LINE_PATH_SEGMENTS * i, which is how the line shader knows whose it is.
+// It's made for the bodies there are at the start and grows (copying what's there) when a path is added past
+// that, about 32 KB of points per path.
+//
+// Nothing is rewritten while a frame in flight may be reading it. The points buffer only gets points that are
+// kept for good, each slot written once when its point is kept, and every ring has TRAIL_REGIONS slots more
+// than a path draws so the slot written next isn't one the frames in flight read. What changes every frame,
+// the table with the last points, goes to the next of TRAIL_REGIONS regions, each with its own fence that is
+// only waited on when the region comes around again, so the CPU stays at most that many frames ahead.
+#define TRAIL_REGIONS 3
+struct TrailBuffer {
+    GLuint vao; // no attributes, core profile wants one bound to draw
+    GLuint points_vbo;
+    GLuint points_texture;
+    LinePoint *mapped; // persistently mapped points_vbo, NULL without ARB_buffer_storage (then new points go through glBufferSubData)
+    GLuint paths_vbo; // TRAIL_REGIONS tables of capacity paths
+    GLuint paths_texture;
+    LinePathInfo *mapped_paths; // persistently mapped paths_vbo, or NULL like mapped (then it's always region 0)
+    GLsync fences[TRAIL_REGIONS]; // the last draw reading each region
+    int region;
+    int capacity; // paths
+
+    // the table and draws of the current frame
+    LinePathInfo *paths;
+    GLint *firsts;
+    GLsizei *counts;
+};
 
 struct LinePath {
 #define MAX_LINE_PATH_SEGMENTS 1000
-    Line* lines; // circular buffer
-    CelestialBody *owner;
+#define LINE_PATH_RING (MAX_LINE_PATH_SEGMENTS + TRAIL_REGIONS) // slots, see TrailBuffer
+    // where the body (and its anchor) was, in the simulation, so the history outlives any change of view
+    glm::dvec3 *positions; // circular buffer of LINE_PATH_RING
+    glm::dvec3 *anchor_positions;
+    int owner; // index of the celestial body, and of the path in trails
+    TrailBuffer *trails;
     int path_start;
     int num_segments;
-};
-
-struct CelestialBody {
-    glm::dvec3 position;
-    glm::dvec3 velocity;
-    double mass;
-    double size;
-    glm::vec3 color;
 
-    LinePath* path_taken;
-    // LinePath path_prediction; TODO
-
-    // used for RENDER_MINIFIED
-    double minified_dist_scale;
-    double minified_size_scale;
-    CelestialBody* anchor;
+    // The last point follows the body, the one before it is the last one kept for good. Where the body went
+    // in between is kept here, as long as all of it is within tolerance of the straight line between those
+    // two points the last point just moves along, otherwise it's kept and a new last point starts following.
+    // So straight stretches take one point and tight turns as many as they need (streaming Douglas-Peucker).
+#define MAX_LINE_PATH_WINDOW 64
+    glm::dvec3 *window_positions;
+    glm::dvec3 *window_anchor_positions;
+    int window_count;
 };
 
 struct GlobalState {
     RenderingMode rendering_mode;
-    CelestialBody* celestial_bodies[MAX_CELESTIAL_BODIES];
-    int num_celestial_bodies;
+    Simulation simulation;
     int camera_target;
     glm::vec3 camera_pos;
     float focused_camera_distance;
     int zoom_level;
     bool light_emitter;
     bool enable_orbit_rendering;
+    SnapshotWriter *snapshot_writer;
+
+    // replay mode, the bodies come from a recorded trajectory instead of the physics
+    TrajectoryReader *replay;
+
+    TrailBuffer *trails;
+    double replay_time;
+    double replay_speed; // simulated time per second, negative plays it backwards
+    bool replay_paused;
+};
+
+// what of GlobalState goes into a snapshot next to the simulation
+struct ViewerSnapshot {
+    int32_t rendering_mode;
+    int32_t camera_target;
+    int32_t zoom_level;
+    int32_t enable_orbit_rendering;
+    float focused_camera_distance;
 };
 
+void save_viewer_snapshot(GlobalState *global_state, const char *path);
+void load_viewer_snapshot(GlobalState *global_state, const char *path);
+void wait_for_trail_draws(TrailBuffer *trails);
+
 void poll_gl_error(const char* file, long long line) {
     int err = glGetError();
     if (err) {
@@ -117,11 +174,6 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     // switch rendering mode
     if ((key == GLFW_KEY_LEFT_CONTROL || key == GLFW_KEY_RIGHT_CONTROL) && action == GLFW_PRESS) {
         global_state->rendering_mode = global_state->rendering_mode == RENDER_MINIFIED ? RENDER_TO_SCALE : RENDER_MINIFIED;
-        // reset paths
-        for (int i = 0; i < global_state->num_celestial_bodies; i++) {
-            global_state->celestial_bodies[i]->path_taken->num_segments = 0;
-            global_state->celestial_bodies[i]->path_taken->path_start = 0;
-        }
         // reset camera
         global_state->camera_target = -1;
     }
@@ -131,17 +183,55 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         global_state->enable_orbit_rendering = !global_state->enable_orbit_rendering;
     }
 
+    // cycle through the integrators
+    if (key == GLFW_KEY_I && action == GLFW_PRESS) {
+        Simulation *sim = &global_state->simulation;
+        sim->integrator = (Integrator) ((sim->integrator + 1) % (INTEGRATOR_WISDOM_HOLMAN + 1));
+        printf("integrator: %s\n", integrator_name(sim->integrator));
+    }
+
+    // replay controls: pause, faster, slower, reverse and jumps of a twentieth of the recording
+    if (global_state->replay && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+        double length = trajectory_end_time(global_state->replay) - trajectory_start_time(global_state->replay);
+        bool jumped = false;
+        if (key == GLFW_KEY_P && action == GLFW_PRESS) global_state->replay_paused = !global_state->replay_paused;
+        if (key == GLFW_KEY_UP) global_state->replay_speed *= 2.0;
+        if (key == GLFW_KEY_DOWN) global_state->replay_speed *= 0.5;
+        if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+            global_state->replay_speed = -global_state->replay_speed;
+            jumped = true;
+        }
+        if (key == GLFW_KEY_LEFT || key == GLFW_KEY_RIGHT) {
+            global_state->replay_time += (key == GLFW_KEY_LEFT ? -0.05 : 0.05) * length;
+            jumped = true;
+        }
+        // reset paths, they only make sense going forward without gaps
+        if (jumped) {
+            wait_for_trail_draws(global_state->trails);
+            for (int i = 0; i < global_state->simulation.bodies.count; i++) {
+                global_state->simulation.celestial_bodies[i].path_taken->num_segments = 0;
+                global_state->simulation.celestial_bodies[i].path_taken->path_start = 0;
+            }
+        }
+        if (key == GLFW_KEY_P || key == GLFW_KEY_UP || key == GLFW_KEY_DOWN || jumped) {
+            printf("replay: t = %f, %gx%s\n", global_state->replay_time, global_state->replay_speed, global_state->replay_paused ? ", paused" : "");
+        }
+    }
+
+    // quick save and quick load
+    if (key == GLFW_KEY_F5 && action == GLFW_PRESS) {
+        save_viewer_snapshot(global_state, SNAPSHOT_PATH);
+    }
+    if (key == GLFW_KEY_F9 && action == GLFW_PRESS) {
+        load_viewer_snapshot(global_state, SNAPSHOT_PATH);
+    }
+
     // switch camera target
     if (key == GLFW_KEY_SPACE && action == GLFW_PRESS && global_state->rendering_mode == RENDER_TO_SCALE) {
-        global_state->camera_target = (global_state->camera_target + 1) % (global_state->num_celestial_bodies + 1);
-        if (global_state->camera_target == global_state->num_celestial_bodies) {
+        global_state->camera_target = (global_state->camera_target + 1) % (global_state->simulation.bodies.count + 1);
+        if (global_state->camera_target == global_state->simulation.bodies.count) {
             global_state->camera_target = -1; // default camera
         }
-        // reset paths
-        for (int i = 0; i < global_state->num_celestial_bodies; i++) {
-            global_state->celestial_bodies[i]->path_taken->num_segments = 0;
-            global_state->celestial_bodies[i]->path_taken->path_start = 0;
-        }
     }
 }
 
@@ -152,7 +242,7 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
     if (global_state->camera_target == -1 || global_state->rendering_mode == RENDER_MINIFIED)
         return;
 
-    CelestialBody* target = global_state->celestial_bodies[global_state->camera_target];
+    CelestialBody* target = &global_state->simulation.celestial_bodies[global_state->camera_target];
     float max_zoom = std::log2(target->size * 3.5f);
     float min_zoom = std::log2(MIN_ZOOM);
 
@@ -161,13 +251,6 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
     else if (yoffset < 0.0 && global_state->zoom_level > 0)
         global_state->zoom_level--;
 
-    // TODO: this is a hack, we should have a better path rendering implementation
-    // reset paths
-    for (int i = 0; i < global_state->num_celestial_bodies; i++) {
-        global_state->celestial_bodies[i]->path_taken->num_segments = 0;
-        global_state->celestial_bodies[i]->path_taken->path_start = 0;
-    }
-    
     global_state->focused_camera_distance = std::exp2(min_zoom + (max_zoom-min_zoom)*global_state->zoom_level / NUM_ZOOM_LEVELS);
 }
 
@@ -198,69 +281,354 @@ char* load_file(char const* path) {
     return buffer;
 }
 
-LinePath *create_line_path(CelestialBody *c) {
+GLuint create_program(const char *vertex_path, const char *fragment_path) {
+    GLuint vertex_shader, fragment_shader, program;
+
+    // TODO: fix the size
+    GLchar shader_info_buffer[200];
+    GLint shader_info_len;
+
+    char* vertex_shader_text = load_file(vertex_path);
+    char* fragment_shader_text = load_file(fragment_path);
+
+    // vertex shader
+    {
+        vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(vertex_shader, 1, (const char* const*)&vertex_shader_text, NULL);
+        glCompileShader(vertex_shader);
+
+        glGetShaderInfoLog(vertex_shader, 200, &shader_info_len, shader_info_buffer);
+
+        if (shader_info_len) printf("Vertex Shader (%s): %s\n", vertex_path, shader_info_buffer);
+    }
+
+    // frag shader
+    {
+        fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(fragment_shader, 1, (const char* const*)&fragment_shader_text, NULL);
+        glCompileShader(fragment_shader);
+        glGetShaderInfoLog(fragment_shader, 200, &shader_info_len, shader_info_buffer);
+        if (shader_info_len) printf("Fragment Shader (%s): %s\n", fragment_path, shader_info_buffer);
+    }
+
+    // shader program
+    {
+        program = glCreateProgram();
+        glAttachShader(program, vertex_shader);
+        glAttachShader(program, fragment_shader);
+        glLinkProgram(program);
+
+        glGetProgramInfoLog(program, 200, &shader_info_len, shader_info_buffer);
+        if (shader_info_len) printf("Shader Program: %s\n", shader_info_buffer);
+    }
+
+    free(vertex_shader_text);
+    free(fragment_shader_text);
+    return program;
+}
+
+static void allocate_trail_buffer(TrailBuffer *trails, int capacity) {
+    GLsizeiptr size = (GLsizeiptr) capacity * LINE_PATH_RING * sizeof(LinePoint);
+    GLsizeiptr paths_size = (GLsizeiptr) TRAIL_REGIONS * capacity * sizeof(LinePathInfo);
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &trails->points_vbo);
+    glBindBuffer(GL_TEXTURE_BUFFER, trails->points_vbo);
+    if (GLEW_ARB_buffer_storage) {
+        glBufferStorage(GL_TEXTURE_BUFFER, size, NULL, flags);
+        trails->mapped = (LinePoint *) glMapBufferRange(GL_TEXTURE_BUFFER, 0, size, flags);
+    } else {
+        glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, trails->points_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, trails->points_vbo);
+
+    glGenBuffers(1, &trails->paths_vbo);
+    glBindBuffer(GL_TEXTURE_BUFFER, trails->paths_vbo);
+    if (GLEW_ARB_buffer_storage) {
+        glBufferStorage(GL_TEXTURE_BUFFER, paths_size, NULL, flags);
+        trails->mapped_paths = (LinePathInfo *) glMapBufferRange(GL_TEXTURE_BUFFER, 0, paths_size, flags);
+    } else {
+        glBufferData(GL_TEXTURE_BUFFER, paths_size, NULL, GL_STREAM_DRAW);
+    }
+    glBindTexture(GL_TEXTURE_BUFFER, trails->paths_texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, trails->paths_vbo);
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+    trails->paths = (LinePathInfo *) realloc(trails->paths, capacity * sizeof(LinePathInfo));
+    trails->firsts = (GLint *) realloc(trails->firsts, capacity * sizeof(GLint));
+    trails->counts = (GLsizei *) realloc(trails->counts, capacity * sizeof(GLsizei));
+    if (!trails->paths || !trails->firsts || !trails->counts) {
+        fprintf(stderr, "Error: failed to allocate memory for the trails.\n");
+        exit(-1);
+    }
+    for (int i = trails->capacity; i < capacity; i++) {
+        trails->firsts[i] = 2 * MAX_LINE_PATH_SEGMENTS * i;
+    }
+    trails->capacity = capacity;
+}
+
+static void unmap_trail_buffer(TrailBuffer *trails) {
+    if (trails->mapped) {
+        glBindBuffer(GL_TEXTURE_BUFFER, trails->points_vbo);
+        glUnmapBuffer(GL_TEXTURE_BUFFER);
+    }
+    if (trails->mapped_paths) {
+        glBindBuffer(GL_TEXTURE_BUFFER, trails->paths_vbo);
+        glUnmapBuffer(GL_TEXTURE_BUFFER);
+    }
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+// needs the GL context
+TrailBuffer *create_trail_buffer(int capacity) {
+    TrailBuffer *trails = (TrailBuffer *) calloc(1, sizeof(TrailBuffer));
+    if (trails == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the trails.\n");
+        exit(-1);
+    }
+    glGenVertexArrays(1, &trails->vao);
+    glGenTextures(1, &trails->points_texture);
+    glGenTextures(1, &trails->paths_texture);
+    allocate_trail_buffer(trails, capacity < 1 ? 1 : capacity);
+    return trails;
+}
+
+void destroy_trail_buffer(TrailBuffer **trails) {
+    if (!trails || !(*trails))
+        return;
+
+    for (int i = 0; i < TRAIL_REGIONS; i++) {
+        if ((*trails)->fences[i]) glDeleteSync((*trails)->fences[i]);
+    }
+    unmap_trail_buffer(*trails);
+    glDeleteTextures(1, &(*trails)->points_texture);
+    glDeleteTextures(1, &(*trails)->paths_texture);
+    glDeleteBuffers(1, &(*trails)->points_vbo);
+    glDeleteBuffers(1, &(*trails)->paths_vbo);
+    glDeleteVertexArrays(1, &(*trails)->vao);
+    free((*trails)->paths);
+    free((*trails)->firsts);
+    free((*trails)->counts);
+    free(*trails);
+    *trails = NULL;
+}
+
+// Room for at least num_paths paths, growing by half at a time. The tables are written anew every frame, only
+// the points are copied over, and the copy has to land before anything is written to the new mapping.
+void reserve_trail_buffer(TrailBuffer *trails, int num_paths) {
+    if (num_paths <= trails->capacity)
+        return;
+
+    int old_capacity = trails->capacity;
+    GLuint old_points_vbo = trails->points_vbo;
+    GLuint old_paths_vbo = trails->paths_vbo;
+    unmap_trail_buffer(trails);
+    for (int i = 0; i < TRAIL_REGIONS; i++) {
+        if (trails->fences[i]) glDeleteSync(trails->fences[i]);
+        trails->fences[i] = 0;
+    }
+    trails->region = 0;
+    allocate_trail_buffer(trails, num_paths > old_capacity * 3 / 2 ? num_paths : old_capacity * 3 / 2);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, old_points_vbo);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, trails->points_vbo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr) old_capacity * LINE_PATH_RING * sizeof(LinePoint));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &old_points_vbo);
+    glDeleteBuffers(1, &old_paths_vbo);
+    if (trails->mapped) {
+        GLsync copied = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        while (glClientWaitSync(copied, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(copied);
+    }
+}
+
+// needs the GL context
+LinePath *create_line_path(TrailBuffer *trails, int c) {
     LinePath *line_path = (LinePath *) calloc(1, sizeof(LinePath));
     if (line_path == NULL)
         exit(-1);
-    // TODO: check what's up with this warning
-    line_path->lines = (Line *) calloc(MAX_LINE_PATH_SEGMENTS, sizeof(Line));
+    line_path->positions = (glm::dvec3 *) calloc(LINE_PATH_RING, sizeof(glm::dvec3));
+    line_path->anchor_positions = (glm::dvec3 *) calloc(LINE_PATH_RING, sizeof(glm::dvec3));
+    line_path->window_positions = (glm::dvec3 *) calloc(MAX_LINE_PATH_WINDOW, sizeof(glm::dvec3));
+    line_path->window_anchor_positions = (glm::dvec3 *) calloc(MAX_LINE_PATH_WINDOW, sizeof(glm::dvec3));
+    if (!line_path->positions || !line_path->anchor_positions || !line_path->window_positions || !line_path->window_anchor_positions) {
+        fprintf(stderr, "Error: failed to allocate memory for a line path.\n");
+        exit(-1);
+    }
     line_path->owner = c;
+    line_path->trails = trails;
+    reserve_trail_buffer(trails, c + 1);
     return line_path;
 }
 
 void destroy_line_path(LinePath **line_path) {
-    if (!line_path)
+    if (!line_path || !(*line_path))
         return;
 
-    if ((*line_path)->lines)
-        free((*line_path)->lines);
+    free((*line_path)->positions);
+    free((*line_path)->anchor_positions);
+    free((*line_path)->window_positions);
+    free((*line_path)->window_anchor_positions);
     free(*line_path);
     *line_path = NULL;
 }
 
-// TODO: optimize this
-// TODO: think how to make it cilindrical in 3d
-void append_to_line_path(LinePath *line_path, GlobalState *global_state, glm::vec3 pos, glm::vec3 o0, glm::vec3 o1, float width) {
-    int index = (line_path->path_start + line_path->num_segments) % MAX_LINE_PATH_SEGMENTS;
+static void wait_for_trail_region(TrailBuffer *trails, int region) {
+    if (!trails->fences[region])
+        return;
 
-    glm::vec3 orig = ((o0 - o1) * 1.0f / 2.0f) + o1;
-    glm::vec3 dir = pos - orig;
+    while (glClientWaitSync(trails->fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+    glDeleteSync(trails->fences[region]);
+    trails->fences[region] = 0;
+}
 
-    glm::vec3 perp = glm::cross(glm::normalize(dir), glm::vec3(0.0, 1.0, 0.0));
+// for when paths start over in slots the frames in flight may still be reading
+void wait_for_trail_draws(TrailBuffer *trails) {
+    for (int i = 0; i < TRAIL_REGIONS; i++) {
+        wait_for_trail_region(trails, i);
+    }
+}
 
-    glm::vec3 p0 = pos + perp * (1.0f / 2.0f) * width;
-    glm::vec3 p1 = pos - perp * (1.0f / 2.0f) * width;
+static LinePoint line_point(LinePath *line_path, int index) {
+    glm::vec3 relative = line_path->positions[index] - line_path->anchor_positions[index];
+    glm::vec3 anchor = line_path->anchor_positions[index];
+    LinePoint point = { { relative.x, relative.y, relative.z, 1.0f }, { anchor.x, anchor.y, anchor.z, 1.0f } };
+    return point;
+}
 
-    Line new_line = { p0.x, p0.y, p0.z, p1.x, p1.y, p1.z };
+// copies the point at slot index of the circular buffer to the GPU, once it's kept for good
+static void upload_line_point(LinePath *line_path, int index) {
+    TrailBuffer *trails = line_path->trails;
+    LinePoint point = line_point(line_path, index);
+    int slot = line_path->owner * LINE_PATH_RING + index;
+    if (trails->mapped) {
+        trails->mapped[slot] = point;
+    } else {
+        glBindBuffer(GL_TEXTURE_BUFFER, trails->points_vbo);
+        glBufferSubData(GL_TEXTURE_BUFFER, slot * sizeof(LinePoint), sizeof(LinePoint), &point);
+    }
+}
 
-    line_path->lines[index] = new_line;
+void save_viewer_snapshot(GlobalState *global_state, const char *path) {
+    ViewerSnapshot viewer = { };
+    viewer.rendering_mode = global_state->rendering_mode;
+    viewer.camera_target = global_state->camera_target;
+    viewer.zoom_level = global_state->zoom_level;
+    viewer.enable_orbit_rendering = global_state->enable_orbit_rendering;
+    viewer.focused_camera_distance = global_state->focused_camera_distance;
+    if (!global_state->snapshot_writer) global_state->snapshot_writer = create_snapshot_writer();
+    // written in the background, the next frame doesn't wait for the disk
+    save_snapshot(global_state->snapshot_writer, &global_state->simulation, &viewer, sizeof(viewer), path);
+    printf("saving a snapshot to %s\n", path);
+}
+
+void load_viewer_snapshot(GlobalState *global_state, const char *path) {
+    Snapshot *snapshot = load_snapshot(path);
+    if (!snapshot)
+        return;
+
+    Simulation *sim = &global_state->simulation;
+    for (int i = 0; i < sim->bodies.count; i++) {
+        destroy_line_path(&sim->celestial_bodies[i].path_taken);
+    }
+    wait_for_trail_draws(global_state->trails);
+    restore_snapshot(sim, snapshot);
+    for (int i = 0; i < sim->bodies.count; i++) {
+        sim->celestial_bodies[i].path_taken = create_line_path(global_state->trails, i);
+    }
+
+    global_state->camera_target = -1;
+    if (snapshot->header->user_data_size == sizeof(ViewerSnapshot)) {
+        const ViewerSnapshot *viewer = (const ViewerSnapshot *) snapshot->user_data;
+        global_state->rendering_mode = viewer->rendering_mode == RENDER_TO_SCALE ? RENDER_TO_SCALE : RENDER_MINIFIED;
+        if (viewer->camera_target >= -1 && viewer->camera_target < sim->bodies.count) {
+            global_state->camera_target = viewer->camera_target;
+        }
+        global_state->zoom_level = viewer->zoom_level < 0 ? 0 : viewer->zoom_level > NUM_ZOOM_LEVELS ? NUM_ZOOM_LEVELS : viewer->zoom_level;
+        global_state->enable_orbit_rendering = viewer->enable_orbit_rendering != 0;
+        global_state->focused_camera_distance = viewer->focused_camera_distance;
+    }
+    destroy_snapshot(&snapshot);
+    printf("loaded %s at t = %f\n", path, sim->time);
+}
+
+// where a position of body (and of its anchor at the same time) is drawn in the current rendering mode
+glm::vec3 rendered_position(GlobalState *global_state, int body, glm::dvec3 position, glm::dvec3 anchor_position) {
+    CelestialBody *c = &global_state->simulation.celestial_bodies[body];
+    if (global_state->rendering_mode == RENDER_TO_SCALE)
+        return glm::vec3(position);
+    if (c->anchor == -1)
+        return glm::vec3(position * c->minified_dist_scale);
+    double anchor_scale_dist = global_state->simulation.celestial_bodies[c->anchor].minified_dist_scale;
+    return glm::vec3(anchor_position * anchor_scale_dist + (position - anchor_position) * c->minified_dist_scale);
+}
+
+void append_to_line_path(LinePath *line_path, glm::dvec3 position, glm::dvec3 anchor_position) {
+    int index = (line_path->path_start + line_path->num_segments) % LINE_PATH_RING;
+
+    // the last point so far is kept, the new one is drawn from the table until it is too
+    if (line_path->num_segments > 0) upload_line_point(line_path, index == 0 ? LINE_PATH_RING - 1 : index - 1);
 
     line_path->num_segments++;
     if (line_path->num_segments > MAX_LINE_PATH_SEGMENTS) {
         line_path->num_segments = MAX_LINE_PATH_SEGMENTS;
-        line_path->path_start = (line_path->path_start + 1) % MAX_LINE_PATH_SEGMENTS;
+        line_path->path_start = (line_path->path_start + 1) % LINE_PATH_RING;
     }
+
+    line_path->positions[index] = position;
+    line_path->anchor_positions[index] = anchor_position;
+}
+
+static float distance_to_segment(glm::vec3 p, glm::vec3 a, glm::vec3 b) {
+    glm::vec3 ab = b - a;
+    float length_squared = glm::dot(ab, ab);
+    float t = length_squared > 0.0f ? glm::dot(p - a, ab) / length_squared : 0.0f;
+    t = t < 0.0f ? 0.0f : t > 1.0f ? 1.0f : t;
+    return glm::length(p - (a + ab * t));
 }
 
-void update_line_path(LinePath* line_path, GlobalState *global_state, glm::vec3 pos) {
-    int index = (line_path->path_start + line_path->num_segments) % MAX_LINE_PATH_SEGMENTS;
-    int index_bef = index == 0 ? MAX_LINE_PATH_SEGMENTS - 1 : index - 1;
+void update_line_path(LinePath* line_path, GlobalState *global_state, glm::dvec3 position, glm::dvec3 anchor_position) {
+    if (line_path->num_segments < 2) {
+        // a fresh path (or one that was just reset) gets its first point for good and a last one to move around
+        if (line_path->num_segments == 0) line_path->window_count = 0;
+        append_to_line_path(line_path, position, anchor_position);
+        return;
+    }
+
+    // the tolerance is in what's on screen now, a path drawn zoomed out and looked at up close shows its corners
+    glm::vec3 camera_target_pos = global_state->camera_target == -1 ? glm::vec3(0) : glm::vec3(get_position(&global_state->simulation.bodies, global_state->camera_target));
+    float tolerance = glm::length(global_state->camera_pos - camera_target_pos) / LINE_TOLERANCE;
 
-    glm::vec3 camera_target_pos = global_state->camera_target == -1 ? glm::vec3(0) : glm::vec3(global_state->celestial_bodies[global_state->camera_target]->position);
+    int last = (line_path->path_start + line_path->num_segments - 1) % LINE_PATH_RING;
+    int kept = last == 0 ? LINE_PATH_RING - 1 : last - 1;
+    glm::vec3 pos = rendered_position(global_state, line_path->owner, position, anchor_position);
+    glm::vec3 pos_last = rendered_position(global_state, line_path->owner, line_path->positions[last], line_path->anchor_positions[last]);
+    if (glm::length(pos - pos_last) <= tolerance)
+        return;
 
-    float width = glm::length(global_state->camera_pos - camera_target_pos) / LINE_WIDTH;
-    if (line_path->num_segments == 0) {
-        Line l = { -width / 2.0f, 0, 0 , width / 2.0f, 0, 0 };
-        line_path->lines[index_bef] = l;
+    bool fits = line_path->window_count < MAX_LINE_PATH_WINDOW;
+    glm::vec3 pos_kept = rendered_position(global_state, line_path->owner, line_path->positions[kept], line_path->anchor_positions[kept]);
+    if (fits && distance_to_segment(pos_last, pos_kept, pos) > tolerance) fits = false;
+    for (int i = 0; fits && i < line_path->window_count; i++) {
+        glm::vec3 p = rendered_position(global_state, line_path->owner, line_path->window_positions[i], line_path->window_anchor_positions[i]);
+        if (distance_to_segment(p, pos_kept, pos) > tolerance) fits = false;
     }
 
-    glm::vec3 o0 = glm::vec3(line_path->lines[index_bef].vertices[0], line_path->lines[index_bef].vertices[1], line_path->lines[index_bef].vertices[2]);
-    glm::vec3 o1 = glm::vec3(line_path->lines[index_bef].vertices[3], line_path->lines[index_bef].vertices[4], line_path->lines[index_bef].vertices[5]);
-    
-    if (glm::abs(glm::length(pos - o0)) > width * 2)
-        append_to_line_path(line_path, global_state, pos, o0, o1, width);
-    //else // TODO
-      //  line_path->lines[index]
+    if (fits) {
+        // the last point moves on, where it was is one more point it has to stay close to
+        line_path->window_positions[line_path->window_count] = line_path->positions[last];
+        line_path->window_anchor_positions[line_path->window_count] = line_path->anchor_positions[last];
+        line_path->window_count++;
+        line_path->positions[last] = position;
+        line_path->anchor_positions[last] = anchor_position;
+    } else {
+        // it turned too much, the last point stays where it is and a new one follows the body from there
+        line_path->window_count = 0;
+        append_to_line_path(line_path, position, anchor_position);
+    }
 }
 
 // Adapted from https://stackoverflow.com/questions/7687148/drawing-sphere-in-opengl-without-using-glusphere
@@ -307,41 +675,13 @@ Sphere *create_sphere(int gradation) {
     return sphere;
 }
 
-CelestialBody *create_celestial_body(glm::dvec3 position, glm::dvec3 velocity, float mass, float size, glm::vec3 color,
-                                     double minified_size_scale, double minified_dist_scale, CelestialBody *anchor) {
-    CelestialBody *c = (CelestialBody*) calloc(1, sizeof(CelestialBody));
-    if (c == NULL) {
-        fprintf(stderr, "Error: failed to allocate memory for celestial body.\n");
-        exit(-1);
-    }
-
-    c->position = position;
-    c->velocity = velocity;
-    c->mass = mass;
-    c->size = size;
-    c->color = color;
-    c->path_taken = create_line_path(c);
-    c->minified_dist_scale = minified_dist_scale;
-    c->minified_size_scale = minified_size_scale;
-    c->anchor = anchor;
-
-    return c;
-}
-
-void destroy_celestial_body(CelestialBody **c) {
-    if (c && (*c)) {
-        if ((*c)->path_taken) {
-            free((*c)->path_taken);
-            (*c)->path_taken = NULL;
-        }
-        free(*c);
-        *c = NULL;
-    }
-}
-
-void render_celestial_body(GlobalState *global_state, GLuint VAO, GLuint pathVAO, GLuint pathVBO, GLuint program, Sphere *s, CelestialBody *c) {
+void render_celestial_body(GlobalState *global_state, GLuint VAO, GLuint program, Sphere *s, int body) {
+    const BodyArrays *bodies = &global_state->simulation.bodies;
+    CelestialBody *c = &global_state->simulation.celestial_bodies[body];
+    glm::dvec3 position = get_position(bodies, body);
     double scale_dist = 1.0, scale_size = 1.0, anchor_scale_dist = 1.0;
-    CelestialBody* anchor = NULL;
+    int anchor = -1;
+    glm::dvec3 anchor_position(0.0);
 
     // adjust scale given a rendering mode
     switch (global_state->rendering_mode) {
@@ -349,7 +689,10 @@ void render_celestial_body(GlobalState *global_state, GLuint VAO, GLuint pathVAO
         scale_size = c->minified_size_scale;
         scale_dist = c->minified_dist_scale;
         anchor = c->anchor;
-        anchor_scale_dist = c->anchor ? c->anchor->minified_dist_scale : 1.0;
+        if (anchor != -1) {
+            anchor_scale_dist = global_state->simulation.celestial_bodies[anchor].minified_dist_scale;
+            anchor_position = get_position(bodies, anchor);
+        }
         break;
     case RENDER_TO_SCALE:
         break;
@@ -361,11 +704,11 @@ void render_celestial_body(GlobalState *global_state, GLuint VAO, GLuint pathVAO
     // render the celestial body
     glBindVertexArray(VAO);
         glm::mat4 model_mat(1.0f);
-        if (anchor) {
-            model_mat = glm::translate(model_mat, glm::vec3(c->position - c->anchor->position) * scale_dist);
-            model_mat = glm::translate(model_mat, glm::vec3(c->anchor->position) * anchor_scale_dist);
+        if (anchor != -1) {
+            model_mat = glm::translate(model_mat, glm::vec3(position - anchor_position) * scale_dist);
+            model_mat = glm::translate(model_mat, glm::vec3(anchor_position) * anchor_scale_dist);
         } else {
-            model_mat = glm::translate(model_mat, glm::vec3(c->position) * scale_dist);
+            model_mat = glm::translate(model_mat, glm::vec3(position) * scale_dist);
         }
         model_mat = glm::scale(model_mat, glm::vec3(c->size) * scale_size);
         glUniform3fv(glGetUniformLocation(program, "forced_color"), 1, glm::value_ptr(c->color));
@@ -373,53 +716,67 @@ void render_celestial_body(GlobalState *global_state, GLuint VAO, GLuint pathVAO
 
         // FIXME: we are hardcoding the only light source as the sun
         // TODO: add a better lighting system with support for multiple lights
-        glUniform3fv(glGetUniformLocation(program, "lightPos"), 1, glm::value_ptr(glm::vec3(global_state->celestial_bodies[0]->position)));
-        glUniform3fv(glGetUniformLocation(program, "lightColor"), 1, glm::value_ptr(glm::vec3(global_state->celestial_bodies[0]->color)));
-        glUniform1i(glGetUniformLocation(program, "light_emitter"), c == global_state->celestial_bodies[0]);
+        glUniform3fv(glGetUniformLocation(program, "lightPos"), 1, glm::value_ptr(glm::vec3(get_position(bodies, 0))));
+        glUniform3fv(glGetUniformLocation(program, "lightColor"), 1, glm::value_ptr(glm::vec3(global_state->simulation.celestial_bodies[0].color)));
+        glUniform1i(glGetUniformLocation(program, "light_emitter"), body == 0);
 
         glDrawArrays(GL_TRIANGLE_STRIP, 0, s->num_elements / 3);
     glBindVertexArray(0);
 
     // TODO: Technically this shouldn't be here, since it's not rendering anything and this code should run even when the screen loses focus
     // update the path taken by the celestial body
-    glm::vec3 rendered_position;
-    if (anchor) {
-        rendered_position = c->anchor->position * anchor_scale_dist;
-        rendered_position += (c->position - c->anchor->position) * scale_dist;
+    update_line_path(c->path_taken, global_state, position, c->anchor != -1 ? get_position(bodies, c->anchor) : glm::dvec3(0.0));
+}
+
+// every path taken at once, line_program has to be in use with the view_proj, viewport and line_width of the frame set
+void render_line_paths(GlobalState *global_state, GLuint line_program) {
+    Simulation *sim = &global_state->simulation;
+    TrailBuffer *trails = global_state->trails;
+    for (int i = 0; i < sim->bodies.count; i++) {
+        CelestialBody *c = &sim->celestial_bodies[i];
+        float dist_scale = 1.0f, anchor_dist_scale = 1.0f;
+        if (global_state->rendering_mode == RENDER_MINIFIED) {
+            dist_scale = c->minified_dist_scale;
+            anchor_dist_scale = c->anchor != -1 ? sim->celestial_bodies[c->anchor].minified_dist_scale : 0.0f;
+        }
+        LinePath *line_path = c->path_taken;
+        LinePathInfo info = { { (GLfloat) line_path->path_start, (GLfloat) line_path->num_segments, dist_scale, anchor_dist_scale },
+                              { c->color.x, c->color.y, c->color.z, 1.0f } };
+        if (line_path->num_segments > 0) info.head = line_point(line_path, (line_path->path_start + line_path->num_segments - 1) % LINE_PATH_RING);
+        trails->paths[i] = info;
+        trails->counts[i] = line_path->num_segments * 2;
+    }
+    int region = trails->region;
+    if (trails->mapped_paths) {
+        // written TRAIL_REGIONS frames ago, that draw is done unless the GPU is that far behind
+        wait_for_trail_region(trails, region);
+        memcpy(trails->mapped_paths + region * trails->capacity, trails->paths, sim->bodies.count * sizeof(LinePathInfo));
     } else {
-        rendered_position = c->position * scale_dist;
+        glBindBuffer(GL_TEXTURE_BUFFER, trails->paths_vbo);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, sim->bodies.count * sizeof(LinePathInfo), trails->paths);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
     }
-    update_line_path(c->path_taken, global_state, rendered_position);
-
-    // render path taken
-    if (global_state->enable_orbit_rendering) {
-        glBindVertexArray(pathVAO);
-            glBindBuffer(GL_ARRAY_BUFFER, pathVBO);
-            model_mat = glm::mat4(1.0f);
-            glUniform3fv(glGetUniformLocation(program, "forced_color"), 1, glm::value_ptr(c->color));
-            glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, glm::value_ptr(model_mat));
 
-            // FIXME: temporary hack to transfor the circular buffer into a linear buffer
-            // TODO: stop allocating this stuff thousands of times!!!
-            Line* linearized = (Line*)calloc(c->path_taken->num_segments, sizeof(Line));
-            if (linearized == NULL) exit(-1);
-            memcpy(linearized, c->path_taken->lines + c->path_taken->path_start, (c->path_taken->num_segments - c->path_taken->path_start) * 6 * sizeof(GLfloat));
-            memcpy(linearized + (c->path_taken->num_segments - c->path_taken->path_start), c->path_taken->lines, c->path_taken->path_start * 6 * sizeof(GLfloat));
-
-            glBufferData(GL_ARRAY_BUFFER, c->path_taken->num_segments * 6 * sizeof(GLfloat), /*c->path_taken->lines*/ linearized, GL_DYNAMIC_DRAW);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
-
-            free(linearized);
-
-            glDrawArrays(GL_TRIANGLE_STRIP, 0, c->path_taken->num_segments * 2);
-        glBindVertexArray(0);
+    glUniform1i(glGetUniformLocation(line_program, "points"), 0);
+    glUniform1i(glGetUniformLocation(line_program, "paths"), 1);
+    glUniform1i(glGetUniformLocation(line_program, "paths_offset"), region * trails->capacity);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, trails->points_texture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER, trails->paths_texture);
+    glBindVertexArray(trails->vao);
+        glMultiDrawArrays(GL_TRIANGLE_STRIP, trails->firsts, trails->counts, sim->bodies.count);
+    glBindVertexArray(0);
+    if (trails->mapped_paths) {
+        trails->fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        trails->region = (region + 1) % TRAIL_REGIONS;
     }
+    glActiveTexture(GL_TEXTURE0);
 }
 
-int main()
+int main(int argc, char **argv)
 {
     GLFWwindow* window;
-    GLuint vertex_shader, fragment_shader, program;
     glfwSetErrorCallback(error_callback);
 
     if (!glfwInit()) {
@@ -455,44 +812,8 @@ int main()
 
     glfwSwapInterval(0); // TODO: check
 
-    // TODO: fix the size
-    GLchar shader_info_buffer[200];
-    GLint shader_info_len;
-
-    // TODO: free
-    char* vertex_shader_text = load_file("shaders/vert.glsl");
-    char* fragment_shader_text = load_file("shaders/frag.glsl");
-
-    // vertex shader
-    {
-        vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex_shader, 1, (const char* const*)&vertex_shader_text, NULL);
-        glCompileShader(vertex_shader);
-
-        glGetShaderInfoLog(vertex_shader, 200, &shader_info_len, shader_info_buffer);
-
-        if (shader_info_len) printf("Vertex Shader: %s\n", shader_info_buffer);
-    }
-
-    // frag shader
-    {
-        fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment_shader, 1, (const char* const*)&fragment_shader_text, NULL);
-        glCompileShader(fragment_shader);
-        glGetShaderInfoLog(fragment_shader, 200, &shader_info_len, shader_info_buffer);
-        if (shader_info_len) printf("Fragment Shader: %s\n", shader_info_buffer);
-    }
-
-    // shader program
-    {
-        program = glCreateProgram();
-        glAttachShader(program, vertex_shader);
-        glAttachShader(program, fragment_shader);
-        glLinkProgram(program);
-
-        glGetProgramInfoLog(program, 200, &shader_info_len, shader_info_buffer);
-        if (shader_info_len) printf("Shader Program: %s\n", shader_info_buffer);
-    }
+    GLuint program = create_program("shaders/vert.glsl", "shaders/frag.glsl");
+    GLuint line_program = create_program("shaders/line_vert.glsl", "shaders/line_frag.glsl");
 
     // intialize misc stuff
     Sphere *sphere = create_sphere(12);
@@ -501,70 +822,39 @@ int main()
     float last_time = (float) glfwGetTime();
     float last_fps_update = (float) glfwGetTime();
     int num_frames = 0;
-    float physics_step = 1 / 300.0f;
-
-
-    // initialize celestial bodies
-    /*
-     * In real life, the gravitational constant is approximately 6*10^(-11).
-     * We can change this in our simulation to get a stronger gravity effect,
-     * since we don't want to wait a whole year for the earth to go around the
-     * sun once.
-     */
-#define SUN_SIZE_SCALE 25.0
-#define ROCKY_SIZE_SCALE 700.0
-#define GASSY_SIZE_SCALE 125.0
-#define SUN_DIST_SCALE 1.0
-#define ROCKY_DIST_SCALE 0.35
-#define MOON_DIST_SCALE 20.0
-#define GASSY_DIST_SCALE 0.155
-    double gravitational_constant = 6 * glm::pow(10, 0); // TODO: tune this
-    CelestialBody *sun = create_celestial_body(glm::dvec3(0.0), glm::dvec3(0.0), 333000.0, 0.0164 * 100, glm::vec3(0.97f, 0.45f, 0.1f), SUN_SIZE_SCALE, SUN_DIST_SCALE, NULL);
-    // TODO: figure out why the game breaks if I put the same distance for two planets (i.e. 382.0)
-    CelestialBody* mercury = create_celestial_body(glm::dvec3(382.0 * 0.4164, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.055, 0.0164 * 0.3829, glm::vec3(0.8f, 0.4f, 0.35f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
-    CelestialBody *venus = create_celestial_body(glm::dvec3(279.48, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.81494, 0.0164 * 0.9499, glm::vec3(0.8f, 0.8f, 0.6f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
-    CelestialBody *earth = create_celestial_body(glm::dvec3(382.0, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 1.0, 0.0164, glm::vec3(0.02f, 0.05f, 1.0f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
-    CelestialBody *moon = create_celestial_body(glm::dvec3(383.0, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.0123, 0.0164 / 3.5, glm::vec3(0.8f, 0.8f, 0.8f), ROCKY_SIZE_SCALE, MOON_DIST_SCALE, earth);
-    CelestialBody* mars = create_celestial_body(glm::dvec3(581.4, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.107, 0.0164 * 0.532, glm::vec3(0.95f, 0.25f, 0.2f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
-    CelestialBody* jupiter = create_celestial_body(glm::dvec3(1938.65, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 317.81, 0.0164 * 10.97, glm::vec3(0.75f, 0.85f, 0.5f), GASSY_SIZE_SCALE, GASSY_DIST_SCALE, sun);
-    CelestialBody* saturn = create_celestial_body(glm::dvec3(382.0 * 10.07, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 95.159, 0.0164 * 9.1402, glm::vec3(0.75f, 0.85f, 0.5f), GASSY_SIZE_SCALE, GASSY_DIST_SCALE * 0.7, sun);
-    // we found the lagrange2 distance (3.69537571433) by trial and error, at 3.69537883714 it goes away from the sun and at 3.69527883714 it goes towards the sun
-    CelestialBody* lagrange2 = create_celestial_body(glm::dvec3(382.0 + 3.69537571438, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.00001, 0.0164 / 3.5, glm::vec3(0.0f, 1.0f, 0.0f), ROCKY_SIZE_SCALE, MOON_DIST_SCALE * 0.5, earth);
-    CelestialBody* lagrange4 = create_celestial_body(glm::rotate(glm::vec3(earth->position), glm::radians(60.0f), glm::vec3(0.0, 1.0, 0.0)), glm::dvec3(0.0, 0.0, 1.0), 0.00001, 0.0164 / 3.5, glm::vec3(0.0f, 1.0f, 0.0f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
-    double orbital_velocity_mag = std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - mercury->position)));
-    mercury->velocity *= orbital_velocity_mag * (3.2/3.0);
-    orbital_velocity_mag = std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - venus->position)));
-    venus->velocity *= orbital_velocity_mag;
-    orbital_velocity_mag = std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - earth->position)));
-    earth->velocity *= orbital_velocity_mag;
-    // Why does this work? Sounds like a such a coincidence.
-    orbital_velocity_mag = std::sqrt((gravitational_constant * earth->mass) / (glm::length(earth->position - moon->position)));
-    orbital_velocity_mag += std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - moon->position)));
-    moon->velocity *= orbital_velocity_mag;
-    orbital_velocity_mag = std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - mars->position)));
-    mars->velocity *= orbital_velocity_mag * (3.1 / 3.0);
-    orbital_velocity_mag = std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - jupiter->position)));
-    jupiter->velocity *= orbital_velocity_mag;
-    orbital_velocity_mag = std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - saturn->position)));
-    saturn->velocity *= orbital_velocity_mag;
-    orbital_velocity_mag = std::sqrt((gravitational_constant * earth->mass) / (glm::length(earth->position - lagrange2->position)));
-    orbital_velocity_mag += std::sqrt((gravitational_constant * sun->mass) / (glm::length(sun->position - lagrange2->position)));
-    lagrange2->velocity *= orbital_velocity_mag;
-    lagrange4->velocity = glm::cross(glm::normalize(sun->position - lagrange4->position), glm::dvec3(0.0, 1.0, 0.0)) * -glm::length(earth->velocity);
 
     // Initialize global simulation state
     GlobalState global_state = { };
     global_state.rendering_mode = RENDER_MINIFIED;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = sun;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = mercury;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = venus;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = earth;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = moon;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = mars;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = jupiter;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = saturn;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = lagrange2;
-    global_state.celestial_bodies[global_state.num_celestial_bodies++] = lagrange4;
+    init_simulation(&global_state.simulation, 6 * glm::pow(10, 0), PHYSICS_STEP); // TODO: tune the gravitational constant
+    create_solar_system(&global_state.simulation);
+    set_simulation_threads(&global_state.simulation, 0); // forces on every core, the render thread helps too
+    if (argc > 1) {
+        // LagrangeDemo file.traj plays back a recording of the same solar system
+        Simulation *sim = &global_state.simulation;
+        global_state.replay = open_trajectory(argv[1]);
+        if (!global_state.replay) exit(EXIT_FAILURE);
+        const TrajectoryHeader *header = global_state.replay->header;
+        if (header->num_bodies < sim->bodies.count) {
+            fprintf(stderr, "Error: %s has %d bodies, the solar system alone has %d.\n", argv[1], header->num_bodies, sim->bodies.count);
+            exit(EXIT_FAILURE);
+        }
+        // whatever else was recorded looks like add_asteroid_belt's asteroids, where they are comes from the file
+        while (sim->bodies.count < header->num_bodies) {
+            add_celestial_body(sim, glm::dvec3(0.0), glm::dvec3(0.0), 1e-9, 0.0164 / 20.0, glm::vec3(0.5f, 0.5f, 0.5f), 700.0, 0.35, 0);
+        }
+        while (sim->test_particles.count < header->num_test_particles) {
+            add_test_particle(sim, glm::dvec3(0.0), glm::dvec3(0.0));
+        }
+        global_state.replay_time = trajectory_start_time(global_state.replay);
+        global_state.replay_speed = 1.0;
+        printf("replaying %s, t = %f to %f, P pauses, up/down change the speed, R reverses, left/right jump\n",
+               argv[1], trajectory_start_time(global_state.replay), trajectory_end_time(global_state.replay));
+    }
+    global_state.trails = create_trail_buffer(global_state.simulation.bodies.count);
+    for (int i = 0; i < global_state.simulation.bodies.count; i++) {
+        global_state.simulation.celestial_bodies[i].path_taken = create_line_path(global_state.trails, i);
+    }
     global_state.camera_target = -1;
     global_state.focused_camera_distance = FOCUSED_CAMERA_DIST;
     global_state.zoom_level = 10;
@@ -589,17 +879,6 @@ int main()
         glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
     glBindVertexArray(0);
 
-    GLuint pathVAO, pathVBO;
-    glGenVertexArrays(1, &pathVAO);
-    glGenBuffers(1, &pathVBO);
-
-    glBindVertexArray(pathVAO);
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, pathVBO);
-    // ... call glBufferData() in real time, we update it every frame anyway
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
-    glBindVertexArray(0);
-
     double physics_accumulator = 0.0;
     POLL_GL_ERROR;
     while (!glfwWindowShouldClose(window)) {
@@ -634,36 +913,21 @@ int main()
 
         glUseProgram(program);
 
-        // TODO: interpolate between next physics frame and the accumulator remainder before rendering
-        // physics
-        while (physics_accumulator >= physics_step) {
-            double delta_time = physics_step;
-
-            // naive n-body simulation using particle-based Newton's laws of motion
-            // we calculate all the velocities before update the position because it's more stable that way
-            
-            for (int i = 0; i < global_state.num_celestial_bodies; i++) {
-                for (int j = 0; j < global_state.num_celestial_bodies; j++) {
-                    if (i == j) continue; // a celestial body isn't affected by its own gravity
-
-                    CelestialBody* c_i = global_state.celestial_bodies[i];
-                    CelestialBody* c_j = global_state.celestial_bodies[j];
-
-                    double distance_i_j = glm::length(c_i->position - c_j->position);
-                    // the epsilon is used to avoid the gravity going to infinity when distance goes too close to zero
-                    // TODO: this doesn't seem to help much, maybe we have to choose a bigger epsilon, but we don't want to break the simulation
-                    double epsilon = 0.000001;
-                    double gravity_force = ((double)gravitational_constant * c_i->mass * c_j->mass) / ((distance_i_j * distance_i_j) + epsilon);
-                    c_i->velocity += (glm::normalize(c_j->position - c_i->position) * gravity_force * (1.0f / (double)c_i->mass)) * delta_time;
-                }
-            }
-
-            for (int i = 0; i < global_state.num_celestial_bodies; i++) {
-                CelestialBody* c_i = global_state.celestial_bodies[i];
-                c_i->position += c_i->velocity * delta_time;
-            }
-
-            physics_accumulator -= delta_time;
+        if (global_state.replay) {
+            // no physics at all, just the recording at the current replay time
+            double start_time = trajectory_start_time(global_state.replay);
+            double end_time = trajectory_end_time(global_state.replay);
+            if (!global_state.replay_paused) global_state.replay_time += frame_time * global_state.replay_speed;
+            if (global_state.replay_time < start_time) global_state.replay_time = start_time;
+            if (global_state.replay_time > end_time) global_state.replay_time = end_time;
+            read_trajectory_state(global_state.replay, global_state.replay_time, &global_state.simulation.bodies, &global_state.simulation.test_particles);
+            global_state.simulation.time = global_state.replay_time;
+        } else {
+            // TODO: interpolate between next physics frame and the accumulator remainder before rendering
+            // physics
+            long long num_physics_steps = (long long) (physics_accumulator / global_state.simulation.physics_step);
+            step_simulation(&global_state.simulation, num_physics_steps);
+            physics_accumulator -= num_physics_steps * global_state.simulation.physics_step;
         }
 
         // camera stuff
@@ -675,23 +939,27 @@ int main()
             view_mat = glm::lookAt(global_state.camera_pos, camera_target, camera_up);
         }
         else {
-            CelestialBody* target = global_state.celestial_bodies[global_state.camera_target];
+            int target_index = global_state.camera_target;
+            CelestialBody* target = &global_state.simulation.celestial_bodies[target_index];
+            glm::dvec3 target_position = get_position(&global_state.simulation.bodies, target_index);
+            glm::dvec3 target_velocity = get_velocity(&global_state.simulation.bodies, target_index);
+            glm::dvec3 anchor_position = target->anchor != -1 ? get_position(&global_state.simulation.bodies, target->anchor) : glm::dvec3(0);
             glm::vec3 camera_target(0);
             switch (global_state.rendering_mode) {
             case RENDER_TO_SCALE:
-                camera_target = target->position;
+                camera_target = target_position;
                 break;
             case RENDER_MINIFIED:
-                camera_target = target->anchor ? glm::vec3(target->anchor->position * target->anchor->minified_dist_scale) : glm::vec3(0);
-                camera_target += (target->position - (target->anchor ? target->anchor->position : glm::dvec3(0))) * target->minified_dist_scale;
+                camera_target = target->anchor != -1 ? glm::vec3(anchor_position * global_state.simulation.celestial_bodies[target->anchor].minified_dist_scale) : glm::vec3(0);
+                camera_target += (target_position - anchor_position) * target->minified_dist_scale;
                 break;
             default:
                 fprintf(stderr, "Error: Invalid rendering mode.\n");
                 exit(-1);
             }
             glm::vec3 camera_up(0, 1, 0);
-            global_state.camera_pos = ((glm::vec3(target->position) + glm::normalize(glm::vec3(target->velocity)) * (target->size + global_state.focused_camera_distance)) - glm::vec3(target->position));
-            global_state.camera_pos += glm::vec3(target->position);
+            global_state.camera_pos = ((glm::vec3(target_position) + glm::normalize(glm::vec3(target_velocity)) * (target->size + global_state.focused_camera_distance)) - glm::vec3(target_position));
+            global_state.camera_pos += glm::vec3(target_position);
             global_state.camera_pos += glm::vec3(0, global_state.focused_camera_distance / 2, 0); // offset from the plane a little bit // TODO: parameterize this?
             //fprintf(stderr, "camera position: %f %f %f\n", camera_pos.x, camera_pos.y, camera_pos.z);
             view_mat = glm::lookAt(global_state.camera_pos, camera_target, camera_up);
@@ -701,8 +969,19 @@ int main()
         glUniformMatrix4fv(glGetUniformLocation(program, "view_proj"), 1, GL_FALSE, glm::value_ptr(view_proj_mat));
 
         // rendering
-        for (int i = 0; i < global_state.num_celestial_bodies; i++) {
-            render_celestial_body(&global_state, VAO, pathVAO, pathVBO, program, sphere, global_state.celestial_bodies[i]);
+        for (int i = 0; i < global_state.simulation.bodies.count; i++) {
+            render_celestial_body(&global_state, VAO, program, sphere, i);
+        }
+
+        // paths taken
+        if (global_state.enable_orbit_rendering) {
+            glUseProgram(line_program);
+            glUniformMatrix4fv(glGetUniformLocation(line_program, "view_proj"), 1, GL_FALSE, glm::value_ptr(view_proj_mat));
+            glUniform2f(glGetUniformLocation(line_program, "viewport"), (float) width, (float) height);
+            glUniform1f(glGetUniformLocation(line_program, "line_width"), LINE_WIDTH);
+            glUniform1i(glGetUniformLocation(line_program, "max_points"), MAX_LINE_PATH_SEGMENTS);
+            glUniform1i(glGetUniformLocation(line_program, "ring_size"), LINE_PATH_RING);
+            render_line_paths(&global_state, line_program);
         }
 
         // finished rendering the frame
@@ -710,4 +989,12 @@ int main()
         POLL_GL_ERROR;
         glfwPollEvents();
     }
+
+    // don't cut a snapshot short
+    destroy_snapshot_writer(&global_state.snapshot_writer);
+    destroy_trajectory_reader(&global_state.replay);
+    for (int i = 0; i < global_state.simulation.bodies.count; i++) {
+        destroy_line_path(&global_state.simulation.celestial_bodies[i].path_taken);
+    }
+    destroy_trail_buffer(&global_state.trails);
 }
@@ -0,0 +1,220 @@
+#include "barnes_hut.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+BarnesHutTree *create_barnes_hut_tree() {
+    BarnesHutTree *tree = (BarnesHutTree *) calloc(1, sizeof(BarnesHutTree));
+    if (tree == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the barnes-hut tree.\n");
+        exit(-1);
+    }
+    return tree;
+}
+
+void destroy_barnes_hut_tree(BarnesHutTree **tree) {
+    if (!tree || !(*tree))
+        return;
+
+    free((*tree)->nodes);
+    free((*tree)->body_indices);
+    free((*tree)->scratch_indices);
+    free(*tree);
+    *tree = NULL;
+}
+
+// returns the index of the first of num_nodes new nodes, which may move tree->nodes around
+static int allocate_nodes(BarnesHutTree *tree, int num_nodes) {
+    if (tree->num_nodes + num_nodes > tree->max_nodes) {
+        int max_nodes = tree->max_nodes ? tree->max_nodes : 1024;
+        while (tree->num_nodes + num_nodes > max_nodes) max_nodes *= 2;
+        tree->nodes = (OctreeNode *) realloc(tree->nodes, max_nodes * sizeof(OctreeNode));
+        if (tree->nodes == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for octree nodes.\n");
+            exit(-1);
+        }
+        tree->max_nodes = max_nodes;
+    }
+    int first = tree->num_nodes;
+    tree->num_nodes += num_nodes;
+    return first;
+}
+
+static inline int octant_of(glm::dvec3 p, glm::dvec3 center) {
+    return (p.x >= center.x) | ((p.y >= center.y) << 1) | ((p.z >= center.z) << 2);
+}
+
+// fills the already allocated node at node_index with the bodies in body_indices[first, first + count)
+static void build_node(BarnesHutTree *tree, const BodyArrays *bodies, int node_index, int first, int count,
+                       glm::dvec3 center, double half_size, int depth, double opening_angle, int leaf_size) {
+    OctreeNode node = { };
+    node.center = center;
+    node.half_size = half_size;
+    node.first_body = first;
+    node.num_bodies = count;
+    node.first_child = -1;
+
+    if (count <= leaf_size || depth >= BARNES_HUT_MAX_DEPTH) {
+        glm::dvec3 weighted_position(0.0);
+        for (int k = first; k < first + count; k++) {
+            int b = tree->body_indices[k];
+            node.mass += bodies->mass[b];
+            weighted_position += get_position(bodies, b) * bodies->mass[b];
+        }
+        node.center_of_mass = node.mass > 0.0 ? weighted_position / node.mass : center;
+    } else {
+        // counting sort of the bodies into their octants
+        int counts[8] = { };
+        for (int k = first; k < first + count; k++) {
+            counts[octant_of(get_position(bodies, tree->body_indices[k]), center)]++;
+        }
+        int offsets[8];
+        int num_children = 0;
+        for (int o = 0, offset = first; o < 8; o++) {
+            offsets[o] = offset;
+            offset += counts[o];
+            if (counts[o]) num_children++;
+        }
+        for (int k = first; k < first + count; k++) {
+            int b = tree->body_indices[k];
+            tree->scratch_indices[offsets[octant_of(get_position(bodies, b), center)]++] = b;
+        }
+        memcpy(tree->body_indices + first, tree->scratch_indices + first, count * sizeof(int));
+
+        node.first_child = allocate_nodes(tree, num_children);
+        node.num_children = num_children;
+
+        double child_half_size = half_size / 2.0;
+        int child = node.first_child;
+        for (int o = 0, offset = first; o < 8; o++) {
+            if (!counts[o]) continue;
+            glm::dvec3 child_center = center + glm::dvec3(o & 1 ? child_half_size : -child_half_size,
+                                                          o & 2 ? child_half_size : -child_half_size,
+                                                          o & 4 ? child_half_size : -child_half_size);
+            build_node(tree, bodies, child, offset, counts[o], child_center, child_half_size, depth + 1, opening_angle, leaf_size);
+            offset += counts[o];
+            child++;
+        }
+
+        glm::dvec3 weighted_position(0.0);
+        for (int k = node.first_child; k < node.first_child + num_children; k++) {
+            node.mass += tree->nodes[k].mass;
+            weighted_position += tree->nodes[k].center_of_mass * tree->nodes[k].mass;
+        }
+        node.center_of_mass = node.mass > 0.0 ? weighted_position / node.mass : center;
+    }
+
+    // Barnes' criterion, widened by how far the center of mass sits from the middle of the cell
+    // so that a body inside a big lopsided cell never sees it as a point mass
+    if (opening_angle > 0.0) {
+        node.opening_radius = (2.0 * half_size) / opening_angle + glm::length(node.center_of_mass - center);
+    } else {
+        node.opening_radius = DBL_MAX;
+    }
+
+    tree->nodes[node_index] = node;
+}
+
+void build_barnes_hut_tree(BarnesHutTree *tree, const BodyArrays *bodies, double opening_angle, int leaf_size) {
+    int num_bodies = bodies->count;
+    tree->num_nodes = 0;
+    if (num_bodies == 0)
+        return;
+
+    if (num_bodies > tree->max_bodies) {
+        tree->body_indices = (int *) realloc(tree->body_indices, num_bodies * sizeof(int));
+        tree->scratch_indices = (int *) realloc(tree->scratch_indices, num_bodies * sizeof(int));
+        if (tree->body_indices == NULL || tree->scratch_indices == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the barnes-hut tree.\n");
+            exit(-1);
+        }
+        tree->max_bodies = num_bodies;
+    }
+
+    glm::dvec3 min_corner = get_position(bodies, 0);
+    glm::dvec3 max_corner = get_position(bodies, 0);
+    for (int i = 0; i < num_bodies; i++) {
+        tree->body_indices[i] = i;
+        min_corner = glm::dvec3(fmin(min_corner.x, bodies->x[i]), fmin(min_corner.y, bodies->y[i]), fmin(min_corner.z, bodies->z[i]));
+        max_corner = glm::dvec3(fmax(max_corner.x, bodies->x[i]), fmax(max_corner.y, bodies->y[i]), fmax(max_corner.z, bodies->z[i]));
+    }
+
+    glm::dvec3 center = (min_corner + max_corner) * 0.5;
+    double half_size = 0.0;
+    for (int axis = 0; axis < 3; axis++) {
+        half_size = fmax(half_size, (max_corner[axis] - min_corner[axis]) * 0.5);
+    }
+    // pad it a little so that no body sits exactly on the boundary of the root
+    half_size = half_size * 1.0001 + 1e-9;
+
+    int root = allocate_nodes(tree, 1);
+    build_node(tree, bodies, root, 0, num_bodies, center, half_size, 0, opening_angle, leaf_size);
+}
+
+// sums the pull of the tree's bodies at position, skip is the index of the body sitting there or -1
+static glm::dvec3 walk_barnes_hut_tree(const BarnesHutTree *tree, const BodyArrays *bodies, glm::dvec3 position, int skip,
+                                       double gravitational_constant, double epsilon) {
+    int stack[8 * BARNES_HUT_MAX_DEPTH + 8];
+    glm::dvec3 acceleration(0.0);
+
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size) {
+        const OctreeNode *node = &tree->nodes[stack[--stack_size]];
+        if (node->mass == 0.0) continue;
+
+        glm::dvec3 d = node->center_of_mass - position;
+        double distance_squared = glm::dot(d, d);
+
+        if (distance_squared > node->opening_radius * node->opening_radius) {
+            // far away, the whole cell acts as a single point mass
+            double distance = sqrt(distance_squared);
+            acceleration += d * (gravitational_constant * node->mass / ((distance_squared + epsilon) * distance));
+        } else if (node->first_child == -1) {
+            for (int k = node->first_body; k < node->first_body + node->num_bodies; k++) {
+                int j = tree->body_indices[k];
+                if (j == skip) continue; // a celestial body isn't affected by its own gravity
+
+                glm::dvec3 d_j = get_position(bodies, j) - position;
+                double distance_squared_j = glm::dot(d_j, d_j);
+                double distance_j = sqrt(distance_squared_j);
+                acceleration += d_j * (gravitational_constant * bodies->mass[j] / ((distance_squared_j + epsilon) * distance_j));
+            }
+        } else {
+            for (int k = node->first_child; k < node->first_child + node->num_children; k++) {
+                stack[stack_size++] = k;
+            }
+        }
+    }
+    return acceleration;
+}
+
+void compute_barnes_hut_accelerations(const BarnesHutTree *tree, const BodyArrays *bodies, double gravitational_constant, double epsilon,
+                                      int first, int last) {
+    if (tree->num_nodes == 0)
+        return;
+
+    for (int i = first; i < last; i++) {
+        glm::dvec3 acceleration = walk_barnes_hut_tree(tree, bodies, get_position(bodies, i), i, gravitational_constant, epsilon);
+        bodies->ax[i] = acceleration.x;
+        bodies->ay[i] = acceleration.y;
+        bodies->az[i] = acceleration.z;
+    }
+}
+
+void compute_barnes_hut_point_accelerations(const BarnesHutTree *tree, const BodyArrays *bodies, BodyArrays *points,
+                                            double gravitational_constant, double epsilon, int first, int last) {
+    for (int i = first; i < last; i++) {
+        glm::dvec3 acceleration(0.0);
+        if (tree->num_nodes != 0) {
+            acceleration = walk_barnes_hut_tree(tree, bodies, get_position(points, i), -1, gravitational_constant, epsilon);
+        }
+        points->ax[i] = acceleration.x;
+        points->ay[i] = acceleration.y;
+        points->az[i] = acceleration.z;
+    }
+}
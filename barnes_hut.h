@@ -0,0 +1,47 @@
+#ifndef BARNES_HUT_H
+#define BARNES_HUT_H
+
+#include <glm/glm.hpp>
+
+#define BARNES_HUT_LEAF_SIZE 8
+#define BARNES_HUT_MAX_DEPTH 40
+
+struct BodyArrays;
+
+struct OctreeNode {
+    glm::dvec3 center_of_mass;
+    double mass;
+    glm::dvec3 center;
+    double half_size;
+    // a node far enough from a body (further than this) is treated as a single point mass
+    double opening_radius;
+    int first_child; // children are stored contiguously, only the non-empty ones
+    int num_children;
+    int first_body; // range into BarnesHutTree::body_indices, only meaningful for leaves
+    int num_bodies;
+};
+
+struct BarnesHutTree {
+    OctreeNode *nodes;
+    int num_nodes;
+    int max_nodes;
+
+    int *body_indices;
+    int *scratch_indices;
+    int max_bodies;
+};
+
+BarnesHutTree *create_barnes_hut_tree();
+void destroy_barnes_hut_tree(BarnesHutTree **tree);
+
+// opening_angle is the usual theta, 0 degenerates into the exact O(N^2) sum
+// leaf_size is how many bodies a cell can hold before it's split (BARNES_HUT_LEAF_SIZE for barnes-hut)
+void build_barnes_hut_tree(BarnesHutTree *tree, const BodyArrays *bodies, double opening_angle, int leaf_size);
+// writes bodies->ax/ay/az of the bodies in [first, last), the tree is only read so ranges can run in parallel
+void compute_barnes_hut_accelerations(const BarnesHutTree *tree, const BodyArrays *bodies, double gravitational_constant, double epsilon,
+                                      int first, int last);
+// the same walk for points that aren't in the tree (test particles), writes points->ax/ay/az of [first, last)
+void compute_barnes_hut_point_accelerations(const BarnesHutTree *tree, const BodyArrays *bodies, BodyArrays *points,
+                                            double gravitational_constant, double epsilon, int first, int last);
+
+#endif
@@ -0,0 +1,282 @@
+#include "block_timestep.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// every double array of BlockTimesteps, in declaration order
+#define BLOCK_NUM_ARRAYS 24
+
+BlockTimesteps *create_block_timesteps() {
+    BlockTimesteps *block = (BlockTimesteps *) calloc(1, sizeof(BlockTimesteps));
+    if (block == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the block timesteps.\n");
+        exit(-1);
+    }
+    block->output_time = -1.0;
+    return block;
+}
+
+void destroy_block_timesteps(BlockTimesteps **block) {
+    if (!block || !(*block))
+        return;
+
+    free((*block)->x); // every double array lives in this one block
+    free((*block)->ticks);
+    free((*block)->levels);
+    free((*block)->active);
+    free(*block);
+    *block = NULL;
+}
+
+static void reserve_block_timesteps(BlockTimesteps *block, int num_bodies) {
+    if (num_bodies <= block->capacity)
+        return;
+
+    int capacity = (num_bodies + 7) / 8 * 8;
+    free(block->x);
+    double *arrays = (double *) aligned_alloc(BODY_ARRAY_ALIGNMENT, BLOCK_NUM_ARRAYS * (size_t) capacity * sizeof(double));
+    block->ticks = (long long *) realloc(block->ticks, capacity * sizeof(long long));
+    block->levels = (int *) realloc(block->levels, capacity * sizeof(int));
+    block->active = (int *) realloc(block->active, capacity * sizeof(int));
+    if (arrays == NULL || block->ticks == NULL || block->levels == NULL || block->active == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the block timesteps.\n");
+        exit(-1);
+    }
+
+    double **pointers[BLOCK_NUM_ARRAYS] = {
+        &block->x, &block->y, &block->z, &block->vx, &block->vy, &block->vz,
+        &block->ax, &block->ay, &block->az, &block->jx, &block->jy, &block->jz,
+        &block->px, &block->py, &block->pz, &block->pvx, &block->pvy, &block->pvz,
+        &block->new_ax, &block->new_ay, &block->new_az, &block->new_jx, &block->new_jy, &block->new_jz,
+    };
+    for (int k = 0; k < BLOCK_NUM_ARRAYS; k++) {
+        *pointers[k] = arrays + (size_t) k * capacity;
+    }
+    block->capacity = capacity;
+}
+
+static inline long long step_ticks(int level) {
+    return 1LL << (BLOCK_MAX_LEVEL - level);
+}
+
+// the biggest power-of-two step that isn't longer than step
+static int level_for_step(BlockTimesteps *block, double step) {
+    int level = 0;
+    double level_step = block->max_step;
+    while (level < BLOCK_MAX_LEVEL && level_step > step) {
+        level_step *= 0.5;
+        level++;
+    }
+    return level;
+}
+
+// taylor series of body i from its own time to dt later
+static void predict(BlockTimesteps *block, int i, double dt, double *position, double *velocity) {
+    double dt2 = dt * dt / 2.0, dt3 = dt * dt * dt / 6.0;
+    position[0] = block->x[i] + block->vx[i] * dt + block->ax[i] * dt2 + block->jx[i] * dt3;
+    position[1] = block->y[i] + block->vy[i] * dt + block->ay[i] * dt2 + block->jy[i] * dt3;
+    position[2] = block->z[i] + block->vz[i] * dt + block->az[i] * dt2 + block->jz[i] * dt3;
+    velocity[0] = block->vx[i] + block->ax[i] * dt + block->jx[i] * dt2;
+    velocity[1] = block->vy[i] + block->ay[i] * dt + block->jy[i] * dt2;
+    velocity[2] = block->vz[i] + block->az[i] * dt + block->jz[i] * dt2;
+}
+
+static void predict_all(BlockTimesteps *block, long long ticks) {
+    for (int i = 0; i < block->num_bodies; i++) {
+        double position[3], velocity[3];
+        predict(block, i, (ticks - block->ticks[i]) * block->tick, position, velocity);
+        block->px[i] = position[0]; block->py[i] = position[1]; block->pz[i] = position[2];
+        block->pvx[i] = velocity[0]; block->pvy[i] = velocity[1]; block->pvz[i] = velocity[2];
+    }
+}
+
+// acceleration and jerk of the predicted bodies [first, last) on the predicted body i. The softening is
+// inside the square root (plummer), the jerk of the direct solver's form would be messier for no visible difference.
+static inline void accumulate_jerk(const BlockTimesteps *block, const double *mass, int first, int last, int i,
+                                   double gravitational_constant, double *acceleration, double *jerk) {
+    double x_i = block->px[i], y_i = block->py[i], z_i = block->pz[i];
+    double vx_i = block->pvx[i], vy_i = block->pvy[i], vz_i = block->pvz[i];
+    double ax = 0.0, ay = 0.0, az = 0.0, jx = 0.0, jy = 0.0, jz = 0.0;
+
+    for (int j = first; j < last; j++) {
+        double dx = block->px[j] - x_i, dy = block->py[j] - y_i, dz = block->pz[j] - z_i;
+        double dvx = block->pvx[j] - vx_i, dvy = block->pvy[j] - vy_i, dvz = block->pvz[j] - vz_i;
+        double distance_squared = dx * dx + dy * dy + dz * dz + GRAVITY_EPSILON;
+        double inverse_distance = 1.0 / sqrt(distance_squared);
+        double factor = gravitational_constant * mass[j] * inverse_distance * inverse_distance * inverse_distance;
+        double rv = 3.0 * (dx * dvx + dy * dvy + dz * dvz) / distance_squared;
+        ax += dx * factor;
+        ay += dy * factor;
+        az += dz * factor;
+        jx += (dvx - rv * dx) * factor;
+        jy += (dvy - rv * dy) * factor;
+        jz += (dvz - rv * dz) * factor;
+    }
+
+    acceleration[0] += ax; acceleration[1] += ay; acceleration[2] += az;
+    jerk[0] += jx; jerk[1] += jy; jerk[2] += jz;
+}
+
+struct JerkTile {
+    BlockTimesteps *block;
+    const double *mass;
+    double gravitational_constant;
+};
+
+// new accelerations and jerks of the active bodies [first, last) of the active list
+static void compute_jerk_tile(void *data, int first, int last, int thread_index) {
+    JerkTile *tile = (JerkTile *) data;
+    BlockTimesteps *block = tile->block;
+    for (int k = first; k < last; k++) {
+        int i = block->active[k];
+        double acceleration[3] = { }, jerk[3] = { };
+        // a celestial body isn't affected by its own gravity
+        accumulate_jerk(block, tile->mass, 0, i, i, tile->gravitational_constant, acceleration, jerk);
+        accumulate_jerk(block, tile->mass, i + 1, block->num_bodies, i, tile->gravitational_constant, acceleration, jerk);
+        block->new_ax[i] = acceleration[0]; block->new_ay[i] = acceleration[1]; block->new_az[i] = acceleration[2];
+        block->new_jx[i] = jerk[0]; block->new_jy[i] = jerk[1]; block->new_jz[i] = jerk[2];
+    }
+}
+
+static void compute_active_forces(BlockTimesteps *block, Simulation *sim) {
+    JerkTile tile = { block, sim->bodies.mass, sim->gravitational_constant };
+    parallel_for_tiles(sim->thread_pool, block->num_active, FORCE_TILE_SIZE, compute_jerk_tile, &tile);
+}
+
+static void start(BlockTimesteps *block, Simulation *sim, double max_step) {
+    BodyArrays *bodies = &sim->bodies;
+    int n = bodies->count;
+    reserve_block_timesteps(block, n);
+    block->num_bodies = n;
+    block->start_time = sim->time;
+    block->max_step = max_step;
+    block->tick = max_step / (double) (1LL << BLOCK_MAX_LEVEL);
+
+    size_t size = n * sizeof(double);
+    memcpy(block->x, bodies->x, size); memcpy(block->px, bodies->x, size);
+    memcpy(block->y, bodies->y, size); memcpy(block->py, bodies->y, size);
+    memcpy(block->z, bodies->z, size); memcpy(block->pz, bodies->z, size);
+    memcpy(block->vx, bodies->vx, size); memcpy(block->pvx, bodies->vx, size);
+    memcpy(block->vy, bodies->vy, size); memcpy(block->pvy, bodies->vy, size);
+    memcpy(block->vz, bodies->vz, size); memcpy(block->pvz, bodies->vz, size);
+
+    for (int i = 0; i < n; i++) block->active[i] = i;
+    block->num_active = n;
+    compute_active_forces(block, sim);
+
+    for (int i = 0; i < n; i++) {
+        block->ax[i] = block->new_ax[i]; block->ay[i] = block->new_ay[i]; block->az[i] = block->new_az[i];
+        block->jx[i] = block->new_jx[i]; block->jy[i] = block->new_jy[i]; block->jz[i] = block->new_jz[i];
+        double a = sqrt(block->ax[i] * block->ax[i] + block->ay[i] * block->ay[i] + block->az[i] * block->az[i]);
+        double j = sqrt(block->jx[i] * block->jx[i] + block->jy[i] * block->jy[i] + block->jz[i] * block->jz[i]);
+        block->levels[i] = j > 0.0 ? level_for_step(block, BLOCK_START_ETA * a / j) : 0;
+        block->ticks[i] = 0;
+    }
+
+    block->started = true;
+}
+
+// hermite corrector for the active body i over its step dt, then its next step from Aarseth's criterion
+static void correct(BlockTimesteps *block, int i, double dt, long long ticks) {
+    double *a0[3] = { &block->ax[i], &block->ay[i], &block->az[i] };
+    double *j0[3] = { &block->jx[i], &block->jy[i], &block->jz[i] };
+    double a1[3] = { block->new_ax[i], block->new_ay[i], block->new_az[i] };
+    double j1[3] = { block->new_jx[i], block->new_jy[i], block->new_jz[i] };
+    double *x[3] = { &block->x[i], &block->y[i], &block->z[i] };
+    double *v[3] = { &block->vx[i], &block->vy[i], &block->vz[i] };
+    double p[3] = { block->px[i], block->py[i], block->pz[i] };
+    double pv[3] = { block->pvx[i], block->pvy[i], block->pvz[i] };
+
+    double snap_squared = 0.0, crackle_squared = 0.0;
+    for (int k = 0; k < 3; k++) {
+        // 2nd and 3rd derivatives of the acceleration at the start of the step, from the hermite interpolant
+        double snap = (-6.0 * (*a0[k] - a1[k]) - dt * (4.0 * *j0[k] + 2.0 * j1[k])) / (dt * dt);
+        double crackle = (12.0 * (*a0[k] - a1[k]) + 6.0 * dt * (*j0[k] + j1[k])) / (dt * dt * dt);
+        double dt2 = dt * dt;
+        *x[k] = p[k] + snap * dt2 * dt2 / 24.0 + crackle * dt2 * dt2 * dt / 120.0;
+        *v[k] = pv[k] + snap * dt2 * dt / 6.0 + crackle * dt2 * dt2 / 24.0;
+        *a0[k] = a1[k];
+        *j0[k] = j1[k];
+
+        double snap_at_end = snap + dt * crackle;
+        snap_squared += snap_at_end * snap_at_end;
+        crackle_squared += crackle * crackle;
+    }
+
+    double a = sqrt(a1[0] * a1[0] + a1[1] * a1[1] + a1[2] * a1[2]);
+    double j = sqrt(j1[0] * j1[0] + j1[1] * j1[1] + j1[2] * j1[2]);
+    double snap = sqrt(snap_squared), crackle = sqrt(crackle_squared);
+    double denominator = j * crackle + snap * snap;
+    double new_step = denominator > 0.0 ? sqrt(BLOCK_ETA * (a * snap + j * j) / denominator) : block->max_step;
+
+    // steps only shrink to the power of two that fits, and only grow one level at a time
+    // when the body's time is a multiple of the doubled step, so the blocks stay in sync
+    int level = block->levels[i];
+    while (level < BLOCK_MAX_LEVEL && block->max_step / (double) (1LL << level) > new_step) level++;
+    if (level == block->levels[i] && level > 0 && 2.0 * block->max_step / (double) (1LL << level) <= new_step &&
+        ticks % step_ticks(level - 1) == 0) {
+        level--;
+    }
+    block->levels[i] = level;
+    block->ticks[i] = ticks;
+}
+
+// the next block time is the earliest end of any body's step, the bodies ending there are active
+static long long next_block_ticks(BlockTimesteps *block) {
+    long long next = block->ticks[0] + step_ticks(block->levels[0]);
+    for (int i = 1; i < block->num_bodies; i++) {
+        long long end = block->ticks[i] + step_ticks(block->levels[i]);
+        if (end < next) next = end;
+    }
+    return next;
+}
+
+static void block_step(BlockTimesteps *block, Simulation *sim, long long ticks) {
+    block->num_active = 0;
+    for (int i = 0; i < block->num_bodies; i++) {
+        if (block->ticks[i] + step_ticks(block->levels[i]) == ticks) block->active[block->num_active++] = i;
+    }
+
+    predict_all(block, ticks);
+    compute_active_forces(block, sim);
+    for (int k = 0; k < block->num_active; k++) {
+        int i = block->active[k];
+        correct(block, i, (ticks - block->ticks[i]) * block->tick, ticks);
+    }
+
+    block->num_block_steps++;
+    block->num_active_total += block->num_active;
+}
+
+void advance_block_timesteps(BlockTimesteps *block, Simulation *sim, double t, double max_step) {
+    if (!block->started || block->num_bodies != sim->bodies.count || block->output_time != sim->time ||
+        block->max_step != max_step) {
+        start(block, sim, max_step);
+    }
+
+    if (block->num_bodies == 0)
+        return;
+
+    long long target_ticks = (long long) floor((t - block->start_time) / block->tick);
+    for (;;) {
+        long long ticks = next_block_ticks(block);
+        if (ticks > target_ticks) break;
+        block_step(block, sim, ticks);
+    }
+
+    BodyArrays *bodies = &sim->bodies;
+    for (int i = 0; i < block->num_bodies; i++) {
+        double position[3], velocity[3];
+        predict(block, i, t - (block->start_time + block->ticks[i] * block->tick), position, velocity);
+        bodies->x[i] = position[0]; bodies->y[i] = position[1]; bodies->z[i] = position[2];
+        bodies->vx[i] = velocity[0]; bodies->vy[i] = velocity[1]; bodies->vz[i] = velocity[2];
+    }
+
+    block->output_time = t;
+    // ax/ay/az haven't been touched, but they belong to some earlier positions
+    sim->accelerations_current = false;
+}
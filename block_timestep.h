@@ -0,0 +1,58 @@
+#ifndef BLOCK_TIMESTEP_H
+#define BLOCK_TIMESTEP_H
+
+// Individual power-of-two block timesteps with a 4th order Hermite predictor-corrector (Makino & Aarseth).
+// Every body has its own step, max_step / 2^level, picked from its acceleration and its derivatives, and only
+// the bodies whose step ends at the current block time get their forces recomputed. Everybody else is just
+// predicted forward, so the cost follows the fast bodies instead of the whole system.
+//
+// The forces are the direct sum over every body (with their jerks), whatever sim->force_mode says.
+
+#define BLOCK_MAX_LEVEL 30 // the smallest step is max_step / 2^30, times are counted in these ticks
+#define DEFAULT_BLOCK_MAX_STEP 1.0
+// Aarseth's accuracy parameter, and a tenth of it for the first step, which only has a / jerk to go by
+// because there are no higher derivatives yet
+#define BLOCK_ETA 0.01
+#define BLOCK_START_ETA 0.001
+
+struct Simulation;
+
+struct BlockTimesteps {
+    int num_bodies;
+    int capacity;
+
+    // corrected state of every body at its own time
+    double *x, *y, *z;
+    double *vx, *vy, *vz;
+    double *ax, *ay, *az;
+    double *jx, *jy, *jz; // jerk, da/dt
+    // everybody predicted to the current block time, the sources of the force evaluation
+    double *px, *py, *pz;
+    double *pvx, *pvy, *pvz;
+    // accelerations and jerks at the end of the step, only filled for the active bodies
+    double *new_ax, *new_ay, *new_az;
+    double *new_jx, *new_jy, *new_jz;
+
+    long long *ticks; // time of each body since start_time
+    int *levels;
+    int *active; // indices of the bodies that finish their step at the current block time
+    int num_active;
+
+    double start_time;
+    double max_step;
+    double tick; // max_step / 2^BLOCK_MAX_LEVEL
+    double output_time; // the time of what was last written into the body arrays, -1 for nothing
+    bool started;
+
+    long long num_block_steps;
+    long long num_active_total; // sum of num_active over every block step
+};
+
+BlockTimesteps *create_block_timesteps();
+void destroy_block_timesteps(BlockTimesteps **block);
+
+// moves the bodies to time t, the bodies whose step goes past t are predicted to it.
+// Starts over from the bodies when they were changed by anything else since the last call.
+void advance_block_timesteps(BlockTimesteps *block, Simulation *sim, double t, double max_step);
+
+#endif
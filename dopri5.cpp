@@ -0,0 +1,202 @@
+#include "dopri5.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Dormand and Prince's tableau, the c_i aren't needed since gravity doesn't depend on time
+static const double a21 = 1.0 / 5.0;
+static const double a31 = 3.0 / 40.0, a32 = 9.0 / 40.0;
+static const double a41 = 44.0 / 45.0, a42 = -56.0 / 15.0, a43 = 32.0 / 9.0;
+static const double a51 = 19372.0 / 6561.0, a52 = -25360.0 / 2187.0, a53 = 64448.0 / 6561.0, a54 = -212.0 / 729.0;
+static const double a61 = 9017.0 / 3168.0, a62 = -355.0 / 33.0, a63 = 46732.0 / 5247.0, a64 = 49.0 / 176.0, a65 = -5103.0 / 18656.0;
+// the 5th order solution, also the last stage
+static const double a71 = 35.0 / 384.0, a73 = 500.0 / 1113.0, a74 = 125.0 / 192.0, a75 = -2187.0 / 6784.0, a76 = 11.0 / 84.0;
+// difference between the 5th and the embedded 4th order solutions
+static const double e1 = 71.0 / 57600.0, e3 = -71.0 / 16695.0, e4 = 71.0 / 1920.0, e5 = -17253.0 / 339200.0, e6 = 22.0 / 525.0, e7 = -1.0 / 40.0;
+// dense output, from Hairer's dopri5.f
+static const double d1 = -12715105075.0 / 11282082432.0, d3 = 87487479700.0 / 32700410799.0, d4 = -10690763975.0 / 1880347072.0,
+                    d5 = 701980252875.0 / 199316789632.0, d6 = -1453857185.0 / 822651844.0, d7 = 69997945.0 / 29380423.0;
+
+// 3 states, the stages and the interpolant
+#define DOPRI5_NUM_ARRAYS (3 + DOPRI5_NUM_STAGES + 5)
+
+Dopri5 *create_dopri5() {
+    Dopri5 *dopri5 = (Dopri5 *) calloc(1, sizeof(Dopri5));
+    if (dopri5 == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the dopri5 integrator.\n");
+        exit(-1);
+    }
+    dopri5->output_time = -1.0;
+    return dopri5;
+}
+
+void destroy_dopri5(Dopri5 **dopri5) {
+    if (!dopri5 || !(*dopri5))
+        return;
+
+    free((*dopri5)->block);
+    free(*dopri5);
+    *dopri5 = NULL;
+}
+
+static void reserve_dopri5(Dopri5 *dopri5, int num_bodies) {
+    int stride = (num_bodies + 7) / 8 * 8;
+    if (dopri5->state && stride == dopri5->stride)
+        return;
+
+    free(dopri5->block);
+    size_t array_size = 6 * (size_t) stride;
+    double *block = (double *) aligned_alloc(BODY_ARRAY_ALIGNMENT, DOPRI5_NUM_ARRAYS * array_size * sizeof(double));
+    if (block == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the dopri5 integrator.\n");
+        exit(-1);
+    }
+    // the padding after each component stays zero, so the loops below can run over whole arrays
+    memset(block, 0, DOPRI5_NUM_ARRAYS * array_size * sizeof(double));
+
+    dopri5->stride = stride;
+    dopri5->block = block;
+    dopri5->state = block;
+    dopri5->next_state = block + array_size;
+    dopri5->stage_state = block + 2 * array_size;
+    for (int k = 0; k < DOPRI5_NUM_STAGES; k++) {
+        dopri5->derivatives[k] = block + (3 + k) * array_size;
+    }
+    for (int k = 0; k < 5; k++) {
+        dopri5->dense[k] = block + (3 + DOPRI5_NUM_STAGES + k) * array_size;
+    }
+}
+
+// component c (x, y, z, vx, vy, vz) of the body arrays
+static double *body_component(BodyArrays *bodies, int c) {
+    double *components[6] = { bodies->x, bodies->y, bodies->z, bodies->vx, bodies->vy, bodies->vz };
+    return components[c];
+}
+
+// derivative = (v, a) at state, the force evaluation goes through the body arrays
+static void evaluate(Dopri5 *dopri5, Simulation *sim, const double *state, double *derivative) {
+    BodyArrays *bodies = &sim->bodies;
+    int n = dopri5->num_bodies, stride = dopri5->stride;
+    size_t size = n * sizeof(double);
+
+    memcpy(bodies->x, state, size);
+    memcpy(bodies->y, state + stride, size);
+    memcpy(bodies->z, state + 2 * stride, size);
+    compute_accelerations(sim);
+
+    memcpy(derivative, state + 3 * stride, 3 * stride * sizeof(double));
+    memcpy(derivative + 3 * stride, bodies->ax, size);
+    memcpy(derivative + 4 * stride, bodies->ay, size);
+    memcpy(derivative + 5 * stride, bodies->az, size);
+}
+
+static void start(Dopri5 *dopri5, Simulation *sim) {
+    reserve_dopri5(dopri5, sim->bodies.count);
+    dopri5->num_bodies = sim->bodies.count;
+    for (int c = 0; c < 6; c++) {
+        memcpy(dopri5->state + c * dopri5->stride, body_component(&sim->bodies, c), dopri5->num_bodies * sizeof(double));
+    }
+    evaluate(dopri5, sim, dopri5->state, dopri5->derivatives[0]);
+
+    dopri5->time = sim->time;
+    // the fixed step is a sane first guess, the controller takes it from there
+    if (!dopri5->started || dopri5->step <= 0.0) dopri5->step = sim->physics_step;
+    dopri5->last_step = 0.0;
+    dopri5->started = true;
+}
+
+// returns whether the step was accepted, either way dopri5->step is updated for the next try
+static bool try_step(Dopri5 *dopri5, Simulation *sim, double tolerance) {
+    int n = 6 * dopri5->stride;
+    double h = dopri5->step;
+    const double *y = dopri5->state;
+    double *stage = dopri5->stage_state;
+    double *y_new = dopri5->next_state;
+    double **k = dopri5->derivatives;
+
+    for (int i = 0; i < n; i++) stage[i] = y[i] + h * (a21 * k[0][i]);
+    evaluate(dopri5, sim, stage, k[1]);
+    for (int i = 0; i < n; i++) stage[i] = y[i] + h * (a31 * k[0][i] + a32 * k[1][i]);
+    evaluate(dopri5, sim, stage, k[2]);
+    for (int i = 0; i < n; i++) stage[i] = y[i] + h * (a41 * k[0][i] + a42 * k[1][i] + a43 * k[2][i]);
+    evaluate(dopri5, sim, stage, k[3]);
+    for (int i = 0; i < n; i++) stage[i] = y[i] + h * (a51 * k[0][i] + a52 * k[1][i] + a53 * k[2][i] + a54 * k[3][i]);
+    evaluate(dopri5, sim, stage, k[4]);
+    for (int i = 0; i < n; i++) stage[i] = y[i] + h * (a61 * k[0][i] + a62 * k[1][i] + a63 * k[2][i] + a64 * k[3][i] + a65 * k[4][i]);
+    evaluate(dopri5, sim, stage, k[5]);
+    for (int i = 0; i < n; i++) y_new[i] = y[i] + h * (a71 * k[0][i] + a73 * k[2][i] + a74 * k[3][i] + a75 * k[4][i] + a76 * k[5][i]);
+    evaluate(dopri5, sim, y_new, k[6]);
+
+    // scaled RMS of the local error estimate, the same tolerance is used as relative and absolute
+    double error = 0.0;
+    for (int i = 0; i < n; i++) {
+        double e = h * (e1 * k[0][i] + e3 * k[2][i] + e4 * k[3][i] + e5 * k[4][i] + e6 * k[5][i] + e7 * k[6][i]);
+        double scale = tolerance + tolerance * fmax(fabs(y[i]), fabs(y_new[i]));
+        error += (e / scale) * (e / scale);
+    }
+    error = sqrt(error / (6.0 * dopri5->num_bodies));
+
+    // the usual controller, 0.9 safety factor and the step can't change by more than 5x at once
+    double factor = error > 0.0 ? 0.9 * pow(error, -0.2) : 5.0;
+    if (error > 1.0) {
+        dopri5->step = h * fmax(0.2, factor);
+        dopri5->num_rejected++;
+        return false;
+    }
+
+    double **dense = dopri5->dense;
+    for (int i = 0; i < n; i++) {
+        double y_diff = y_new[i] - y[i];
+        double bspl = h * k[0][i] - y_diff;
+        dense[0][i] = y[i];
+        dense[1][i] = y_diff;
+        dense[2][i] = bspl;
+        dense[3][i] = y_diff - h * k[6][i] - bspl;
+        dense[4][i] = h * (d1 * k[0][i] + d3 * k[2][i] + d4 * k[3][i] + d5 * k[4][i] + d6 * k[5][i] + d7 * k[6][i]);
+    }
+
+    // first same as last, the derivative at the end of this step starts the next one
+    double *swap = k[0]; k[0] = k[6]; k[6] = swap;
+    swap = dopri5->state; dopri5->state = dopri5->next_state; dopri5->next_state = swap;
+
+    dopri5->time += h;
+    dopri5->last_step = h;
+    dopri5->step = h * fmin(5.0, fmax(0.2, factor));
+    dopri5->num_accepted++;
+    return true;
+}
+
+void advance_dopri5(Dopri5 *dopri5, Simulation *sim, double t, double tolerance) {
+    if (!dopri5->started || dopri5->num_bodies != sim->bodies.count || dopri5->output_time != sim->time) {
+        start(dopri5, sim);
+    }
+
+    while (dopri5->time < t) {
+        try_step(dopri5, sim, tolerance);
+    }
+
+    int n = dopri5->num_bodies, stride = dopri5->stride;
+    if (dopri5->last_step == 0.0) {
+        // nothing was integrated since the start
+        for (int c = 0; c < 6; c++) {
+            memcpy(body_component(&sim->bodies, c), dopri5->state + c * stride, n * sizeof(double));
+        }
+    } else {
+        double theta = (t - (dopri5->time - dopri5->last_step)) / dopri5->last_step;
+        double theta1 = 1.0 - theta;
+        double **dense = dopri5->dense;
+        for (int c = 0; c < 6; c++) {
+            double *out = body_component(&sim->bodies, c);
+            for (int i = c * stride; i < c * stride + n; i++) {
+                out[i - c * stride] = dense[0][i] + theta * (dense[1][i] + theta1 * (dense[2][i] + theta * (dense[3][i] + theta1 * dense[4][i])));
+            }
+        }
+    }
+
+    dopri5->output_time = t;
+    // what's in ax/ay/az belongs to some stage, not to the interpolated positions
+    sim->accelerations_current = false;
+}
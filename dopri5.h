@@ -0,0 +1,40 @@
+#ifndef DOPRI5_H
+#define DOPRI5_H
+
+// Dormand-Prince 5(4) with step size control and Hairer's dense output. It keeps its own copy of the state,
+// which runs ahead of the simulation by up to one step, and writes the interpolated state at the requested
+// time into the body arrays, so it can take steps much longer than the time between two frames.
+
+#define DEFAULT_DOPRI5_TOLERANCE 1e-9
+#define DOPRI5_NUM_STAGES 7
+
+struct Simulation;
+
+struct Dopri5 {
+    int num_bodies;
+    int stride; // distance between the 6 components (x, y, z, vx, vy, vz) in every array below
+    double *block; // every array below lives in this one allocation
+    double *state; // at time
+    double *next_state;
+    double *stage_state;
+    double *derivatives[DOPRI5_NUM_STAGES]; // k1..k7, k7 is the derivative at next_state (first same as last)
+    double *dense[5]; // coefficients of the interpolant over the last accepted step
+
+    double time;
+    double step; // the next step it will try
+    double last_step; // the accepted one the interpolant covers, ending at time
+    double output_time; // the time of what was last written into the body arrays, -1 for nothing
+    bool started;
+
+    long long num_accepted;
+    long long num_rejected;
+};
+
+Dopri5 *create_dopri5();
+void destroy_dopri5(Dopri5 **dopri5);
+
+// moves the bodies to time t, taking whatever steps tolerance asks for (relative and absolute error per step).
+// Starts over from the bodies when they were changed by anything else since the last call.
+void advance_dopri5(Dopri5 *dopri5, Simulation *sim, double t, double tolerance);
+
+#endif
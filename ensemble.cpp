@@ -0,0 +1,349 @@
+#include "ensemble.h"
+#include "simulation.h"
+#include "integrator.h"
+#include "force_simd.h"
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/ext.hpp>
+
+struct EnsembleRun {
+    const Simulation *sim;
+    Ensemble *ensemble;
+};
+
+// splitmix64, so that every member gets an unrelated stream from seed + index
+static unsigned long long next_random(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// box-muller, throws the second value away
+static double random_gaussian(unsigned long long *state) {
+    double u = ((next_random(state) >> 11) + 1) * (1.0 / 9007199254740993.0); // (0, 1], log(0) never happens
+    double v = (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+    return sqrt(-2.0 * log(u)) * cos(glm::two_pi<double>() * v);
+}
+
+static glm::dvec3 random_offset(unsigned long long *state, double sigma) {
+    double x = random_gaussian(state);
+    double y = random_gaussian(state);
+    double z = random_gaussian(state);
+    return glm::dvec3(x, y, z) * sigma;
+}
+
+static void copy_body_arrays(BodyArrays *to, const BodyArrays *from) {
+    init_body_arrays(to);
+    reserve_body_arrays(to, from->count);
+    size_t size = from->count * sizeof(double);
+    memcpy(to->x, from->x, size);
+    memcpy(to->y, from->y, size);
+    memcpy(to->z, from->z, size);
+    memcpy(to->vx, from->vx, size);
+    memcpy(to->vy, from->vy, size);
+    memcpy(to->vz, from->vz, size);
+    memcpy(to->mass, from->mass, size);
+    memcpy(to->ax, from->ax, size);
+    memcpy(to->ay, from->ay, size);
+    memcpy(to->az, from->az, size);
+    to->count = from->count;
+}
+
+// the settings and the shared read only parts of sim, with state of its own
+static void init_member(Simulation *member, const Simulation *sim) {
+    *member = *sim;
+    copy_body_arrays(&member->bodies, &sim->bodies);
+    copy_body_arrays(&member->test_particles, &sim->test_particles);
+    member->dopri5 = NULL;
+    member->block_timesteps = NULL;
+    member->wisdom_holman = NULL;
+    member->barnes_hut_tree = NULL;
+    member->fmm_tree = NULL;
+    member->thread_pool = NULL;
+    member->symmetric_buffers = NULL;
+    member->symmetric_buffers_size = 0;
+    member->spk_states = NULL;
+    member->spk_segments = NULL;
+    member->spk_scratch_capacity = 0;
+    member->recorder = NULL;
+}
+
+static void destroy_member(Simulation *member) {
+    member->celestial_bodies = NULL; // the scenario's
+    destroy_simulation(member);
+}
+
+// the offsets of member index, the same whichever way it runs
+static void draw_member_offsets(const Simulation *sim, const EnsembleSettings *settings, int index, EnsembleMember *result) {
+    unsigned long long state = settings->seed + index;
+    result->position_offset = random_offset(&state, settings->position_sigma);
+    result->velocity_offset = random_offset(&state, settings->velocity_sigma);
+    glm::dvec3 radial = glm::normalize(get_position(&sim->bodies, settings->body) - get_position(&sim->bodies, settings->reference));
+    result->radial_offset = glm::dot(result->position_offset, radial);
+    result->outcome = OUTCOME_BOUND;
+}
+
+// OUTCOME_BOUND while the body is within escape_distance of the reference
+static EnsembleOutcome classify(const EnsembleSettings *settings, glm::dvec3 position, glm::dvec3 reference, glm::dvec3 sun) {
+    if (glm::length(position - reference) <= settings->escape_distance)
+        return OUTCOME_BOUND;
+    return glm::length(position - sun) < glm::length(reference - sun) ? OUTCOME_INWARD : OUTCOME_OUTWARD;
+}
+
+static void run_member(const Simulation *sim, const EnsembleSettings *settings, int index, EnsembleMember *result) {
+    int sun = 0;
+    draw_member_offsets(sim, settings, index, result);
+
+    Simulation member;
+    init_member(&member, sim);
+    set_position(&member.bodies, settings->body, get_position(&member.bodies, settings->body) + result->position_offset);
+    set_velocity(&member.bodies, settings->body, get_velocity(&member.bodies, settings->body) + result->velocity_offset);
+    member.accelerations_current = false;
+    member.test_particle_accelerations_current = false;
+
+    long long num_steps = (long long) floor((settings->end_time - member.time) / member.physics_step + 1e-9);
+    for (long long step = 0; step < num_steps; step++) {
+        step_simulation(&member, 1);
+        result->outcome = classify(settings, get_position(&member.bodies, settings->body),
+                                   get_position(&member.bodies, settings->reference), get_position(&member.bodies, sun));
+        if (result->outcome != OUTCOME_BOUND) break;
+    }
+    result->outcome_time = member.time;
+
+    destroy_member(&member);
+}
+
+// members [first, first + num_lanes) in one batch, the lanes past the last member run the unperturbed scenario
+static void run_batch(const Simulation *sim, const EnsembleSettings *settings, int first, EnsembleMember *results) {
+    int sun = 0;
+    EnsembleBatch *batch = create_ensemble_batch(sim, settings->num_lanes);
+    int num_members = settings->num_members - first < batch->num_lanes ? settings->num_members - first : batch->num_lanes;
+
+    for (int lane = 0; lane < num_members; lane++) {
+        EnsembleMember *result = &results[first + lane];
+        draw_member_offsets(sim, settings, first + lane, result);
+        int k = settings->body * batch->num_lanes + lane;
+        batch->lanes.x[k] += result->position_offset.x;
+        batch->lanes.y[k] += result->position_offset.y;
+        batch->lanes.z[k] += result->position_offset.z;
+        batch->lanes.vx[k] += result->velocity_offset.x;
+        batch->lanes.vy[k] += result->velocity_offset.y;
+        batch->lanes.vz[k] += result->velocity_offset.z;
+    }
+
+    // decided lanes keep going with the others, it's the same instructions either way
+    double time = sim->time;
+    int num_running = num_members;
+    long long num_steps = (long long) floor((settings->end_time - sim->time) / sim->physics_step + 1e-9);
+    for (long long step = 0; step < num_steps && num_running > 0; step++) {
+        step_ensemble_batch(batch, sim->integrator, sim->physics_step);
+        time += sim->physics_step;
+        for (int lane = 0; lane < num_members; lane++) {
+            EnsembleMember *result = &results[first + lane];
+            if (result->outcome != OUTCOME_BOUND) continue;
+            result->outcome = classify(settings, get_lane_position(batch, settings->body, lane),
+                                       get_lane_position(batch, settings->reference, lane), get_lane_position(batch, sun, lane));
+            if (result->outcome != OUTCOME_BOUND) {
+                result->outcome_time = time;
+                num_running--;
+            }
+        }
+    }
+    for (int lane = 0; lane < num_members; lane++) {
+        if (results[first + lane].outcome == OUTCOME_BOUND) results[first + lane].outcome_time = time;
+    }
+
+    destroy_ensemble_batch(&batch);
+}
+
+static void run_members_tile(void *data, int first, int last, int thread_index) {
+    EnsembleRun *run = (EnsembleRun *) data;
+    for (int i = first; i < last; i++) {
+        run_member(run->sim, &run->ensemble->settings, i, &run->ensemble->members[i]);
+    }
+}
+
+// a tile of batches, batch b is the members from b * num_lanes on
+static void run_batches_tile(void *data, int first, int last, int thread_index) {
+    EnsembleRun *run = (EnsembleRun *) data;
+    for (int b = first; b < last; b++) {
+        run_batch(run->sim, &run->ensemble->settings, b * run->ensemble->settings.num_lanes, run->ensemble->members);
+    }
+}
+
+Ensemble *run_ensemble(const Simulation *sim, const EnsembleSettings *settings, int num_threads) {
+    bool batched = settings->num_lanes > 1;
+    if (batched && (!integrator_is_fixed_step(sim->integrator) || (sim->force_mode != FORCE_DIRECT && sim->force_mode != FORCE_SYMMETRIC) ||
+                    sim->test_particles.count || sim->ephemeris || sim->spk)) {
+        fprintf(stderr, "Error: batched ensembles only run the fixed step integrators with direct or symmetric forces, without test particles, ephemeris or SPK kernel.\n");
+        return NULL;
+    }
+
+    Ensemble *ensemble = (Ensemble *) calloc(1, sizeof(Ensemble));
+    if (ensemble == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the ensemble.\n");
+        exit(-1);
+    }
+    ensemble->settings = *settings;
+    if (ensemble->settings.escape_distance <= 0.0) {
+        double distance = glm::length(get_position(&sim->bodies, settings->body) - get_position(&sim->bodies, settings->reference));
+        ensemble->settings.escape_distance = DEFAULT_ENSEMBLE_ESCAPE_FACTOR * distance;
+    }
+    ensemble->members = (EnsembleMember *) calloc(settings->num_members > 0 ? settings->num_members : 1, sizeof(EnsembleMember));
+    if (ensemble->members == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for %d ensemble members.\n", settings->num_members);
+        exit(-1);
+    }
+
+    // one member (or batch) per tile, members that leave early are done early and the pool steals around them
+    ThreadPool *pool = create_thread_pool(num_threads);
+    EnsembleRun run = { sim, ensemble };
+    if (batched) {
+        ensemble->settings.num_lanes = (settings->num_lanes + ENSEMBLE_BATCH_LANE_MULTIPLE - 1) / ENSEMBLE_BATCH_LANE_MULTIPLE * ENSEMBLE_BATCH_LANE_MULTIPLE;
+        int num_batches = (settings->num_members + ensemble->settings.num_lanes - 1) / ensemble->settings.num_lanes;
+        parallel_for_tiles(pool, num_batches, 1, run_batches_tile, &run);
+    } else {
+        parallel_for_tiles(pool, settings->num_members, 1, run_members_tile, &run);
+    }
+    destroy_thread_pool(&pool);
+
+    for (int k = 0; k < NUM_ENSEMBLE_OUTCOMES; k++) {
+        ensemble->min_radial_offset[k] = INFINITY;
+        ensemble->max_radial_offset[k] = -INFINITY;
+    }
+    for (int i = 0; i < settings->num_members; i++) {
+        const EnsembleMember *member = &ensemble->members[i];
+        int k = member->outcome;
+        ensemble->num_outcomes[k]++;
+        ensemble->mean_outcome_time[k] += member->outcome_time;
+        ensemble->min_radial_offset[k] = fmin(ensemble->min_radial_offset[k], member->radial_offset);
+        ensemble->max_radial_offset[k] = fmax(ensemble->max_radial_offset[k], member->radial_offset);
+    }
+    for (int k = 0; k < NUM_ENSEMBLE_OUTCOMES; k++) {
+        if (ensemble->num_outcomes[k]) ensemble->mean_outcome_time[k] /= ensemble->num_outcomes[k];
+    }
+
+    return ensemble;
+}
+
+EnsembleBatch *create_ensemble_batch(const Simulation *sim, int num_lanes) {
+    EnsembleBatch *batch = (EnsembleBatch *) calloc(1, sizeof(EnsembleBatch));
+    if (batch == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the ensemble batch.\n");
+        exit(-1);
+    }
+    num_lanes = (num_lanes + ENSEMBLE_BATCH_LANE_MULTIPLE - 1) / ENSEMBLE_BATCH_LANE_MULTIPLE * ENSEMBLE_BATCH_LANE_MULTIPLE;
+    batch->num_bodies = sim->bodies.count;
+    batch->num_lanes = num_lanes;
+    batch->gravitational_constant = sim->gravitational_constant;
+    batch->simd_level = sim->simd_level;
+
+    BodyArrays *lanes = &batch->lanes;
+    init_body_arrays(lanes);
+    reserve_body_arrays(lanes, batch->num_bodies * num_lanes);
+    lanes->count = batch->num_bodies * num_lanes;
+    const BodyArrays *bodies = &sim->bodies;
+    for (int i = 0; i < batch->num_bodies; i++) {
+        for (int k = i * num_lanes; k < (i + 1) * num_lanes; k++) {
+            lanes->x[k] = bodies->x[i];
+            lanes->y[k] = bodies->y[i];
+            lanes->z[k] = bodies->z[i];
+            lanes->vx[k] = bodies->vx[i];
+            lanes->vy[k] = bodies->vy[i];
+            lanes->vz[k] = bodies->vz[i];
+            lanes->mass[k] = bodies->mass[i];
+        }
+    }
+    return batch;
+}
+
+void destroy_ensemble_batch(EnsembleBatch **batch) {
+    if (!batch || !(*batch))
+        return;
+
+    destroy_body_arrays(&(*batch)->lanes);
+    free(*batch);
+    *batch = NULL;
+}
+
+void compute_batch_accelerations(EnsembleBatch *batch) {
+    BodyArrays *lanes = &batch->lanes;
+    int num_bodies = batch->num_bodies, num_lanes = batch->num_lanes;
+    double gravitational_constant = batch->gravitational_constant;
+
+    if (batch->simd_level != SIMD_SCALAR) {
+        compute_batch_accelerations_simd(lanes, num_bodies, num_lanes, gravitational_constant, GRAVITY_EPSILON, batch->simd_level);
+        return;
+    }
+
+    // a cache line of lanes at a time, the fixed length loop over them is what the compiler vectorizes
+    const double *x = lanes->x, *y = lanes->y, *z = lanes->z, *mass = lanes->mass;
+    for (int i = 0; i < num_bodies; i++) {
+        for (int first = i * num_lanes; first < (i + 1) * num_lanes; first += ENSEMBLE_BATCH_LANE_MULTIPLE) {
+            double sum_x[ENSEMBLE_BATCH_LANE_MULTIPLE] = { };
+            double sum_y[ENSEMBLE_BATCH_LANE_MULTIPLE] = { };
+            double sum_z[ENSEMBLE_BATCH_LANE_MULTIPLE] = { };
+
+            // the same copies of every other body
+            for (int j = first % num_lanes; j < num_bodies * num_lanes; j += num_lanes) {
+                if (j == first) continue;
+                for (int k = 0; k < ENSEMBLE_BATCH_LANE_MULTIPLE; k++) {
+                    double dx = x[j + k] - x[first + k];
+                    double dy = y[j + k] - y[first + k];
+                    double dz = z[j + k] - z[first + k];
+                    double distance_squared = dx * dx + dy * dy + dz * dz;
+                    double factor = gravitational_constant * mass[j + k] / ((distance_squared + GRAVITY_EPSILON) * sqrt(distance_squared));
+                    sum_x[k] += dx * factor;
+                    sum_y[k] += dy * factor;
+                    sum_z[k] += dz * factor;
+                }
+            }
+
+            for (int k = 0; k < ENSEMBLE_BATCH_LANE_MULTIPLE; k++) {
+                lanes->ax[first + k] = sum_x[k];
+                lanes->ay[first + k] = sum_y[k];
+                lanes->az[first + k] = sum_z[k];
+            }
+        }
+    }
+}
+
+static void batch_accelerations(void *data) {
+    compute_batch_accelerations((EnsembleBatch *) data);
+}
+
+void step_ensemble_batch(EnsembleBatch *batch, Integrator integrator, double delta_time) {
+    if (!batch->accelerations_current) {
+        compute_batch_accelerations(batch);
+    }
+    if (!integrate_fixed_step(integrator, &batch->lanes, batch_accelerations, batch, delta_time)) {
+        fprintf(stderr, "Error: ensemble batches only run the fixed step integrators.\n");
+        exit(-1);
+    }
+    batch->accelerations_current = true;
+}
+
+void destroy_ensemble(Ensemble **ensemble) {
+    if (!ensemble || !(*ensemble))
+        return;
+
+    free((*ensemble)->members);
+    free(*ensemble);
+    *ensemble = NULL;
+}
+
+const char *ensemble_outcome_name(EnsembleOutcome outcome) {
+    switch (outcome) {
+        case OUTCOME_BOUND: return "bound";
+        case OUTCOME_INWARD: return "inward";
+        case OUTCOME_OUTWARD: return "outward";
+        default: return "unknown";
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <glm/glm.hpp>
+
+#include "simulation.h"
+
+// Monte Carlo ensembles: many copies of one scenario, each with the starting position and velocity of one body
+// nudged by a random gaussian offset, run in parallel to see how sensitive where it ends up is to where it
+// starts. The scenario simulation is only read. Every member gets its own copy of the body and test particle
+// arrays and of the integrator state, and shares everything else with the scenario (the celestial bodies,
+// the ephemeris, the SPK kernel).
+//
+// A member's fate is decided by the distance between the watched body and a reference body: once it's more
+// than escape_distance, the watched body left on the side of the first body (the sun) or on the far side.
+
+#define DEFAULT_ENSEMBLE_POSITION_SIGMA 1e-6
+
+// escape_distance of 0 is this times the starting distance between the body and the reference
+#define DEFAULT_ENSEMBLE_ESCAPE_FACTOR 3.0
+
+// lanes of a batch are padded to a cache line worth of doubles, a full AVX-512 register
+#define ENSEMBLE_BATCH_LANE_MULTIPLE (BODY_ARRAY_ALIGNMENT / (int) sizeof(double))
+
+enum EnsembleOutcome {
+    OUTCOME_BOUND,   // still within escape_distance of the reference at the end
+    OUTCOME_INWARD,  // left towards the sun
+    OUTCOME_OUTWARD, // left away from the sun
+    NUM_ENSEMBLE_OUTCOMES,
+};
+
+struct EnsembleSettings {
+    int num_members;
+    int body; // the one that gets perturbed and watched
+    int reference;
+    double position_sigma; // standard deviation of the offsets, on every axis
+    double velocity_sigma;
+    double end_time;
+    double escape_distance;
+    unsigned long long seed; // member i only depends on the seed and i, not on the number of threads
+    // run this many members at once in an EnsembleBatch, one per SIMD lane, 0 or 1 for one Simulation per member
+    int num_lanes;
+};
+
+struct EnsembleMember {
+    glm::dvec3 position_offset;
+    glm::dvec3 velocity_offset;
+    double radial_offset; // position_offset along the direction from the reference to the body
+    EnsembleOutcome outcome;
+    double outcome_time; // when it left, end_time for OUTCOME_BOUND
+};
+
+struct Ensemble {
+    EnsembleSettings settings;
+    EnsembleMember *members;
+
+    int num_outcomes[NUM_ENSEMBLE_OUTCOMES];
+    double mean_outcome_time[NUM_ENSEMBLE_OUTCOMES];
+    // the radial offsets of the members with every outcome span [min, max], when the inward and outward
+    // ranges don't overlap the starting distance that splits them is somewhere in between
+    double min_radial_offset[NUM_ENSEMBLE_OUTCOMES];
+    double max_radial_offset[NUM_ENSEMBLE_OUTCOMES];
+};
+
+// Copies of one small system side by side, one per SIMD lane: body i of copy k is at i * num_lanes + k in every
+// array of lanes. The force loop goes over the bodies like the direct solver does and works on a whole row of
+// copies at a time, so ten bodies still fill every vector register. The copies can differ in anything but the
+// number of bodies. Only direct forces and the fixed step integrators (euler up to yoshida6).
+struct EnsembleBatch {
+    BodyArrays lanes; // count is num_bodies * num_lanes, kick_bodies and drift_bodies don't care about the layout
+    int num_bodies;
+    int num_lanes; // a multiple of ENSEMBLE_BATCH_LANE_MULTIPLE
+    double gravitational_constant;
+    SimdLevel simd_level;
+    bool accelerations_current;
+};
+
+// num_lanes copies of the bodies of sim (rounded up), with its gravitational constant and simd level
+EnsembleBatch *create_ensemble_batch(const Simulation *sim, int num_lanes);
+void destroy_ensemble_batch(EnsembleBatch **batch);
+
+void compute_batch_accelerations(EnsembleBatch *batch);
+// integrator has to be a fixed step one
+void step_ensemble_batch(EnsembleBatch *batch, Integrator integrator, double delta_time);
+
+inline glm::dvec3 get_lane_position(const EnsembleBatch *batch, int body, int lane) {
+    int k = body * batch->num_lanes + lane;
+    return glm::dvec3(batch->lanes.x[k], batch->lanes.y[k], batch->lanes.z[k]);
+}
+
+// runs every member on num_threads threads (counting the caller, 0 for one per core), each member (or batch of
+// settings->num_lanes members) runs on a single thread with the integrator and force settings of sim. Prints
+// what went wrong and returns NULL if batches were asked for a scenario they can't run.
+Ensemble *run_ensemble(const Simulation *sim, const EnsembleSettings *settings, int num_threads);
+void destroy_ensemble(Ensemble **ensemble);
+
+const char *ensemble_outcome_name(EnsembleOutcome outcome);
+
+#endif
@@ -0,0 +1,225 @@
+#include "ephemeris.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(sizeof(EphemerisHeader) == 64, "the ephemeris header is part of the file format");
+
+Ephemeris *build_ephemeris(Simulation *sim, double end_time, double segment_length, int degree) {
+    assert(segment_length > 0.0);
+    assert(degree >= 0 && degree <= EPHEMERIS_MAX_DEGREE);
+
+    int num_bodies = sim->bodies.count;
+    int num_segments = (int) ceil((end_time - sim->time) / segment_length - 1e-9);
+    if (num_segments < 1) num_segments = 1;
+    int n = degree + 1;
+
+    Ephemeris *ephemeris = (Ephemeris *) calloc(1, sizeof(Ephemeris));
+    double *coefficients = (double *) calloc((size_t) num_segments * num_bodies * 3 * n, sizeof(double));
+    double *samples = (double *) calloc((size_t) num_bodies * 3 * n, sizeof(double));
+    double *cosines = (double *) calloc((size_t) n * n, sizeof(double));
+    if (ephemeris == NULL || coefficients == NULL || samples == NULL || cosines == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the ephemeris.\n");
+        exit(-1);
+    }
+    ephemeris->num_bodies = num_bodies;
+    ephemeris->num_segments = num_segments;
+    ephemeris->degree = degree;
+    ephemeris->start_time = sim->time;
+    ephemeris->segment_length = segment_length;
+    ephemeris->coefficients = coefficients;
+
+    // cos(pi * j * (k + 1/2) / n), the chebyshev polynomials at the nodes
+    for (int j = 0; j < n; j++) {
+        for (int k = 0; k < n; k++) {
+            cosines[j * n + k] = cos(M_PI * j * (k + 0.5) / n);
+        }
+    }
+
+    BodyArrays *bodies = &sim->bodies;
+    for (int segment = 0; segment < num_segments; segment++) {
+        double half_length = 0.5 * segment_length;
+        double middle = ephemeris->start_time + segment * segment_length + half_length;
+
+        // node k sits at cos(pi * (k + 1/2) / n), so going down in k goes forward in time
+        // (that's row 1 of cosines, which a degree 0 ephemeris doesn't have)
+        for (int k = n - 1; k >= 0; k--) {
+            advance_simulation_exactly_to(sim, middle + half_length * cos(M_PI * (k + 0.5) / n));
+            for (int b = 0; b < num_bodies; b++) {
+                samples[(b * 3 + 0) * n + k] = bodies->x[b];
+                samples[(b * 3 + 1) * n + k] = bodies->y[b];
+                samples[(b * 3 + 2) * n + k] = bodies->z[b];
+            }
+        }
+
+        double *segment_coefficients = coefficients + (size_t) segment * num_bodies * 3 * n;
+        for (int row = 0; row < num_bodies * 3; row++) {
+            for (int j = 0; j < n; j++) {
+                double sum = 0.0;
+                for (int k = 0; k < n; k++) {
+                    sum += samples[row * n + k] * cosines[j * n + k];
+                }
+                segment_coefficients[row * n + j] = (j == 0 ? 1.0 : 2.0) * sum / n;
+            }
+        }
+    }
+    advance_simulation_exactly_to(sim, ephemeris_end_time(ephemeris));
+
+    free(samples);
+    free(cosines);
+    return ephemeris;
+}
+
+void destroy_ephemeris(Ephemeris **ephemeris) {
+    if (!ephemeris || !(*ephemeris))
+        return;
+
+    if ((*ephemeris)->mapping) {
+        munmap((*ephemeris)->mapping, (*ephemeris)->mapping_size);
+    } else {
+        free((void *) (*ephemeris)->coefficients);
+    }
+    free(*ephemeris);
+    *ephemeris = NULL;
+}
+
+static size_t ephemeris_num_coefficients(const Ephemeris *ephemeris) {
+    return (size_t) ephemeris->num_segments * ephemeris->num_bodies * 3 * (ephemeris->degree + 1);
+}
+
+bool write_ephemeris(const Ephemeris *ephemeris, const char *path) {
+    EphemerisHeader header = { };
+    memcpy(header.magic, EPHEMERIS_MAGIC, sizeof(EPHEMERIS_MAGIC));
+    header.version = EPHEMERIS_VERSION;
+    header.num_bodies = ephemeris->num_bodies;
+    header.num_segments = ephemeris->num_segments;
+    header.degree = ephemeris->degree;
+    header.start_time = ephemeris->start_time;
+    header.segment_length = ephemeris->segment_length;
+
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error: can't open '%s' for writing.\n", path);
+        return false;
+    }
+    size_t num_coefficients = ephemeris_num_coefficients(ephemeris);
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+              fwrite(ephemeris->coefficients, sizeof(double), num_coefficients, f) == num_coefficients;
+    if (fclose(f) != 0) ok = false;
+    if (!ok) {
+        fprintf(stderr, "Error: failed to write the ephemeris to '%s'.\n", path);
+    }
+    return ok;
+}
+
+Ephemeris *load_ephemeris(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: can't open '%s'.\n", path);
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(EphemerisHeader)) {
+        fprintf(stderr, "Error: '%s' is not an ephemeris.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) file_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map '%s'.\n", path);
+        return NULL;
+    }
+
+    const EphemerisHeader *header = (const EphemerisHeader *) mapping;
+    Ephemeris ephemeris = { };
+    ephemeris.num_bodies = header->num_bodies;
+    ephemeris.num_segments = header->num_segments;
+    ephemeris.degree = header->degree;
+    ephemeris.start_time = header->start_time;
+    ephemeris.segment_length = header->segment_length;
+    ephemeris.coefficients = (const double *) (header + 1);
+    ephemeris.mapping = mapping;
+    ephemeris.mapping_size = size;
+
+    if (memcmp(header->magic, EPHEMERIS_MAGIC, sizeof(EPHEMERIS_MAGIC)) != 0) {
+        fprintf(stderr, "Error: '%s' is not an ephemeris.\n", path);
+    } else if (header->version != EPHEMERIS_VERSION) {
+        fprintf(stderr, "Error: '%s' is version %u of the ephemeris format, only %d is supported.\n", path, header->version, EPHEMERIS_VERSION);
+    } else if (ephemeris.num_bodies < 0 || ephemeris.num_segments < 1 || ephemeris.degree < 0 ||
+               ephemeris.degree > EPHEMERIS_MAX_DEGREE || !(ephemeris.segment_length > 0.0) ||
+               sizeof(EphemerisHeader) + ephemeris_num_coefficients(&ephemeris) * sizeof(double) != size) {
+        fprintf(stderr, "Error: '%s' is corrupt.\n", path);
+    } else {
+        Ephemeris *result = (Ephemeris *) malloc(sizeof(Ephemeris));
+        if (result == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the ephemeris.\n");
+            exit(-1);
+        }
+        *result = ephemeris;
+        return result;
+    }
+    munmap(mapping, size);
+    return NULL;
+}
+
+double ephemeris_end_time(const Ephemeris *ephemeris) {
+    return ephemeris->start_time + ephemeris->num_segments * ephemeris->segment_length;
+}
+
+bool evaluate_ephemeris(const Ephemeris *ephemeris, double t, BodyArrays *bodies) {
+    if (bodies->count != ephemeris->num_bodies)
+        return false;
+
+    double segment_time = (t - ephemeris->start_time) / ephemeris->segment_length;
+    // a little slack so that rounding in sim->time doesn't lose the very end
+    if (segment_time < -1e-9 || segment_time > ephemeris->num_segments + 1e-9)
+        return false;
+    int segment = (int) floor(segment_time);
+    if (segment < 0) segment = 0;
+    if (segment >= ephemeris->num_segments) segment = ephemeris->num_segments - 1;
+    double s = fmin(fmax(2.0 * (segment_time - segment) - 1.0, -1.0), 1.0);
+
+    // T_j(s) and their derivatives, T'_j+1 = 2 T_j + 2 s T'_j - T'_j-1
+    int n = ephemeris->degree + 1;
+    double polynomials[EPHEMERIS_MAX_DEGREE + 1];
+    double derivatives[EPHEMERIS_MAX_DEGREE + 1];
+    polynomials[0] = 1.0;
+    derivatives[0] = 0.0;
+    if (n > 1) {
+        polynomials[1] = s;
+        derivatives[1] = 1.0;
+    }
+    for (int j = 2; j < n; j++) {
+        polynomials[j] = 2.0 * s * polynomials[j - 1] - polynomials[j - 2];
+        derivatives[j] = 2.0 * polynomials[j - 1] + 2.0 * s * derivatives[j - 1] - derivatives[j - 2];
+    }
+    double time_scale = 2.0 / ephemeris->segment_length; // ds/dt
+
+    const double *coefficients = ephemeris->coefficients + (size_t) segment * ephemeris->num_bodies * 3 * n;
+    double *positions[3] = { bodies->x, bodies->y, bodies->z };
+    double *velocities[3] = { bodies->vx, bodies->vy, bodies->vz };
+    for (int b = 0; b < ephemeris->num_bodies; b++) {
+        for (int axis = 0; axis < 3; axis++) {
+            const double *c = coefficients + (b * 3 + axis) * n;
+            double position = 0.0, velocity = 0.0;
+            for (int j = 0; j < n; j++) {
+                position += c[j] * polynomials[j];
+                velocity += c[j] * derivatives[j];
+            }
+            positions[axis][b] = position;
+            velocities[axis][b] = velocity * time_scale;
+        }
+    }
+    return true;
+}
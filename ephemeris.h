@@ -0,0 +1,60 @@
+#ifndef EPHEMERIS_H
+#define EPHEMERIS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Piecewise Chebyshev fit of the trajectories of the bodies, so that runs that only care about test
+// particles don't have to integrate the planets again. Only positions are stored, velocities come from
+// the derivative of the same polynomials.
+//
+// File layout (native endianness): an EphemerisHeader, then for every segment, every body and every axis
+// degree + 1 doubles, lowest order first. It's meant to be mmapped as is.
+
+#define EPHEMERIS_MAGIC "LGEPHEM"
+#define EPHEMERIS_VERSION 1
+#define EPHEMERIS_MAX_DEGREE 32
+#define DEFAULT_EPHEMERIS_SEGMENT 0.5
+#define DEFAULT_EPHEMERIS_DEGREE 12
+
+struct Simulation;
+struct BodyArrays;
+
+struct EphemerisHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t num_bodies;
+    int32_t num_segments;
+    int32_t degree;
+    double start_time;
+    double segment_length;
+    uint8_t padding[24]; // keeps the coefficients 64 byte aligned
+};
+
+struct Ephemeris {
+    int num_bodies;
+    int num_segments;
+    int degree;
+    double start_time;
+    double segment_length;
+    const double *coefficients;
+
+    void *mapping; // the whole file when it was loaded with load_ephemeris, NULL when it was built
+    size_t mapping_size;
+};
+
+// integrates sim from sim->time to end_time with its own integrator, sampling every segment at its
+// chebyshev nodes. sim ends up at end_time.
+Ephemeris *build_ephemeris(Simulation *sim, double end_time, double segment_length, int degree);
+void destroy_ephemeris(Ephemeris **ephemeris);
+
+// both print what went wrong and return false / NULL
+bool write_ephemeris(const Ephemeris *ephemeris, const char *path);
+Ephemeris *load_ephemeris(const char *path);
+
+double ephemeris_end_time(const Ephemeris *ephemeris);
+// writes the positions and velocities of every body at time t, false if t is outside the fit
+// or bodies doesn't have as many bodies
+bool evaluate_ephemeris(const Ephemeris *ephemeris, double t, BodyArrays *bodies);
+
+#endif
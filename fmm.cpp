@@ -0,0 +1,456 @@
+#include "fmm.h"
+#include "barnes_hut.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <mutex>
+
+/*
+ * Notation: n, k and l are multi-indices (n_x, n_y, n_z), |n| = n_x + n_y + n_z, d^n = d_x^n_x * d_y^n_y * d_z^n_z
+ * and binomials of multi-indices are the product of the binomials of each component.
+ *
+ * The Taylor coefficients of the kernel are a_n(R) = (-1)^|n| / n! * D^n (1 / |R|), so that
+ *     1 / |x - y| = sum_n a_n(x - c) (y - c)^n
+ * A cell centered at c (its center of mass) keeps the multipoles M_n = sum_j m_j (y_j - c)^n, and a cell
+ * centered at z keeps the local expansion L_l such that the potential inside it is sum_l L_l (x - z)^l.
+ *
+ *     M2M: M'_n = sum_{k <= n} binom(n, k) M_k (c - c')^(n - k)
+ *     M2L: L_l += -G (-1)^|l| sum_n binom(n + l, l) M_n a_{n + l}(z - c), for |n| + |l| <= order
+ *          and since a_n(-R) = (-1)^|n| a_n(R), the opposite direction reuses the same coefficients
+ *     L2L: L'_k = sum_{l >= k} binom(l, k) L_l (z' - z)^(l - k)
+ *     L2P: acceleration_i = -sum_l l_i L_l (x - z)^(l - e_i)
+ *
+ * Cells interact mutually through a dual tree walk (Dehnen 2002), which is what makes the method O(N).
+ */
+
+static int multi_indices[FMM_MAX_COEFFICIENTS][3];
+static int coefficient_index[FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1][FMM_MAX_ORDER + 1];
+static double binomials[2 * FMM_MAX_ORDER + 1][2 * FMM_MAX_ORDER + 1];
+static std::once_flag tables_initialized; // ensemble members create their trees on several threads at once
+
+// every (n, l) pair of the M2L sum, sorted by |n| + |l| so that the terms of any order are a prefix
+struct M2LTerm {
+    short n, l, n_plus_l;
+    double binomial_n; // binom(n + l, l) (-1)^|n|, for the local of the source cell
+    double binomial_l; // binom(n + l, l) (-1)^|l|, for the local of the target cell
+};
+#define FMM_MAX_M2L_TERMS 3003 // (FMM_MAX_ORDER + 6)! / (FMM_MAX_ORDER! 6!)
+static M2LTerm m2l_terms[FMM_MAX_M2L_TERMS];
+static int num_m2l_terms_for_order[FMM_MAX_ORDER + 1];
+
+static void init_tables() {
+    // ordered by |n|, so the coefficients up to any order are a prefix of the array
+    int index = 0;
+    for (int order = 0; order <= FMM_MAX_ORDER; order++) {
+        for (int a = order; a >= 0; a--) {
+            for (int b = order - a; b >= 0; b--) {
+                int c = order - a - b;
+                multi_indices[index][0] = a;
+                multi_indices[index][1] = b;
+                multi_indices[index][2] = c;
+                coefficient_index[a][b][c] = index;
+                index++;
+            }
+        }
+    }
+
+    for (int n = 0; n <= 2 * FMM_MAX_ORDER; n++) {
+        binomials[n][0] = 1.0;
+        for (int k = 1; k <= n; k++) {
+            binomials[n][k] = binomials[n - 1][k - 1] + (k < n ? binomials[n - 1][k] : 0.0);
+        }
+    }
+
+    int num_terms = 0;
+    for (int order = 0; order <= FMM_MAX_ORDER; order++) {
+        for (int n = 0; n < FMM_MAX_COEFFICIENTS; n++) {
+            for (int l = 0; l < FMM_MAX_COEFFICIENTS; l++) {
+                const int *n_index = multi_indices[n];
+                const int *l_index = multi_indices[l];
+                if (n_index[0] + n_index[1] + n_index[2] + l_index[0] + l_index[1] + l_index[2] != order) continue;
+
+                int n_plus_l[3] = { n_index[0] + l_index[0], n_index[1] + l_index[1], n_index[2] + l_index[2] };
+                double binomial = binomials[n_plus_l[0]][l_index[0]] * binomials[n_plus_l[1]][l_index[1]] * binomials[n_plus_l[2]][l_index[2]];
+                M2LTerm term;
+                term.n = (short) n;
+                term.l = (short) l;
+                term.n_plus_l = (short) coefficient_index[n_plus_l[0]][n_plus_l[1]][n_plus_l[2]];
+                term.binomial_n = (n_index[0] + n_index[1] + n_index[2]) & 1 ? -binomial : binomial;
+                term.binomial_l = (l_index[0] + l_index[1] + l_index[2]) & 1 ? -binomial : binomial;
+                m2l_terms[num_terms++] = term;
+            }
+        }
+        num_m2l_terms_for_order[order] = num_terms;
+    }
+}
+
+static inline int num_coefficients_for(int order) {
+    return (order + 1) * (order + 2) * (order + 3) / 6;
+}
+
+static inline int order_of(const int *n) {
+    return n[0] + n[1] + n[2];
+}
+
+// d^n for every multi-index up to order
+static void compute_powers(glm::dvec3 d, int order, double *powers) {
+    double p[3][FMM_MAX_ORDER + 1];
+    for (int axis = 0; axis < 3; axis++) {
+        p[axis][0] = 1.0;
+        for (int k = 1; k <= order; k++) p[axis][k] = p[axis][k - 1] * d[axis];
+    }
+    for (int k = 0; k < num_coefficients_for(order); k++) {
+        const int *n = multi_indices[k];
+        powers[k] = p[0][n[0]] * p[1][n[1]] * p[2][n[2]];
+    }
+}
+
+// a_n(R) through the recurrence |n| R^2 a_n = (2|n| - 1) sum_i R_i a_{n - e_i} - (|n| - 1) sum_i a_{n - 2 e_i}
+static void compute_taylor_coefficients(glm::dvec3 R, int order, double *a) {
+    double distance_squared = glm::dot(R, R);
+    a[0] = 1.0 / sqrt(distance_squared);
+
+    for (int k = 1; k < num_coefficients_for(order); k++) {
+        const int *n = multi_indices[k];
+        int n_order = order_of(n);
+        double sum = 0.0;
+        for (int axis = 0; axis < 3; axis++) {
+            int m[3] = { n[0], n[1], n[2] };
+            if (m[axis] >= 1) {
+                m[axis] -= 1;
+                sum += (2 * n_order - 1) * R[axis] * a[coefficient_index[m[0]][m[1]][m[2]]];
+            }
+            if (m[axis] >= 1) {
+                m[axis] -= 1;
+                sum -= (n_order - 1) * a[coefficient_index[m[0]][m[1]][m[2]]];
+            }
+        }
+        a[k] = sum / (n_order * distance_squared);
+    }
+}
+
+static inline double multi_binomial(const int *n, const int *k) {
+    return binomials[n[0]][k[0]] * binomials[n[1]][k[1]] * binomials[n[2]][k[2]];
+}
+
+FmmTree *create_fmm_tree() {
+    std::call_once(tables_initialized, init_tables);
+
+    FmmTree *tree = (FmmTree *) calloc(1, sizeof(FmmTree));
+    if (tree == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the fmm tree.\n");
+        exit(-1);
+    }
+    tree->octree = create_barnes_hut_tree();
+    return tree;
+}
+
+void destroy_fmm_tree(FmmTree **tree) {
+    if (!tree || !(*tree))
+        return;
+
+    destroy_barnes_hut_tree(&(*tree)->octree);
+    free((*tree)->radii);
+    free((*tree)->multipoles);
+    free((*tree)->locals);
+    free((*tree)->leaves);
+    free((*tree)->neighbor_offsets);
+    free((*tree)->neighbors);
+    free((*tree)->leaf_pairs);
+    free(*tree);
+    *tree = NULL;
+}
+
+static void reserve_expansions(FmmTree *tree, int num_nodes) {
+    if (num_nodes <= tree->max_nodes)
+        return;
+
+    tree->radii = (double *) realloc(tree->radii, num_nodes * sizeof(double));
+    tree->multipoles = (double *) realloc(tree->multipoles, num_nodes * FMM_MAX_COEFFICIENTS * sizeof(double));
+    tree->locals = (double *) realloc(tree->locals, num_nodes * FMM_MAX_COEFFICIENTS * sizeof(double));
+    tree->leaves = (int *) realloc(tree->leaves, num_nodes * sizeof(int));
+    tree->neighbor_offsets = (int *) realloc(tree->neighbor_offsets, (num_nodes + 1) * sizeof(int));
+    if (tree->radii == NULL || tree->multipoles == NULL || tree->locals == NULL || tree->leaves == NULL || tree->neighbor_offsets == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for fmm expansions.\n");
+        exit(-1);
+    }
+    tree->max_nodes = num_nodes;
+}
+
+// P2M at the leaves and M2M everywhere else, children always come after their parent in the node array
+static void upward_pass(FmmTree *tree, const BodyArrays *bodies) {
+    const BarnesHutTree *octree = tree->octree;
+    int num_coefficients = tree->num_coefficients;
+    double powers[FMM_MAX_COEFFICIENTS];
+
+    for (int node_index = octree->num_nodes - 1; node_index >= 0; node_index--) {
+        const OctreeNode *node = &octree->nodes[node_index];
+        double *multipoles = tree->multipoles + node_index * FMM_MAX_COEFFICIENTS;
+        double radius = 0.0;
+        memset(multipoles, 0, num_coefficients * sizeof(double));
+
+        if (node->first_child == -1) {
+            for (int k = node->first_body; k < node->first_body + node->num_bodies; k++) {
+                int b = octree->body_indices[k];
+                glm::dvec3 d = get_position(bodies, b) - node->center_of_mass;
+                radius = fmax(radius, glm::length(d));
+                compute_powers(d, tree->order, powers);
+                for (int n = 0; n < num_coefficients; n++) multipoles[n] += bodies->mass[b] * powers[n];
+            }
+        } else {
+            for (int child_index = node->first_child; child_index < node->first_child + node->num_children; child_index++) {
+                const OctreeNode *child = &octree->nodes[child_index];
+                const double *child_multipoles = tree->multipoles + child_index * FMM_MAX_COEFFICIENTS;
+                glm::dvec3 d = child->center_of_mass - node->center_of_mass;
+                radius = fmax(radius, glm::length(d) + tree->radii[child_index]);
+                compute_powers(d, tree->order, powers);
+
+                for (int n = 0; n < num_coefficients; n++) {
+                    const int *n_index = multi_indices[n];
+                    double sum = 0.0;
+                    for (int kx = 0; kx <= n_index[0]; kx++) {
+                        for (int ky = 0; ky <= n_index[1]; ky++) {
+                            for (int kz = 0; kz <= n_index[2]; kz++) {
+                                int k_index[3] = { kx, ky, kz };
+                                sum += multi_binomial(n_index, k_index) * child_multipoles[coefficient_index[kx][ky][kz]]
+                                     * powers[coefficient_index[n_index[0] - kx][n_index[1] - ky][n_index[2] - kz]];
+                            }
+                        }
+                    }
+                    multipoles[n] += sum;
+                }
+            }
+        }
+
+        tree->radii[node_index] = radius;
+    }
+}
+
+// M2L in both directions between two well separated cells
+static void multipole_to_local(FmmTree *tree, int a, int b, double gravitational_constant) {
+    const BarnesHutTree *octree = tree->octree;
+    const double *multipoles_a = tree->multipoles + a * FMM_MAX_COEFFICIENTS;
+    const double *multipoles_b = tree->multipoles + b * FMM_MAX_COEFFICIENTS;
+    double taylor[FMM_MAX_COEFFICIENTS];
+    double locals_a[FMM_MAX_COEFFICIENTS] = { };
+    double locals_b[FMM_MAX_COEFFICIENTS] = { };
+
+    compute_taylor_coefficients(octree->nodes[a].center_of_mass - octree->nodes[b].center_of_mass, tree->order, taylor);
+
+    for (int k = 0; k < num_m2l_terms_for_order[tree->order]; k++) {
+        const M2LTerm *term = &m2l_terms[k];
+        locals_a[term->l] += term->binomial_l * multipoles_b[term->n] * taylor[term->n_plus_l];
+        locals_b[term->l] += term->binomial_n * multipoles_a[term->n] * taylor[term->n_plus_l];
+    }
+
+    double *target_a = tree->locals + a * FMM_MAX_COEFFICIENTS;
+    double *target_b = tree->locals + b * FMM_MAX_COEFFICIENTS;
+    for (int l = 0; l < tree->num_coefficients; l++) {
+        target_a[l] -= gravitational_constant * locals_a[l];
+        target_b[l] -= gravitational_constant * locals_b[l];
+    }
+}
+
+static void add_leaf_pair(FmmTree *tree, int a, int b) {
+    if (tree->num_leaf_pairs == tree->max_leaf_pairs) {
+        tree->max_leaf_pairs = tree->max_leaf_pairs ? 2 * tree->max_leaf_pairs : 1024;
+        tree->leaf_pairs = (int *) realloc(tree->leaf_pairs, 2 * tree->max_leaf_pairs * sizeof(int));
+        if (tree->leaf_pairs == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the fmm leaf pairs.\n");
+            exit(-1);
+        }
+    }
+    tree->leaf_pairs[2 * tree->num_leaf_pairs] = a;
+    tree->leaf_pairs[2 * tree->num_leaf_pairs + 1] = b;
+    tree->num_leaf_pairs++;
+}
+
+// turns the pairs of the walk into the neighbors of every leaf, both ways
+static void build_neighbor_lists(FmmTree *tree) {
+    int num_nodes = tree->octree->num_nodes;
+    int *offsets = tree->neighbor_offsets;
+    memset(offsets, 0, (num_nodes + 1) * sizeof(int));
+    for (int p = 0; p < tree->num_leaf_pairs; p++) {
+        int a = tree->leaf_pairs[2 * p], b = tree->leaf_pairs[2 * p + 1];
+        offsets[a + 1]++;
+        if (a != b) offsets[b + 1]++;
+    }
+    for (int node_index = 0; node_index < num_nodes; node_index++) {
+        offsets[node_index + 1] += offsets[node_index];
+    }
+
+    if (offsets[num_nodes] > tree->max_neighbors) {
+        tree->max_neighbors = offsets[num_nodes];
+        tree->neighbors = (int *) realloc(tree->neighbors, tree->max_neighbors * sizeof(int));
+        if (tree->neighbors == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the fmm neighbor lists.\n");
+            exit(-1);
+        }
+    }
+    // filled from the back of every range, the end of a range ends up at the start of it, one slot too far up
+    int num_neighbors = offsets[num_nodes];
+    for (int p = 0; p < tree->num_leaf_pairs; p++) {
+        int a = tree->leaf_pairs[2 * p], b = tree->leaf_pairs[2 * p + 1];
+        tree->neighbors[--offsets[a + 1]] = b;
+        if (a != b) tree->neighbors[--offsets[b + 1]] = a;
+    }
+    for (int node_index = 0; node_index < num_nodes; node_index++) {
+        offsets[node_index] = offsets[node_index + 1];
+    }
+    offsets[num_nodes] = num_neighbors;
+}
+
+// M2L for the cells that are far enough apart, the pairs of leaves that aren't are left for the direct sums
+static void interact(FmmTree *tree, int a, int b, double opening_angle, double gravitational_constant) {
+    const BarnesHutTree *octree = tree->octree;
+    const OctreeNode *node_a = &octree->nodes[a];
+    const OctreeNode *node_b = &octree->nodes[b];
+
+    if (node_a->mass == 0.0 && node_b->mass == 0.0)
+        return;
+
+    if (a != b) {
+        double distance = glm::length(node_a->center_of_mass - node_b->center_of_mass);
+        if (tree->radii[a] + tree->radii[b] < opening_angle * distance) {
+            multipole_to_local(tree, a, b, gravitational_constant);
+            return;
+        }
+    }
+
+    bool a_is_leaf = node_a->first_child == -1;
+    bool b_is_leaf = node_b->first_child == -1;
+
+    if (a_is_leaf && b_is_leaf) {
+        add_leaf_pair(tree, a, b);
+    } else if (a == b) {
+        // every unordered pair of children, plus each child with itself
+        for (int i = node_a->first_child; i < node_a->first_child + node_a->num_children; i++) {
+            for (int j = i; j < node_a->first_child + node_a->num_children; j++) {
+                interact(tree, i, j, opening_angle, gravitational_constant);
+            }
+        }
+    } else if (!a_is_leaf && (b_is_leaf || tree->radii[a] >= tree->radii[b])) {
+        for (int i = node_a->first_child; i < node_a->first_child + node_a->num_children; i++) {
+            interact(tree, i, b, opening_angle, gravitational_constant);
+        }
+    } else {
+        for (int j = node_b->first_child; j < node_b->first_child + node_b->num_children; j++) {
+            interact(tree, a, j, opening_angle, gravitational_constant);
+        }
+    }
+}
+
+// L2L into the children, and the list of leaves for the L2P
+static void downward_pass(FmmTree *tree) {
+    const BarnesHutTree *octree = tree->octree;
+    int num_coefficients = tree->num_coefficients;
+    double powers[FMM_MAX_COEFFICIENTS];
+
+    tree->num_leaves = 0;
+    for (int node_index = 0; node_index < octree->num_nodes; node_index++) {
+        const OctreeNode *node = &octree->nodes[node_index];
+        const double *locals = tree->locals + node_index * FMM_MAX_COEFFICIENTS;
+
+        if (node->first_child == -1) {
+            tree->leaves[tree->num_leaves++] = node_index;
+            continue;
+        }
+
+        for (int child_index = node->first_child; child_index < node->first_child + node->num_children; child_index++) {
+            double *child_locals = tree->locals + child_index * FMM_MAX_COEFFICIENTS;
+            compute_powers(octree->nodes[child_index].center_of_mass - node->center_of_mass, tree->order, powers);
+
+            for (int k = 0; k < num_coefficients; k++) {
+                const int *k_index = multi_indices[k];
+                double sum = 0.0;
+                for (int l = k; l < num_coefficients; l++) {
+                    const int *l_index = multi_indices[l];
+                    if (l_index[0] < k_index[0] || l_index[1] < k_index[1] || l_index[2] < k_index[2]) continue;
+                    sum += multi_binomial(l_index, k_index) * locals[l]
+                         * powers[coefficient_index[l_index[0] - k_index[0]][l_index[1] - k_index[1]][l_index[2] - k_index[2]]];
+                }
+                child_locals[k] += sum;
+            }
+        }
+    }
+}
+
+void prepare_fmm_accelerations(FmmTree *tree, const BodyArrays *bodies, int order, double opening_angle,
+                               double gravitational_constant) {
+    memset(bodies->ax, 0, bodies->count * sizeof(double));
+    memset(bodies->ay, 0, bodies->count * sizeof(double));
+    memset(bodies->az, 0, bodies->count * sizeof(double));
+    tree->num_leaves = 0;
+    if (bodies->count == 0)
+        return;
+
+    if (order < 1) order = 1;
+    if (order > FMM_MAX_ORDER) order = FMM_MAX_ORDER;
+    tree->order = order;
+    tree->num_coefficients = num_coefficients_for(order);
+
+    build_barnes_hut_tree(tree->octree, bodies, opening_angle, FMM_LEAF_SIZE);
+    reserve_expansions(tree, tree->octree->num_nodes);
+
+    for (int node_index = 0; node_index < tree->octree->num_nodes; node_index++) {
+        memset(tree->locals + node_index * FMM_MAX_COEFFICIENTS, 0, tree->num_coefficients * sizeof(double));
+    }
+
+    upward_pass(tree, bodies);
+    tree->num_leaf_pairs = 0;
+    interact(tree, 0, 0, opening_angle, gravitational_constant);
+    build_neighbor_lists(tree);
+    downward_pass(tree);
+}
+
+void compute_fmm_leaf_accelerations(const FmmTree *tree, const BodyArrays *bodies, double gravitational_constant, double epsilon,
+                                    int first, int last) {
+    const BarnesHutTree *octree = tree->octree;
+    int num_coefficients = tree->num_coefficients;
+    double powers[FMM_MAX_COEFFICIENTS];
+
+    for (int leaf = first; leaf < last; leaf++) {
+        int node_index = tree->leaves[leaf];
+        const OctreeNode *node = &octree->nodes[node_index];
+        const double *locals = tree->locals + node_index * FMM_MAX_COEFFICIENTS;
+
+        for (int k = node->first_body; k < node->first_body + node->num_bodies; k++) {
+            int i = octree->body_indices[k];
+            glm::dvec3 position_i = get_position(bodies, i);
+            compute_powers(position_i - node->center_of_mass, tree->order, powers);
+
+            // L2P
+            glm::dvec3 acceleration(0.0);
+            for (int l = 1; l < num_coefficients; l++) {
+                const int *l_index = multi_indices[l];
+                for (int axis = 0; axis < 3; axis++) {
+                    if (!l_index[axis]) continue;
+                    int m[3] = { l_index[0], l_index[1], l_index[2] };
+                    m[axis] -= 1;
+                    acceleration[axis] -= l_index[axis] * locals[l] * powers[coefficient_index[m[0]][m[1]][m[2]]];
+                }
+            }
+
+            // the direct sums, one sided so that only this leaf's bodies are written
+            for (int n = tree->neighbor_offsets[node_index]; n < tree->neighbor_offsets[node_index + 1]; n++) {
+                const OctreeNode *neighbor = &octree->nodes[tree->neighbors[n]];
+                for (int k_j = neighbor->first_body; k_j < neighbor->first_body + neighbor->num_bodies; k_j++) {
+                    int j = octree->body_indices[k_j];
+                    if (j == i) continue; // a celestial body isn't affected by its own gravity
+                    glm::dvec3 d = get_position(bodies, j) - position_i;
+                    double distance_squared = glm::dot(d, d);
+                    double distance = sqrt(distance_squared);
+                    acceleration += d * (gravitational_constant * bodies->mass[j] / ((distance_squared + epsilon) * distance));
+                }
+            }
+
+            bodies->ax[i] += acceleration.x;
+            bodies->ay[i] += acceleration.y;
+            bodies->az[i] += acceleration.z;
+        }
+    }
+}
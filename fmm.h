@@ -0,0 +1,53 @@
+#ifndef FMM_H
+#define FMM_H
+
+#include <glm/glm.hpp>
+
+// Cartesian Taylor-series fast multipole method, see fmm.cpp for the expansions
+
+#define FMM_MAX_ORDER 8
+#define FMM_MAX_COEFFICIENTS 165 // number of multi-indices up to FMM_MAX_ORDER
+#define DEFAULT_FMM_ORDER 4
+// bigger leaves than barnes-hut, the direct sums are cheap next to the M2L translations
+#define FMM_LEAF_SIZE 32
+
+struct BodyArrays;
+struct BarnesHutTree;
+
+struct FmmTree {
+    BarnesHutTree *octree; // the same octree the barnes-hut solver uses
+    int order;
+    int num_coefficients;
+
+    // per octree node
+    double *radii; // distance from the center of mass to its furthest body
+    double *multipoles;
+    double *locals;
+    int max_nodes;
+
+    // the leaves, and for each the leaves whose bodies it sums directly (itself included), from the tree walk
+    int *leaves;
+    int num_leaves;
+    int *neighbor_offsets; // per node, neighbors[neighbor_offsets[a]..neighbor_offsets[a + 1]) for leaf a
+    int *neighbors;
+    int max_neighbors;
+    int *leaf_pairs; // what the walk found, each pair once
+    int num_leaf_pairs;
+    int max_leaf_pairs;
+};
+
+FmmTree *create_fmm_tree();
+void destroy_fmm_tree(FmmTree **tree);
+
+// The serial part: builds the tree, P2M/M2M, the dual tree walk with every M2L and L2L down to the leaves.
+// Zeroes bodies->ax/ay/az. order is the expansion order (1..FMM_MAX_ORDER), opening_angle is the cell-cell
+// acceptance criterion (r_a + r_b < opening_angle * distance), both trade speed for accuracy.
+// NOTE: the M2L stays serial, the mutual interactions write the locals of both cells.
+void prepare_fmm_accelerations(FmmTree *tree, const BodyArrays *bodies, int order, double opening_angle,
+                               double gravitational_constant);
+// L2P and the direct sums of the leaves [first, last) of tree->leaves into bodies->ax/ay/az, every leaf only
+// writes its own bodies so ranges can run in parallel
+void compute_fmm_leaf_accelerations(const FmmTree *tree, const BodyArrays *bodies, double gravitational_constant, double epsilon,
+                                    int first, int last);
+
+#endif
@@ -0,0 +1,153 @@
+// Built with -mavx2 -mfma. Only touch plain struct fields here, an inline function from a shared header
+// compiled in this file could be picked by the linker for the whole program and crash older CPUs.
+
+#include "force_simd.h"
+#include "simulation.h"
+
+#include <math.h>
+#include <float.h>
+#include <immintrin.h>
+
+static inline double horizontal_sum(__m256d v) {
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+// There's no double rsqrt before AVX-512, so take the 12 bit float estimate and refine it with three
+// Newton-Raphson steps in double precision. Squared distances outside the float range have no estimate:
+// they're inf as floats or the estimate is, and the steps make it NaN. Either shows up as an inf in
+// *outside, for the caller to check once and redo the lot with exact, a sqrt and a divide, which close
+// encounters and runaway bodies almost never need.
+static inline __m256d inverse_sqrt(__m256d distance_squared, bool exact, __m128 *outside) {
+    if (exact)
+        return _mm256_div_pd(_mm256_set1_pd(1.0), _mm256_sqrt_pd(distance_squared));
+
+    __m256d half_distance_squared = _mm256_mul_pd(_mm256_set1_pd(0.5), distance_squared);
+    __m256d three_halves = _mm256_set1_pd(1.5);
+    __m128 single = _mm256_cvtpd_ps(distance_squared);
+    __m128 estimate = _mm_rsqrt_ps(single);
+    __m256d result = _mm256_cvtps_pd(estimate);
+    for (int k = 0; k < 3; k++) {
+        __m256d y2 = _mm256_mul_pd(result, result);
+        result = _mm256_mul_pd(result, _mm256_fnmadd_pd(half_distance_squared, y2, three_halves));
+    }
+    *outside = _mm_max_ps(*outside, _mm_add_ps(single, estimate));
+    return result;
+}
+
+// the pulls of bodies [first, first + 4 * n) on (x_i, y_i, z_i), 4 bodies at a time, false if some had to be exact
+static inline bool accumulate_vectors(const BodyArrays *bodies, int first, int n, __m256d position_x, __m256d position_y, __m256d position_z,
+                                      __m256d g, __m256d eps, bool exact, __m256d *sum_x, __m256d *sum_y, __m256d *sum_z) {
+    const double *x = bodies->x, *y = bodies->y, *z = bodies->z, *mass = bodies->mass;
+    __m128 outside = _mm_setzero_ps();
+    *sum_x = _mm256_setzero_pd();
+    *sum_y = _mm256_setzero_pd();
+    *sum_z = _mm256_setzero_pd();
+    for (int j = first; j < first + 4 * n; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), position_x);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), position_y);
+        __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(z + j), position_z);
+        __m256d distance_squared = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+        __m256d inverse_distance = inverse_sqrt(distance_squared, exact, &outside);
+
+        __m256d factor = _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(g, _mm256_loadu_pd(mass + j)), inverse_distance),
+                                       _mm256_add_pd(distance_squared, eps));
+        *sum_x = _mm256_fmadd_pd(dx, factor, *sum_x);
+        *sum_y = _mm256_fmadd_pd(dy, factor, *sum_y);
+        *sum_z = _mm256_fmadd_pd(dz, factor, *sum_z);
+    }
+    return !_mm_movemask_ps(_mm_cmp_ps(outside, _mm_set1_ps(FLT_MAX), _CMP_GT_OQ));
+}
+
+// the pulls of bodies [first, last) on (x_i, y_i, z_i)
+static void accumulate_avx2(const BodyArrays *bodies, int first, int last, double x_i, double y_i, double z_i,
+                            double gravitational_constant, double epsilon, double *ax, double *ay, double *az) {
+    const double *x = bodies->x, *y = bodies->y, *z = bodies->z, *mass = bodies->mass;
+    __m256d position_x = _mm256_set1_pd(x_i);
+    __m256d position_y = _mm256_set1_pd(y_i);
+    __m256d position_z = _mm256_set1_pd(z_i);
+    __m256d g = _mm256_set1_pd(gravitational_constant);
+    __m256d eps = _mm256_set1_pd(epsilon);
+    __m256d sum_x, sum_y, sum_z;
+
+    int n = (last - first) / 4;
+    if (!accumulate_vectors(bodies, first, n, position_x, position_y, position_z, g, eps, false, &sum_x, &sum_y, &sum_z)) {
+        accumulate_vectors(bodies, first, n, position_x, position_y, position_z, g, eps, true, &sum_x, &sum_y, &sum_z);
+    }
+    int j = first + 4 * n;
+
+    double partial_x = horizontal_sum(sum_x);
+    double partial_y = horizontal_sum(sum_y);
+    double partial_z = horizontal_sum(sum_z);
+
+    for (; j < last; j++) {
+        double dx = x[j] - x_i, dy = y[j] - y_i, dz = z[j] - z_i;
+        double distance_squared = dx * dx + dy * dy + dz * dz;
+        double factor = gravitational_constant * mass[j] / (sqrt(distance_squared) * (distance_squared + epsilon));
+        partial_x += dx * factor;
+        partial_y += dy * factor;
+        partial_z += dz * factor;
+    }
+
+    *ax += partial_x;
+    *ay += partial_y;
+    *az += partial_z;
+}
+
+void compute_direct_accelerations_avx2(const BodyArrays *bodies, double gravitational_constant, double epsilon, int first, int last) {
+    for (int i = first; i < last; i++) {
+        double ax = 0.0, ay = 0.0, az = 0.0;
+        // a celestial body isn't affected by its own gravity
+        accumulate_avx2(bodies, 0, i, bodies->x[i], bodies->y[i], bodies->z[i], gravitational_constant, epsilon, &ax, &ay, &az);
+        accumulate_avx2(bodies, i + 1, bodies->count, bodies->x[i], bodies->y[i], bodies->z[i], gravitational_constant, epsilon, &ax, &ay, &az);
+        bodies->ax[i] = ax;
+        bodies->ay[i] = ay;
+        bodies->az[i] = az;
+    }
+}
+
+// the pulls on copies k to k + 3 of a body from the same copies of every other body, false if some had to be exact
+static inline bool accumulate_copies(const BodyArrays *lanes, int num_bodies, int num_lanes, int k, __m256d g, __m256d eps, bool exact,
+                                     __m256d *sum_x, __m256d *sum_y, __m256d *sum_z) {
+    const double *x = lanes->x, *y = lanes->y, *z = lanes->z, *mass = lanes->mass;
+    __m256d position_x = _mm256_load_pd(x + k);
+    __m256d position_y = _mm256_load_pd(y + k);
+    __m256d position_z = _mm256_load_pd(z + k);
+    __m128 outside = _mm_setzero_ps();
+    *sum_x = _mm256_setzero_pd();
+    *sum_y = _mm256_setzero_pd();
+    *sum_z = _mm256_setzero_pd();
+    for (int j = k % num_lanes; j < num_bodies * num_lanes; j += num_lanes) {
+        if (j == k) continue;
+        __m256d dx = _mm256_sub_pd(_mm256_load_pd(x + j), position_x);
+        __m256d dy = _mm256_sub_pd(_mm256_load_pd(y + j), position_y);
+        __m256d dz = _mm256_sub_pd(_mm256_load_pd(z + j), position_z);
+        __m256d distance_squared = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dz, dz)));
+        __m256d inverse_distance = inverse_sqrt(distance_squared, exact, &outside);
+
+        __m256d factor = _mm256_div_pd(_mm256_mul_pd(_mm256_mul_pd(g, _mm256_load_pd(mass + j)), inverse_distance),
+                                       _mm256_add_pd(distance_squared, eps));
+        *sum_x = _mm256_fmadd_pd(dx, factor, *sum_x);
+        *sum_y = _mm256_fmadd_pd(dy, factor, *sum_y);
+        *sum_z = _mm256_fmadd_pd(dz, factor, *sum_z);
+    }
+    return !_mm_movemask_ps(_mm_cmp_ps(outside, _mm_set1_ps(FLT_MAX), _CMP_GT_OQ));
+}
+
+// the pulls on 4 copies of body i at a time
+void compute_batch_accelerations_avx2(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon) {
+    __m256d g = _mm256_set1_pd(gravitational_constant);
+    __m256d eps = _mm256_set1_pd(epsilon);
+
+    for (int i = 0; i < num_bodies; i++) {
+        for (int k = i * num_lanes; k < (i + 1) * num_lanes; k += 4) {
+            __m256d sum_x, sum_y, sum_z;
+            if (!accumulate_copies(lanes, num_bodies, num_lanes, k, g, eps, false, &sum_x, &sum_y, &sum_z)) {
+                accumulate_copies(lanes, num_bodies, num_lanes, k, g, eps, true, &sum_x, &sum_y, &sum_z);
+            }
+            _mm256_store_pd(lanes->ax + k, sum_x);
+            _mm256_store_pd(lanes->ay + k, sum_y);
+            _mm256_store_pd(lanes->az + k, sum_z);
+        }
+    }
+}
@@ -0,0 +1,121 @@
+// Built with -mavx512f. Only touch plain struct fields here, an inline function from a shared header
+// compiled in this file could be picked by the linker for the whole program and crash older CPUs.
+
+#include "force_simd.h"
+#include "simulation.h"
+
+#include <math.h>
+#include <immintrin.h>
+
+// the pulls of bodies [first, last) on (x_i, y_i, z_i), 8 bodies at a time
+static void accumulate_avx512(const BodyArrays *bodies, int first, int last, double x_i, double y_i, double z_i,
+                              double gravitational_constant, double epsilon, double *ax, double *ay, double *az) {
+    const double *x = bodies->x, *y = bodies->y, *z = bodies->z, *mass = bodies->mass;
+    __m512d position_x = _mm512_set1_pd(x_i);
+    __m512d position_y = _mm512_set1_pd(y_i);
+    __m512d position_z = _mm512_set1_pd(z_i);
+    __m512d g = _mm512_set1_pd(gravitational_constant);
+    __m512d eps = _mm512_set1_pd(epsilon);
+    __m512d half = _mm512_set1_pd(0.5);
+    __m512d three_halves = _mm512_set1_pd(1.5);
+    __m512d sum_x = _mm512_setzero_pd();
+    __m512d sum_y = _mm512_setzero_pd();
+    __m512d sum_z = _mm512_setzero_pd();
+
+    int j = first;
+    for (; j + 8 <= last; j += 8) {
+        __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(x + j), position_x);
+        __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(y + j), position_y);
+        __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(z + j), position_z);
+        __m512d distance_squared = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+
+        // 14 bit estimate, two Newton-Raphson steps take it to full double precision
+        __m512d inverse_distance = _mm512_rsqrt14_pd(distance_squared);
+        __m512d half_distance_squared = _mm512_mul_pd(half, distance_squared);
+        for (int k = 0; k < 2; k++) {
+            __m512d y2 = _mm512_mul_pd(inverse_distance, inverse_distance);
+            inverse_distance = _mm512_mul_pd(inverse_distance, _mm512_fnmadd_pd(half_distance_squared, y2, three_halves));
+        }
+
+        __m512d factor = _mm512_div_pd(_mm512_mul_pd(_mm512_mul_pd(g, _mm512_loadu_pd(mass + j)), inverse_distance),
+                                       _mm512_add_pd(distance_squared, eps));
+        sum_x = _mm512_fmadd_pd(dx, factor, sum_x);
+        sum_y = _mm512_fmadd_pd(dy, factor, sum_y);
+        sum_z = _mm512_fmadd_pd(dz, factor, sum_z);
+    }
+
+    double partial_x = _mm512_reduce_add_pd(sum_x);
+    double partial_y = _mm512_reduce_add_pd(sum_y);
+    double partial_z = _mm512_reduce_add_pd(sum_z);
+
+    for (; j < last; j++) {
+        double dx = x[j] - x_i, dy = y[j] - y_i, dz = z[j] - z_i;
+        double distance_squared = dx * dx + dy * dy + dz * dz;
+        double factor = gravitational_constant * mass[j] / (sqrt(distance_squared) * (distance_squared + epsilon));
+        partial_x += dx * factor;
+        partial_y += dy * factor;
+        partial_z += dz * factor;
+    }
+
+    *ax += partial_x;
+    *ay += partial_y;
+    *az += partial_z;
+}
+
+void compute_direct_accelerations_avx512(const BodyArrays *bodies, double gravitational_constant, double epsilon, int first, int last) {
+    for (int i = first; i < last; i++) {
+        double ax = 0.0, ay = 0.0, az = 0.0;
+        // a celestial body isn't affected by its own gravity
+        accumulate_avx512(bodies, 0, i, bodies->x[i], bodies->y[i], bodies->z[i], gravitational_constant, epsilon, &ax, &ay, &az);
+        accumulate_avx512(bodies, i + 1, bodies->count, bodies->x[i], bodies->y[i], bodies->z[i], gravitational_constant, epsilon, &ax, &ay, &az);
+        bodies->ax[i] = ax;
+        bodies->ay[i] = ay;
+        bodies->az[i] = az;
+    }
+}
+
+// the pulls on 8 copies of body i at a time
+void compute_batch_accelerations_avx512(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon) {
+    const double *x = lanes->x, *y = lanes->y, *z = lanes->z, *mass = lanes->mass;
+    __m512d g = _mm512_set1_pd(gravitational_constant);
+    __m512d eps = _mm512_set1_pd(epsilon);
+    __m512d half = _mm512_set1_pd(0.5);
+    __m512d three_halves = _mm512_set1_pd(1.5);
+
+    for (int i = 0; i < num_bodies; i++) {
+        for (int k = i * num_lanes; k < (i + 1) * num_lanes; k += 8) {
+            __m512d position_x = _mm512_load_pd(x + k);
+            __m512d position_y = _mm512_load_pd(y + k);
+            __m512d position_z = _mm512_load_pd(z + k);
+            __m512d sum_x = _mm512_setzero_pd();
+            __m512d sum_y = _mm512_setzero_pd();
+            __m512d sum_z = _mm512_setzero_pd();
+
+            // the same copies of every other body
+            for (int j = k % num_lanes; j < num_bodies * num_lanes; j += num_lanes) {
+                if (j == k) continue;
+                __m512d dx = _mm512_sub_pd(_mm512_load_pd(x + j), position_x);
+                __m512d dy = _mm512_sub_pd(_mm512_load_pd(y + j), position_y);
+                __m512d dz = _mm512_sub_pd(_mm512_load_pd(z + j), position_z);
+                __m512d distance_squared = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dz, dz)));
+
+                __m512d inverse_distance = _mm512_rsqrt14_pd(distance_squared);
+                __m512d half_distance_squared = _mm512_mul_pd(half, distance_squared);
+                for (int n = 0; n < 2; n++) {
+                    __m512d y2 = _mm512_mul_pd(inverse_distance, inverse_distance);
+                    inverse_distance = _mm512_mul_pd(inverse_distance, _mm512_fnmadd_pd(half_distance_squared, y2, three_halves));
+                }
+
+                __m512d factor = _mm512_div_pd(_mm512_mul_pd(_mm512_mul_pd(g, _mm512_load_pd(mass + j)), inverse_distance),
+                                               _mm512_add_pd(distance_squared, eps));
+                sum_x = _mm512_fmadd_pd(dx, factor, sum_x);
+                sum_y = _mm512_fmadd_pd(dy, factor, sum_y);
+                sum_z = _mm512_fmadd_pd(dz, factor, sum_z);
+            }
+
+            _mm512_store_pd(lanes->ax + k, sum_x);
+            _mm512_store_pd(lanes->ay + k, sum_y);
+            _mm512_store_pd(lanes->az + k, sum_z);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#include "force_simd.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+SimdLevel detect_simd_level() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+const char *simd_level_name(SimdLevel level) {
+    switch (level) {
+    case SIMD_SCALAR: return "scalar";
+    case SIMD_SSE2: return "sse2";
+    case SIMD_AVX2: return "avx2";
+    case SIMD_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+bool parse_simd_level(const char *name, SimdLevel *level) {
+    if (!strcmp(name, "scalar")) *level = SIMD_SCALAR;
+    else if (!strcmp(name, "sse2")) *level = SIMD_SSE2;
+    else if (!strcmp(name, "avx2")) *level = SIMD_AVX2;
+    else if (!strcmp(name, "avx512")) *level = SIMD_AVX512;
+    else return false;
+    return true;
+}
+
+void compute_direct_accelerations_simd(const BodyArrays *bodies, double gravitational_constant, double epsilon, SimdLevel level,
+                                       int first, int last) {
+    switch (level) {
+    case SIMD_SSE2:
+        compute_direct_accelerations_sse2(bodies, gravitational_constant, epsilon, first, last);
+        break;
+    case SIMD_AVX2:
+        compute_direct_accelerations_avx2(bodies, gravitational_constant, epsilon, first, last);
+        break;
+    case SIMD_AVX512:
+        compute_direct_accelerations_avx512(bodies, gravitational_constant, epsilon, first, last);
+        break;
+    default:
+        fprintf(stderr, "Error: Invalid simd level.\n");
+        exit(-1);
+    }
+}
+
+void compute_batch_accelerations_simd(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon,
+                                      SimdLevel level) {
+    switch (level) {
+    case SIMD_SSE2:
+        compute_batch_accelerations_sse2(lanes, num_bodies, num_lanes, gravitational_constant, epsilon);
+        break;
+    case SIMD_AVX2:
+        compute_batch_accelerations_avx2(lanes, num_bodies, num_lanes, gravitational_constant, epsilon);
+        break;
+    case SIMD_AVX512:
+        compute_batch_accelerations_avx512(lanes, num_bodies, num_lanes, gravitational_constant, epsilon);
+        break;
+    default:
+        fprintf(stderr, "Error: Invalid simd level.\n");
+        exit(-1);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef FORCE_SIMD_H
+#define FORCE_SIMD_H
+
+struct BodyArrays;
+
+// instruction sets the direct force kernel can run on, in increasing order of width
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,   // 2 pairs per instruction
+    SIMD_AVX2,   // 4 pairs per instruction, with FMA
+    SIMD_AVX512, // 8 pairs per instruction
+};
+
+// the widest level this CPU (and OS) can run
+SimdLevel detect_simd_level();
+const char *simd_level_name(SimdLevel level);
+bool parse_simd_level(const char *name, SimdLevel *level);
+
+// same sum as the scalar direct solver, several pairs per instruction, writes bodies->ax/ay/az of the
+// bodies in [first, last) (the pull of every body on them, so separate ranges can run on separate threads).
+// The AVX kernels get 1/r from a hardware rsqrt estimate plus Newton-Raphson instead of a sqrt and a second divide.
+void compute_direct_accelerations_simd(const BodyArrays *bodies, double gravitational_constant, double epsilon, SimdLevel level,
+                                       int first, int last);
+
+// The same sum for copies of one system laid out lane by lane (see EnsembleBatch in ensemble.h): body i of
+// copy k is at i * num_lanes + k in every array of lanes, so a vector holds the same body in 2, 4 or 8 copies
+// and the loop over the bodies never leaves a register half empty. num_lanes must be a multiple of 8.
+void compute_batch_accelerations_simd(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon,
+                                      SimdLevel level);
+
+// one per instruction set, each in its own translation unit built with the matching -m flags,
+// so they must only be called after checking detect_simd_level()
+void compute_direct_accelerations_sse2(const BodyArrays *bodies, double gravitational_constant, double epsilon, int first, int last);
+void compute_direct_accelerations_avx2(const BodyArrays *bodies, double gravitational_constant, double epsilon, int first, int last);
+void compute_direct_accelerations_avx512(const BodyArrays *bodies, double gravitational_constant, double epsilon, int first, int last);
+void compute_batch_accelerations_sse2(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon);
+void compute_batch_accelerations_avx2(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon);
+void compute_batch_accelerations_avx512(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon);
+
+#endif
@@ -0,0 +1,107 @@
+// Built with -msse2, which every x86-64 CPU has.
+
+#include "force_simd.h"
+#include "simulation.h"
+
+#include <math.h>
+#include <emmintrin.h>
+
+static inline double horizontal_sum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+// the pulls of bodies [first, last) on (x_i, y_i, z_i), 2 bodies at a time
+static void accumulate_sse2(const BodyArrays *bodies, int first, int last, double x_i, double y_i, double z_i,
+                            double gravitational_constant, double epsilon, double *ax, double *ay, double *az) {
+    const double *x = bodies->x, *y = bodies->y, *z = bodies->z, *mass = bodies->mass;
+    __m128d position_x = _mm_set1_pd(x_i);
+    __m128d position_y = _mm_set1_pd(y_i);
+    __m128d position_z = _mm_set1_pd(z_i);
+    __m128d g = _mm_set1_pd(gravitational_constant);
+    __m128d eps = _mm_set1_pd(epsilon);
+    __m128d sum_x = _mm_setzero_pd();
+    __m128d sum_y = _mm_setzero_pd();
+    __m128d sum_z = _mm_setzero_pd();
+
+    int j = first;
+    for (; j + 2 <= last; j += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(x + j), position_x);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(y + j), position_y);
+        __m128d dz = _mm_sub_pd(_mm_loadu_pd(z + j), position_z);
+        __m128d distance_squared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+
+        // a float rsqrt refined in double was slower than sqrtpd + divpd here, so keep the exact form
+        __m128d distance = _mm_sqrt_pd(distance_squared);
+        __m128d factor = _mm_div_pd(_mm_mul_pd(g, _mm_loadu_pd(mass + j)),
+                                    _mm_mul_pd(distance, _mm_add_pd(distance_squared, eps)));
+        sum_x = _mm_add_pd(sum_x, _mm_mul_pd(dx, factor));
+        sum_y = _mm_add_pd(sum_y, _mm_mul_pd(dy, factor));
+        sum_z = _mm_add_pd(sum_z, _mm_mul_pd(dz, factor));
+    }
+
+    double partial_x = horizontal_sum(sum_x);
+    double partial_y = horizontal_sum(sum_y);
+    double partial_z = horizontal_sum(sum_z);
+
+    for (; j < last; j++) {
+        double dx = x[j] - x_i, dy = y[j] - y_i, dz = z[j] - z_i;
+        double distance_squared = dx * dx + dy * dy + dz * dz;
+        double factor = gravitational_constant * mass[j] / (sqrt(distance_squared) * (distance_squared + epsilon));
+        partial_x += dx * factor;
+        partial_y += dy * factor;
+        partial_z += dz * factor;
+    }
+
+    *ax += partial_x;
+    *ay += partial_y;
+    *az += partial_z;
+}
+
+void compute_direct_accelerations_sse2(const BodyArrays *bodies, double gravitational_constant, double epsilon, int first, int last) {
+    for (int i = first; i < last; i++) {
+        double ax = 0.0, ay = 0.0, az = 0.0;
+        // a celestial body isn't affected by its own gravity
+        accumulate_sse2(bodies, 0, i, bodies->x[i], bodies->y[i], bodies->z[i], gravitational_constant, epsilon, &ax, &ay, &az);
+        accumulate_sse2(bodies, i + 1, bodies->count, bodies->x[i], bodies->y[i], bodies->z[i], gravitational_constant, epsilon, &ax, &ay, &az);
+        bodies->ax[i] = ax;
+        bodies->ay[i] = ay;
+        bodies->az[i] = az;
+    }
+}
+
+// the pulls on 2 copies of body i at a time
+void compute_batch_accelerations_sse2(BodyArrays *lanes, int num_bodies, int num_lanes, double gravitational_constant, double epsilon) {
+    const double *x = lanes->x, *y = lanes->y, *z = lanes->z, *mass = lanes->mass;
+    __m128d g = _mm_set1_pd(gravitational_constant);
+    __m128d eps = _mm_set1_pd(epsilon);
+
+    for (int i = 0; i < num_bodies; i++) {
+        for (int k = i * num_lanes; k < (i + 1) * num_lanes; k += 2) {
+            __m128d position_x = _mm_load_pd(x + k);
+            __m128d position_y = _mm_load_pd(y + k);
+            __m128d position_z = _mm_load_pd(z + k);
+            __m128d sum_x = _mm_setzero_pd();
+            __m128d sum_y = _mm_setzero_pd();
+            __m128d sum_z = _mm_setzero_pd();
+
+            // the same copies of every other body
+            for (int j = k % num_lanes; j < num_bodies * num_lanes; j += num_lanes) {
+                if (j == k) continue;
+                __m128d dx = _mm_sub_pd(_mm_load_pd(x + j), position_x);
+                __m128d dy = _mm_sub_pd(_mm_load_pd(y + j), position_y);
+                __m128d dz = _mm_sub_pd(_mm_load_pd(z + j), position_z);
+                __m128d distance_squared = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+                __m128d distance = _mm_sqrt_pd(distance_squared);
+                __m128d factor = _mm_div_pd(_mm_mul_pd(g, _mm_load_pd(mass + j)),
+                                            _mm_mul_pd(distance, _mm_add_pd(distance_squared, eps)));
+                sum_x = _mm_add_pd(sum_x, _mm_mul_pd(dx, factor));
+                sum_y = _mm_add_pd(sum_y, _mm_mul_pd(dy, factor));
+                sum_z = _mm_add_pd(sum_z, _mm_mul_pd(dz, factor));
+            }
+
+            _mm_store_pd(lanes->ax + k, sum_x);
+            _mm_store_pd(lanes->ay + k, sum_y);
+            _mm_store_pd(lanes->az + k, sum_z);
+        }
+    }
+}
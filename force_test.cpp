@@ -0,0 +1,96 @@
+// Checks the SIMD direct force kernels against the scalar sum, on separations whose squares are out of
+// float range (where the AVX2 kernel can't use its float rsqrt estimate) as well as ordinary ones.
+// Built and run by make test.
+
+#include "simulation.h"
+#include "force_simd.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#define NUM_TEST_BODIES 19 // more than two vectors of 8 and a remainder
+#define BATCH_LANES 8
+#define FORCE_TOLERANCE 1e-12
+
+// a cluster of bodies 1e-25 apart, one 1e25 apart and one at ordinary distances, mixed within every vector
+static void add_test_bodies(Simulation *sim) {
+    for (int i = 0; i < NUM_TEST_BODIES; i++) {
+        double scale = i % 3 == 0 ? 1e-25 : i % 3 == 1 ? 1e25 : 1.0;
+        glm::dvec3 position(scale * (i / 3 + 1), i % 3 == 2 ? 1.0 : 0.0, 0.0);
+        add_celestial_body(sim, position, glm::dvec3(0.0), 1.0f + i, 0.01f, glm::vec3(1.0f), 1.0, 1.0, -1);
+    }
+}
+
+static bool close_enough(double value, double expected) {
+    return isfinite(value) && fabs(value - expected) <= FORCE_TOLERANCE * fabs(expected) + 1e-300;
+}
+
+static bool check_direct(SimdLevel level, const BodyArrays *expected) {
+    Simulation sim;
+    init_simulation(&sim, 6.0, PHYSICS_STEP);
+    add_test_bodies(&sim);
+    sim.force_mode = FORCE_DIRECT;
+    sim.simd_level = level;
+    compute_accelerations(&sim);
+
+    bool ok = true;
+    for (int i = 0; i < NUM_TEST_BODIES; i++) {
+        if (!close_enough(sim.bodies.ax[i], expected->ax[i]) || !close_enough(sim.bodies.ay[i], expected->ay[i]) ||
+            !close_enough(sim.bodies.az[i], expected->az[i])) {
+            printf("%s: body %d is (%g, %g, %g), should be (%g, %g, %g)\n", simd_level_name(level), i,
+                   sim.bodies.ax[i], sim.bodies.ay[i], sim.bodies.az[i], expected->ax[i], expected->ay[i], expected->az[i]);
+            ok = false;
+        }
+    }
+    destroy_simulation(&sim);
+    return ok;
+}
+
+// the same system in every lane
+static bool check_batch(SimdLevel level, const BodyArrays *expected) {
+    BodyArrays lanes;
+    init_body_arrays(&lanes);
+    reserve_body_arrays(&lanes, NUM_TEST_BODIES * BATCH_LANES);
+    lanes.count = NUM_TEST_BODIES * BATCH_LANES;
+    for (int i = 0; i < NUM_TEST_BODIES; i++) {
+        for (int k = 0; k < BATCH_LANES; k++) {
+            lanes.x[i * BATCH_LANES + k] = expected->x[i];
+            lanes.y[i * BATCH_LANES + k] = expected->y[i];
+            lanes.z[i * BATCH_LANES + k] = expected->z[i];
+            lanes.mass[i * BATCH_LANES + k] = expected->mass[i];
+        }
+    }
+    compute_batch_accelerations_simd(&lanes, NUM_TEST_BODIES, BATCH_LANES, 6.0, GRAVITY_EPSILON, level);
+
+    bool ok = true;
+    for (int i = 0; i < NUM_TEST_BODIES * BATCH_LANES; i++) {
+        int body = i / BATCH_LANES;
+        if (!close_enough(lanes.ax[i], expected->ax[body]) || !close_enough(lanes.ay[i], expected->ay[body]) ||
+            !close_enough(lanes.az[i], expected->az[body])) {
+            printf("%s batch: body %d lane %d is (%g, %g, %g), should be (%g, %g, %g)\n", simd_level_name(level), body, i % BATCH_LANES,
+                   lanes.ax[i], lanes.ay[i], lanes.az[i], expected->ax[body], expected->ay[body], expected->az[body]);
+            ok = false;
+        }
+    }
+    destroy_body_arrays(&lanes);
+    return ok;
+}
+
+int main() {
+    Simulation reference;
+    init_simulation(&reference, 6.0, PHYSICS_STEP);
+    add_test_bodies(&reference);
+    reference.force_mode = FORCE_DIRECT;
+    reference.simd_level = SIMD_SCALAR;
+    compute_accelerations(&reference);
+
+    bool ok = true;
+    for (int level = SIMD_SSE2; level <= detect_simd_level(); level++) {
+        bool level_ok = check_direct((SimdLevel) level, &reference.bodies);
+        level_ok = check_batch((SimdLevel) level, &reference.bodies) && level_ok;
+        printf("%s: %s\n", simd_level_name((SimdLevel) level), level_ok ? "ok" : "FAILED");
+        ok = ok && level_ok;
+    }
+    destroy_simulation(&reference);
+    return ok ? 0 : 1;
+}
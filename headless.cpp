@@ -0,0 +1,411 @@
+// Runs the simulation without a window or a GL context, as fast as the CPU allows.
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <chrono>
+
+#include "simulation.h"
+#include "fmm.h"
+#include "thread_pool.h"
+#include "dopri5.h"
+#include "block_timestep.h"
+#include "ephemeris.h"
+#include "spk.h"
+#include "snapshot.h"
+#include "trajectory.h"
+#include "ensemble.h"
+
+static void print_usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-t sim_time] [-n num_steps] [-r report_interval] [-i integrator] [-dt step] [-tol tolerance]\n"
+            "          [-maxdt block_max_step] [-wh coordinates] [-f force_mode] [-theta opening_angle] [-order fmm_order] [-simd level]\n"
+            "          [-threads num_threads] [-belt num_asteroids] [-tracers num_particles] [-ephem-out file] [-ephem file]\n"
+            "          [-segment length] [-degree degree] [-spk kernel] [-epoch julian_date] [-follow-spk]\n"
+            "          [-load snapshot] [-save snapshot] [-record file] [-record-every num_steps] [-quantum size]\n"
+            "          [-ensemble num_members] [-watch body] [-reference body] [-sigma size] [-vsigma size] [-escape distance]\n"
+            "          [-seed seed] [-lanes num_lanes] [-energy] [-q]\n"
+            "  -t  simulated time to integrate (default: 1000)\n"
+            "  -n  integrate exactly this many steps instead of a time span\n"
+            "  -r  print progress every this much simulated time (default: off)\n"
+            "  -i  euler (default), leapfrog, verlet, yoshida4, yoshida6, dopri5, block or wh (wisdom-holman)\n"
+            "  -dt  physics step, for dopri5 and block only how often to sample the state (default: %f)\n"
+            "  -tol  error tolerance per step for dopri5 (default: %g)\n"
+            "  -maxdt  longest step of a body for block, the others are this over powers of two (default: %g)\n"
+            "  -wh  jacobi or democratic-heliocentric (dh) coordinates for wh (default: dh)\n"
+            "  -f  direct (default), symmetric, barnes-hut or fmm\n"
+            "  -theta  opening angle for barnes-hut and fmm (default: %.2f)\n"
+            "  -order  expansion order for fmm, 1 to %d (default: %d)\n"
+            "  -simd  scalar, sse2, avx2 or avx512 for direct forces (default: %s)\n"
+            "  -threads  threads for the force evaluation, 0 for one per core (default: 1)\n"
+            "  -belt  add this many asteroids between mars and jupiter\n"
+            "  -tracers  add this many massless test particles between mars and jupiter\n"
+            "  -ephem-out  integrate the bodies up to the end time and save them as a chebyshev ephemeris\n"
+            "  -ephem  read the bodies from an ephemeris instead of integrating them while it lasts\n"
+            "  -segment  time span of every chebyshev fit in -ephem-out (default: %g)\n"
+            "  -degree  degree of the chebyshev fits in -ephem-out, up to %d (default: %d)\n"
+            "  -spk  start the planets from a JPL SPK kernel (de440.bsp, ...) instead of the built in positions\n"
+            "  -epoch  TDB julian date of the start for -spk (default: %.1f, J2000)\n"
+            "  -follow-spk  keep reading the planets from the kernel instead of integrating them\n"
+            "  -load  resume from a snapshot, with its integrator and force settings, -t is still the end time\n"
+            "  -save  write a snapshot at the end, and at every -r report while running\n"
+            "  -record  write the trajectories of all the bodies and test particles to a file\n"
+            "  -record-every  only record every this many steps (default: 1)\n"
+            "  -quantum  precision of the recorded positions and velocities (default: %g)\n"
+            "  -ensemble  run this many copies up to -t instead, with the start of -watch perturbed, and count how it leaves -reference\n"
+            "  -watch  the body -ensemble perturbs (default: 8, the lagrange2 marker)\n"
+            "  -reference  the body -ensemble measures the escapes from (default: 3, the earth)\n"
+            "  -sigma  standard deviation of the position offsets of -ensemble (default: %g)\n"
+            "  -vsigma  standard deviation of the velocity offsets of -ensemble (default: 0)\n"
+            "  -escape  distance from -reference that counts as an escape (default: %g times the starting one)\n"
+            "  -seed  of the -ensemble offsets (default: 1)\n"
+            "  -lanes  run the -ensemble members this many at a time, one per SIMD lane (default: 1, one at a time)\n"
+            "  -energy  print the relative energy error at the end\n"
+            "  -q  don't print the final state of the bodies\n",
+            program, (double) PHYSICS_STEP, DEFAULT_DOPRI5_TOLERANCE, DEFAULT_BLOCK_MAX_STEP, DEFAULT_OPENING_ANGLE, FMM_MAX_ORDER, DEFAULT_FMM_ORDER, simd_level_name(detect_simd_level()),
+            DEFAULT_EPHEMERIS_SEGMENT, EPHEMERIS_MAX_DEGREE, DEFAULT_EPHEMERIS_DEGREE, J2000_JULIAN_DATE,
+            DEFAULT_TRAJECTORY_POSITION_QUANTUM, DEFAULT_ENSEMBLE_POSITION_SIGMA, DEFAULT_ENSEMBLE_ESCAPE_FACTOR);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    double sim_time = 1000.0;
+    long long num_steps = -1;
+    double report_interval = 0.0;
+    bool quiet = false;
+    bool report_energy = false;
+    Integrator integrator = INTEGRATOR_EULER;
+    double physics_step = PHYSICS_STEP;
+    double tolerance = DEFAULT_DOPRI5_TOLERANCE;
+    double block_max_step = DEFAULT_BLOCK_MAX_STEP;
+    WhCoordinates wh_coordinates = WH_DEMOCRATIC_HELIOCENTRIC;
+    ForceMode force_mode = FORCE_DIRECT;
+    double opening_angle = DEFAULT_OPENING_ANGLE;
+    int fmm_order = DEFAULT_FMM_ORDER;
+    SimdLevel simd_level = detect_simd_level();
+    int num_threads = 1;
+    int num_asteroids = 0;
+    int num_tracers = 0;
+    const char *ephemeris_out_path = NULL;
+    const char *ephemeris_path = NULL;
+    double ephemeris_segment = DEFAULT_EPHEMERIS_SEGMENT;
+    int ephemeris_degree = DEFAULT_EPHEMERIS_DEGREE;
+    const char *spk_path = NULL;
+    double epoch = J2000_JULIAN_DATE;
+    bool follow_spk = false;
+    const char *load_path = NULL;
+    const char *save_path = NULL;
+    const char *record_path = NULL;
+    int record_interval = 1;
+    double quantum = DEFAULT_TRAJECTORY_POSITION_QUANTUM;
+    EnsembleSettings ensemble_settings = { };
+    ensemble_settings.body = 8;
+    ensemble_settings.reference = 3;
+    ensemble_settings.position_sigma = DEFAULT_ENSEMBLE_POSITION_SIGMA;
+    ensemble_settings.seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            sim_time = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            num_steps = atoll(argv[++i]);
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            report_interval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            if (!parse_integrator(argv[++i], &integrator)) {
+                fprintf(stderr, "Error: unknown integrator '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-dt") && i + 1 < argc) {
+            physics_step = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-tol") && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-maxdt") && i + 1 < argc) {
+            block_max_step = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-wh") && i + 1 < argc) {
+            if (!parse_wh_coordinates(argv[++i], &wh_coordinates)) {
+                fprintf(stderr, "Error: unknown coordinates '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            if (!parse_force_mode(argv[++i], &force_mode)) {
+                fprintf(stderr, "Error: unknown force mode '%s'.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-theta") && i + 1 < argc) {
+            opening_angle = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-order") && i + 1 < argc) {
+            fmm_order = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-simd") && i + 1 < argc) {
+            if (!parse_simd_level(argv[++i], &simd_level)) {
+                fprintf(stderr, "Error: unknown simd level '%s'.\n", argv[i]);
+                return 1;
+            }
+            if (simd_level > detect_simd_level()) {
+                fprintf(stderr, "Error: this CPU doesn't support %s.\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-belt") && i + 1 < argc) {
+            num_asteroids = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-tracers") && i + 1 < argc) {
+            num_tracers = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-ephem-out") && i + 1 < argc) {
+            ephemeris_out_path = argv[++i];
+        } else if (!strcmp(argv[i], "-ephem") && i + 1 < argc) {
+            ephemeris_path = argv[++i];
+        } else if (!strcmp(argv[i], "-segment") && i + 1 < argc) {
+            ephemeris_segment = atof(argv[++i]);
+            if (!(ephemeris_segment > 0.0)) {
+                fprintf(stderr, "Error: the segment length has to be positive.\n");
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-degree") && i + 1 < argc) {
+            ephemeris_degree = atoi(argv[++i]);
+            if (ephemeris_degree < 0 || ephemeris_degree > EPHEMERIS_MAX_DEGREE) {
+                fprintf(stderr, "Error: the degree has to be between 0 and %d.\n", EPHEMERIS_MAX_DEGREE);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-spk") && i + 1 < argc) {
+            spk_path = argv[++i];
+        } else if (!strcmp(argv[i], "-epoch") && i + 1 < argc) {
+            epoch = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-follow-spk")) {
+            follow_spk = true;
+        } else if (!strcmp(argv[i], "-load") && i + 1 < argc) {
+            load_path = argv[++i];
+        } else if (!strcmp(argv[i], "-save") && i + 1 < argc) {
+            save_path = argv[++i];
+        } else if (!strcmp(argv[i], "-record") && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (!strcmp(argv[i], "-record-every") && i + 1 < argc) {
+            record_interval = atoi(argv[++i]);
+            if (record_interval < 1) record_interval = 1;
+        } else if (!strcmp(argv[i], "-quantum") && i + 1 < argc) {
+            quantum = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-ensemble") && i + 1 < argc) {
+            ensemble_settings.num_members = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-watch") && i + 1 < argc) {
+            ensemble_settings.body = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-reference") && i + 1 < argc) {
+            ensemble_settings.reference = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-sigma") && i + 1 < argc) {
+            ensemble_settings.position_sigma = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-vsigma") && i + 1 < argc) {
+            ensemble_settings.velocity_sigma = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-escape") && i + 1 < argc) {
+            ensemble_settings.escape_distance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            ensemble_settings.seed = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "-lanes") && i + 1 < argc) {
+            ensemble_settings.num_lanes = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-energy")) {
+            report_energy = true;
+        } else if (!strcmp(argv[i], "-q")) {
+            quiet = true;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Simulation sim;
+    init_simulation(&sim, 6.0, physics_step);
+    SpkFile *spk = NULL;
+    if (load_path) {
+        Snapshot *snapshot = load_snapshot(load_path);
+        if (!snapshot) return 1;
+        restore_snapshot(&sim, snapshot);
+        destroy_snapshot(&snapshot);
+        printf("resumed from %s at t = %f\n", load_path, sim.time);
+    } else {
+        create_solar_system(&sim);
+    }
+    if (spk_path) {
+        spk = load_spk(spk_path);
+        if (!spk) return 1;
+        double et = (epoch - J2000_JULIAN_DATE) * 86400.0;
+        if (!load_path && !set_bodies_from_spk(&sim, spk, et)) {
+            fprintf(stderr, "Error: %s doesn't cover all the planets at julian date %f.\n", spk_path, epoch);
+            return 1;
+        }
+        if (follow_spk) {
+            sim.spk = spk;
+            sim.spk_epoch = et;
+        }
+    }
+    sim.simd_level = simd_level;
+    set_simulation_threads(&sim, num_threads);
+    // a snapshot brings its own bodies and settings
+    if (!load_path) {
+        add_asteroid_belt(&sim, num_asteroids, 382.0 * 2.2, 382.0 * 3.3, 42);
+        add_test_particle_belt(&sim, num_tracers, 382.0 * 2.2, 382.0 * 3.3, 43);
+        sim.force_mode = force_mode;
+        sim.opening_angle = opening_angle;
+        sim.fmm_order = fmm_order;
+        sim.integrator = integrator;
+        sim.tolerance = tolerance;
+        sim.block_max_step = block_max_step;
+        sim.wh_coordinates = wh_coordinates;
+    }
+    if (sim.force_mode == FORCE_DIRECT) {
+        printf("%d bodies, %s forces (%s), %d threads\n", sim.bodies.count, force_mode_name(sim.force_mode),
+               simd_level_name(sim.simd_level), thread_pool_size(sim.thread_pool));
+    } else {
+        printf("%d bodies, %s forces, %d threads\n", sim.bodies.count, force_mode_name(sim.force_mode), thread_pool_size(sim.thread_pool));
+    }
+    if (sim.test_particles.count) {
+        printf("%d test particles\n", sim.test_particles.count);
+    }
+    if (sim.integrator == INTEGRATOR_WISDOM_HOLMAN) {
+        printf("%s integrator (%s), step %g\n", integrator_name(sim.integrator), wh_coordinates_name(sim.wh_coordinates), sim.physics_step);
+    } else {
+        printf("%s integrator, step %g\n", integrator_name(sim.integrator), sim.physics_step);
+    }
+
+    if (spk) {
+        printf("planets from %s at julian date %f%s, %f days per time unit\n", spk_path, epoch,
+               follow_spk ? " and on" : "", spk_seconds_per_time_unit(&sim) / 86400.0);
+    }
+
+    Ephemeris *ephemeris = NULL;
+    if (ephemeris_path) {
+        ephemeris = load_ephemeris(ephemeris_path);
+        if (!ephemeris) return 1;
+        if (!evaluate_ephemeris(ephemeris, sim.time, &sim.bodies)) {
+            fprintf(stderr, "Error: the ephemeris has %d bodies from t = %f, the simulation has %d at t = %f.\n",
+                    ephemeris->num_bodies, ephemeris->start_time, sim.bodies.count, sim.time);
+            return 1;
+        }
+        sim.ephemeris = ephemeris;
+        printf("bodies from the ephemeris up to t = %f\n", ephemeris_end_time(ephemeris));
+    }
+    double initial_energy = report_energy ? compute_total_energy(&sim) : 0.0;
+
+    if (num_steps >= 0) {
+        sim_time = num_steps * sim.physics_step;
+    }
+
+    if (ensemble_settings.num_members > 0) {
+        int body = ensemble_settings.body, reference = ensemble_settings.reference;
+        if (body < 0 || body >= sim.bodies.count || reference < 0 || reference >= sim.bodies.count || body == reference) {
+            fprintf(stderr, "Error: -watch and -reference have to be two different bodies out of %d.\n", sim.bodies.count);
+            return 1;
+        }
+        ensemble_settings.end_time = sim_time;
+        auto start = std::chrono::steady_clock::now();
+        // every member runs on one thread, so the threads go to the members instead
+        Ensemble *ensemble = run_ensemble(&sim, &ensemble_settings, num_threads);
+        if (!ensemble) return 1;
+        double elapsed = seconds_since(start);
+
+        printf("%d members up to t = %f, body %d perturbed by %g in position and %g in velocity, escapes past %f from body %d\n",
+               ensemble_settings.num_members, sim_time, body, ensemble_settings.position_sigma, ensemble_settings.velocity_sigma,
+               ensemble->settings.escape_distance, reference);
+        for (int k = 0; k < NUM_ENSEMBLE_OUTCOMES; k++) {
+            if (!ensemble->num_outcomes[k]) continue;
+            printf("%-8s %6d (%5.1f%%), mean t = %f, radial offsets from %g to %g\n", ensemble_outcome_name((EnsembleOutcome) k),
+                   ensemble->num_outcomes[k], 100.0 * ensemble->num_outcomes[k] / ensemble_settings.num_members,
+                   ensemble->mean_outcome_time[k], ensemble->min_radial_offset[k], ensemble->max_radial_offset[k]);
+        }
+        if (ensemble->num_outcomes[OUTCOME_INWARD] && ensemble->num_outcomes[OUTCOME_OUTWARD] &&
+            ensemble->max_radial_offset[OUTCOME_INWARD] < ensemble->min_radial_offset[OUTCOME_OUTWARD]) {
+            printf("inward and outward split between radial offsets %g and %g\n",
+                   ensemble->max_radial_offset[OUTCOME_INWARD], ensemble->min_radial_offset[OUTCOME_OUTWARD]);
+        }
+        if (ensemble->settings.num_lanes > 1) {
+            printf("%d lanes per batch (%s)\n", ensemble->settings.num_lanes, simd_level_name(sim.simd_level));
+        }
+        printf("%f s wall clock, %f members/s\n", elapsed, ensemble_settings.num_members / elapsed);
+
+        destroy_ensemble(&ensemble);
+        destroy_simulation(&sim);
+        destroy_ephemeris(&ephemeris);
+        destroy_spk(&spk);
+        return 0;
+    }
+
+    SnapshotWriter *snapshot_writer = save_path ? create_snapshot_writer() : NULL;
+    TrajectoryRecorder *recorder = NULL;
+    if (record_path) {
+        recorder = create_trajectory_recorder(record_path, &sim, quantum, quantum);
+        if (!recorder) return 1;
+        record_trajectory_sample(recorder, &sim); // the starting point
+        sim.recorder = recorder;
+        sim.record_interval = record_interval;
+    }
+    long long first_step = sim.num_steps;
+    auto start = std::chrono::steady_clock::now();
+
+    if (ephemeris_out_path) {
+        ephemeris = build_ephemeris(&sim, sim_time, ephemeris_segment, ephemeris_degree);
+        if (!write_ephemeris(ephemeris, ephemeris_out_path)) return 1;
+        printf("wrote %d segments of degree %d to %s\n", ephemeris->num_segments, ephemeris->degree, ephemeris_out_path);
+    } else if (num_steps >= 0) {
+        step_simulation(&sim, num_steps);
+    } else if (report_interval > 0.0) {
+        for (double t = sim.time + report_interval; sim.time < sim_time; t += report_interval) {
+            advance_simulation_to(&sim, t < sim_time ? t : sim_time);
+            double elapsed = seconds_since(start);
+            printf("t = %f, %lld steps, %f steps/s\n", sim.time, sim.num_steps, (sim.num_steps - first_step) / elapsed);
+            if (t >= sim_time) break;
+            // checkpoint, written while the simulation goes on
+            if (snapshot_writer) save_snapshot(snapshot_writer, &sim, NULL, 0, save_path);
+        }
+    } else {
+        advance_simulation_to(&sim, sim_time);
+    }
+
+    double elapsed = seconds_since(start);
+
+    if (recorder) {
+        sim.recorder = NULL;
+        if (!close_trajectory_recorder(recorder)) return 1;
+        long long num_samples = trajectory_samples_written(recorder);
+        long long num_bytes = trajectory_bytes_written(recorder);
+        double raw_bytes = (double) num_samples * (1 + 6 * (sim.bodies.count + sim.test_particles.count)) * sizeof(double);
+        printf("recorded %lld samples to %s, %f MB, %.1fx smaller than raw doubles, %f s wall clock with the writes\n",
+               num_samples, record_path, num_bytes / 1e6, raw_bytes / num_bytes, seconds_since(start));
+        destroy_trajectory_recorder(&recorder);
+    }
+
+    if (!quiet) {
+        // the belt would drown the interesting bodies
+        for (int i = 0; i < sim.bodies.count - num_asteroids; i++) {
+            printf("body %d: position (%f, %f, %f) velocity (%f, %f, %f)\n", i,
+                   sim.bodies.x[i], sim.bodies.y[i], sim.bodies.z[i],
+                   sim.bodies.vx[i], sim.bodies.vy[i], sim.bodies.vz[i]);
+        }
+    }
+
+    printf("simulated %f time units in %lld steps, %f s wall clock\n", sim.time, sim.num_steps, elapsed);
+    printf("%f steps/s, %fx real time\n", (sim.num_steps - first_step) / elapsed, sim.time / elapsed);
+    if (sim.dopri5) {
+        printf("dopri5: %lld steps accepted, %lld rejected\n", sim.dopri5->num_accepted, sim.dopri5->num_rejected);
+    }
+    if (sim.block_timesteps && sim.block_timesteps->num_block_steps) {
+        printf("block: %lld block steps, %f active bodies on average\n", sim.block_timesteps->num_block_steps,
+               (double) sim.block_timesteps->num_active_total / sim.block_timesteps->num_block_steps);
+    }
+    if (report_energy) {
+        printf("relative energy error %e\n", fabs((compute_total_energy(&sim) - initial_energy) / initial_energy));
+    }
+
+    if (snapshot_writer) {
+        save_snapshot(snapshot_writer, &sim, NULL, 0, save_path);
+        if (!wait_for_snapshot(snapshot_writer)) return 1;
+        printf("saved a snapshot to %s\n", save_path);
+        destroy_snapshot_writer(&snapshot_writer);
+    }
+
+    destroy_simulation(&sim);
+    destroy_ephemeris(&ephemeris);
+    destroy_spk(&spk);
+    return 0;
+}
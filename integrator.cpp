@@ -0,0 +1,180 @@
+#include "integrator.h"
+#include "simulation.h"
+#include "dopri5.h"
+#include "block_timestep.h"
+#include "wisdom_holman.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Yoshida's symmetric compositions of leapfrog, w[0] is the middle substep and the rest mirror around it.
+// 4th order is the triple jump, 6th order is his "solution A".
+static const double yoshida4_w1 = 1.35120719195965763405; // 1 / (2 - 2^(1/3))
+static const double yoshida4_weights[3] = { yoshida4_w1, 1.0 - 2.0 * yoshida4_w1, yoshida4_w1 };
+
+static const double yoshida6_w1 = -1.17767998417887;
+static const double yoshida6_w2 = 0.235573213359357;
+static const double yoshida6_w3 = 0.784513610477560;
+static const double yoshida6_w0 = 1.0 - 2.0 * (yoshida6_w1 + yoshida6_w2 + yoshida6_w3);
+static const double yoshida6_weights[7] = { yoshida6_w3, yoshida6_w2, yoshida6_w1, yoshida6_w0, yoshida6_w1, yoshida6_w2, yoshida6_w3 };
+
+const char *integrator_name(Integrator integrator) {
+    switch (integrator) {
+    case INTEGRATOR_EULER: return "euler";
+    case INTEGRATOR_LEAPFROG: return "leapfrog";
+    case INTEGRATOR_VELOCITY_VERLET: return "verlet";
+    case INTEGRATOR_YOSHIDA4: return "yoshida4";
+    case INTEGRATOR_YOSHIDA6: return "yoshida6";
+    case INTEGRATOR_DOPRI5: return "dopri5";
+    case INTEGRATOR_BLOCK: return "block";
+    case INTEGRATOR_WISDOM_HOLMAN: return "wh";
+    }
+    return "unknown";
+}
+
+bool parse_integrator(const char *name, Integrator *integrator) {
+    if (!strcmp(name, "euler")) *integrator = INTEGRATOR_EULER;
+    else if (!strcmp(name, "leapfrog")) *integrator = INTEGRATOR_LEAPFROG;
+    else if (!strcmp(name, "verlet")) *integrator = INTEGRATOR_VELOCITY_VERLET;
+    else if (!strcmp(name, "yoshida4")) *integrator = INTEGRATOR_YOSHIDA4;
+    else if (!strcmp(name, "yoshida6")) *integrator = INTEGRATOR_YOSHIDA6;
+    else if (!strcmp(name, "dopri5")) *integrator = INTEGRATOR_DOPRI5;
+    else if (!strcmp(name, "block")) *integrator = INTEGRATOR_BLOCK;
+    else if (!strcmp(name, "wh")) *integrator = INTEGRATOR_WISDOM_HOLMAN;
+    else return false;
+    return true;
+}
+
+int integrator_order(Integrator integrator) {
+    switch (integrator) {
+    case INTEGRATOR_EULER: return 1;
+    case INTEGRATOR_LEAPFROG: return 2;
+    case INTEGRATOR_VELOCITY_VERLET: return 2;
+    case INTEGRATOR_YOSHIDA4: return 4;
+    case INTEGRATOR_YOSHIDA6: return 6;
+    case INTEGRATOR_DOPRI5: return 5;
+    case INTEGRATOR_BLOCK: return 4;
+    case INTEGRATOR_WISDOM_HOLMAN: return 2;
+    }
+    return 0;
+}
+
+int integrator_force_evaluations(Integrator integrator) {
+    switch (integrator) {
+    case INTEGRATOR_YOSHIDA4: return 3;
+    case INTEGRATOR_YOSHIDA6: return 7;
+    case INTEGRATOR_DOPRI5: return 6;
+    default: return 1;
+    }
+}
+
+void kick_bodies(BodyArrays *bodies, double h) {
+    for (int i = 0; i < bodies->count; i++) {
+        bodies->vx[i] += bodies->ax[i] * h;
+        bodies->vy[i] += bodies->ay[i] * h;
+        bodies->vz[i] += bodies->az[i] * h;
+    }
+}
+
+void drift_bodies(BodyArrays *bodies, double h) {
+    for (int i = 0; i < bodies->count; i++) {
+        bodies->x[i] += bodies->vx[i] * h;
+        bodies->y[i] += bodies->vy[i] * h;
+        bodies->z[i] += bodies->vz[i] * h;
+    }
+}
+
+// x += v * h + a * h^2 / 2, then v gets the old half of the acceleration average
+static void verlet_drift(BodyArrays *bodies, double h) {
+    double half_h = 0.5 * h;
+    for (int i = 0; i < bodies->count; i++) {
+        bodies->x[i] += (bodies->vx[i] + bodies->ax[i] * half_h) * h;
+        bodies->y[i] += (bodies->vy[i] + bodies->ay[i] * half_h) * h;
+        bodies->z[i] += (bodies->vz[i] + bodies->az[i] * half_h) * h;
+        bodies->vx[i] += bodies->ax[i] * half_h;
+        bodies->vy[i] += bodies->ay[i] * half_h;
+        bodies->vz[i] += bodies->az[i] * half_h;
+    }
+}
+
+static void leapfrog_substep(BodyArrays *bodies, AccelerationFunction accelerations, void *data, double h) {
+    kick_bodies(bodies, 0.5 * h);
+    drift_bodies(bodies, h);
+    accelerations(data);
+    kick_bodies(bodies, 0.5 * h);
+}
+
+// leapfrog substeps back to back, the closing kick of one and the opening kick of the next are one pass
+static void composition_step(BodyArrays *bodies, AccelerationFunction accelerations, void *data,
+                             const double *weights, int num_weights, double delta_time) {
+    kick_bodies(bodies, 0.5 * weights[0] * delta_time);
+    for (int k = 0; k < num_weights; k++) {
+        drift_bodies(bodies, weights[k] * delta_time);
+        accelerations(data);
+        double next_weight = k + 1 < num_weights ? weights[k + 1] : 0.0;
+        kick_bodies(bodies, 0.5 * (weights[k] + next_weight) * delta_time);
+    }
+}
+
+bool integrator_is_fixed_step(Integrator integrator) {
+    return integrator <= INTEGRATOR_YOSHIDA6;
+}
+
+bool integrate_fixed_step(Integrator integrator, BodyArrays *bodies, AccelerationFunction accelerations, void *data, double delta_time) {
+    switch (integrator) {
+    case INTEGRATOR_EULER:
+        // we calculate all the velocities before update the position because it's more stable that way
+        kick_bodies(bodies, delta_time);
+        drift_bodies(bodies, delta_time);
+        accelerations(data);
+        return true;
+    case INTEGRATOR_LEAPFROG:
+        leapfrog_substep(bodies, accelerations, data, delta_time);
+        return true;
+    case INTEGRATOR_VELOCITY_VERLET:
+        verlet_drift(bodies, delta_time);
+        accelerations(data);
+        kick_bodies(bodies, 0.5 * delta_time);
+        return true;
+    case INTEGRATOR_YOSHIDA4:
+        composition_step(bodies, accelerations, data, yoshida4_weights, 3, delta_time);
+        return true;
+    case INTEGRATOR_YOSHIDA6:
+        composition_step(bodies, accelerations, data, yoshida6_weights, 7, delta_time);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void simulation_accelerations(void *data) {
+    compute_accelerations((Simulation *) data);
+}
+
+void integrate_step(Simulation *sim, double delta_time) {
+    if (sim->integrator == INTEGRATOR_DOPRI5) {
+        if (!sim->dopri5) sim->dopri5 = create_dopri5();
+        advance_dopri5(sim->dopri5, sim, sim->time + delta_time, sim->tolerance);
+        return;
+    }
+    if (sim->integrator == INTEGRATOR_BLOCK) {
+        if (!sim->block_timesteps) sim->block_timesteps = create_block_timesteps();
+        advance_block_timesteps(sim->block_timesteps, sim, sim->time + delta_time, sim->block_max_step);
+        return;
+    }
+
+    if (!sim->accelerations_current) {
+        compute_accelerations(sim);
+    }
+
+    if (sim->integrator == INTEGRATOR_WISDOM_HOLMAN) {
+        if (!sim->wisdom_holman) sim->wisdom_holman = create_wisdom_holman();
+        wisdom_holman_step(sim->wisdom_holman, sim, delta_time, sim->wh_coordinates);
+    } else if (!integrate_fixed_step(sim->integrator, &sim->bodies, simulation_accelerations, sim, delta_time)) {
+        fprintf(stderr, "Error: Invalid integrator.\n");
+        exit(-1);
+    }
+
+    sim->accelerations_current = true;
+}
@@ -0,0 +1,49 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+struct Simulation;
+struct BodyArrays;
+
+// The fixed step integrators are all symplectic, they differ in order (how fast the error drops with the step) and
+// in how many force evaluations a step costs. They all start a step with the accelerations of the current positions
+// and leave the ones of the new positions behind, so the last evaluation of a step is reused by the next one.
+enum Integrator {
+    INTEGRATOR_EULER,           // semi-implicit euler: kick, drift. 1st order, 1 force evaluation per step
+    INTEGRATOR_LEAPFROG,        // kick-drift-kick leapfrog, 2nd order, 1 evaluation
+    INTEGRATOR_VELOCITY_VERLET, // the same scheme written as x += v dt + a dt^2 / 2, 2nd order, 1 evaluation
+    INTEGRATOR_YOSHIDA4,        // 3 leapfrog substeps, 4th order, 3 evaluations
+    INTEGRATOR_YOSHIDA6,        // 7 leapfrog substeps, 6th order, 7 evaluations
+    // adaptive dormand-prince 5(4), see dopri5.h. Its steps have nothing to do with the physics step,
+    // which only says when to interpolate the state. 6 evaluations per accepted step.
+    INTEGRATOR_DOPRI5,
+    // hermite with a power-of-two step per body, see block_timestep.h. Like dopri5 it runs on its own clock
+    // and the physics step only says when to predict the state, 1 evaluation per active body per block step.
+    INTEGRATOR_BLOCK,
+    // kepler drifts around body 0 between interaction kicks, see wisdom_holman.h. 2nd order in the perturbations,
+    // 1 evaluation per step, but the step can be a good fraction of the shortest orbit around the sun.
+    INTEGRATOR_WISDOM_HOLMAN,
+};
+
+const char *integrator_name(Integrator integrator);
+bool parse_integrator(const char *name, Integrator *integrator);
+int integrator_order(Integrator integrator);
+int integrator_force_evaluations(Integrator integrator);
+
+// advances every body by delta_time with sim->integrator, doesn't touch sim->time
+void integrate_step(Simulation *sim, double delta_time);
+
+// fills the ax/ay/az of the bodies being integrated for their current positions
+typedef void (*AccelerationFunction)(void *data);
+
+// euler up to yoshida6, the ones that only need kicks, drifts and accelerations
+bool integrator_is_fixed_step(Integrator integrator);
+// one step of a fixed step integrator on any set of bodies, which must come with the accelerations of their
+// current positions and leave with the ones of the new positions. false for the other integrators.
+bool integrate_fixed_step(Integrator integrator, BodyArrays *bodies, AccelerationFunction accelerations, void *data, double delta_time);
+
+// v += a * h
+void kick_bodies(BodyArrays *bodies, double h);
+// x += v * h
+void drift_bodies(BodyArrays *bodies, double h);
+
+#endif
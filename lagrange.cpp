@@ -0,0 +1,74 @@
+#include "lagrange.h"
+#include "simulation.h"
+
+#include <math.h>
+
+#define LAGRANGE_MAX_ITERATIONS 50
+
+// Position x along the line through the pair, in units of their distance with the barycenter at 0, the
+// primary at -mu and the secondary at 1 - mu, where gravity and the centrifugal force cancel:
+// x - (1 - mu) (x + mu) / |x + mu|^3 - mu (x - 1 + mu) / |x - 1 + mu|^3 = 0
+static double solve_collinear(double mu, double x) {
+    for (int iteration = 0; iteration < LAGRANGE_MAX_ITERATIONS; iteration++) {
+        double r1 = fabs(x + mu);
+        double r2 = fabs(x - 1.0 + mu);
+        double f = x - (1.0 - mu) * (x + mu) / (r1 * r1 * r1) - mu * (x - 1.0 + mu) / (r2 * r2 * r2);
+        double derivative = 1.0 + 2.0 * (1.0 - mu) / (r1 * r1 * r1) + 2.0 * mu / (r2 * r2 * r2);
+        double step = f / derivative;
+        x -= step;
+        if (fabs(step) < 1e-15 * fabs(x))
+            break;
+    }
+    return x;
+}
+
+void compute_lagrange_point(const Simulation *sim, int primary, int secondary, LagrangePoint point,
+                            glm::dvec3 *position, glm::dvec3 *velocity) {
+    const BodyArrays *bodies = &sim->bodies;
+    double primary_mass = bodies->mass[primary];
+    double secondary_mass = bodies->mass[secondary];
+    double total_mass = primary_mass + secondary_mass;
+    double mu = secondary_mass / total_mass;
+
+    glm::dvec3 separation = get_position(bodies, secondary) - get_position(bodies, primary);
+    glm::dvec3 relative_velocity = get_velocity(bodies, secondary) - get_velocity(bodies, primary);
+    double distance = glm::length(separation);
+    glm::dvec3 barycenter = (get_position(bodies, primary) * primary_mass + get_position(bodies, secondary) * secondary_mass) / total_mass;
+    glm::dvec3 barycenter_velocity = (get_velocity(bodies, primary) * primary_mass + get_velocity(bodies, secondary) * secondary_mass) / total_mass;
+
+    // x towards the secondary, y the way it's moving, normal the axis the pair turns around
+    glm::dvec3 x_axis = separation / distance;
+    glm::dvec3 normal = glm::cross(separation, relative_velocity);
+    if (glm::length(normal) <= 1e-12 * distance * glm::length(relative_velocity)) {
+        normal = glm::dvec3(0.0, -1.0, 0.0);
+    }
+    normal = glm::normalize(normal);
+    glm::dvec3 y_axis = glm::normalize(glm::cross(normal, x_axis));
+
+    // in units of the distance, from the barycenter
+    double x = 0.0, y = 0.0;
+    double hill_radius = cbrt(mu / 3.0); // the collinear points near the secondary are about this far from it
+    switch (point) {
+    case LAGRANGE_L1: x = solve_collinear(mu, 1.0 - mu - hill_radius); break;
+    case LAGRANGE_L2: x = solve_collinear(mu, 1.0 - mu + hill_radius); break;
+    case LAGRANGE_L3: x = solve_collinear(mu, -1.0 - 5.0 * mu / 12.0); break;
+    case LAGRANGE_L4: x = 0.5 - mu; y = sqrt(3.0) / 2.0; break;
+    case LAGRANGE_L5: x = 0.5 - mu; y = -sqrt(3.0) / 2.0; break;
+    }
+
+    glm::dvec3 offset = (x_axis * x + y_axis * y) * distance;
+    double angular_velocity = sqrt(sim->gravitational_constant * total_mass / (distance * distance * distance));
+    *position = barycenter + offset;
+    *velocity = barycenter_velocity + glm::cross(normal, offset) * angular_velocity;
+}
+
+const char *lagrange_point_name(LagrangePoint point) {
+    switch (point) {
+    case LAGRANGE_L1: return "L1";
+    case LAGRANGE_L2: return "L2";
+    case LAGRANGE_L3: return "L3";
+    case LAGRANGE_L4: return "L4";
+    case LAGRANGE_L5: return "L5";
+    }
+    return "unknown";
+}
@@ -0,0 +1,31 @@
+#ifndef LAGRANGE_H
+#define LAGRANGE_H
+
+#include <glm/glm.hpp>
+
+// The five points where a massless body keeps its place relative to two bodies going around their barycenter
+// on circles (the circular restricted three-body problem). L1, L2 and L3 are on the line through the pair,
+// between them, beyond the secondary and beyond the primary; they come from Newton iteration on the balance
+// of the two pulls and the centrifugal force. L4 and L5 are the tips of the equilateral triangles, leading
+// and trailing the secondary. Everything else in the simulation is ignored, so the moon or jupiter still pull
+// a marker away from the collinear points over time.
+
+struct Simulation;
+
+enum LagrangePoint {
+    LAGRANGE_L1,
+    LAGRANGE_L2,
+    LAGRANGE_L3,
+    LAGRANGE_L4,
+    LAGRANGE_L5,
+};
+
+// position of point for the current positions of primary and secondary, and the velocity that co-rotates with
+// them at the angular velocity of a circular orbit at their current distance. The orbital plane is the one of
+// their relative motion, or the plane everything in create_solar_system goes around in if they aren't moving.
+void compute_lagrange_point(const Simulation *sim, int primary, int secondary, LagrangePoint point,
+                            glm::dvec3 *position, glm::dvec3 *velocity);
+
+const char *lagrange_point_name(LagrangePoint point);
+
+#endif
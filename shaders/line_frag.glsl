@@ -0,0 +1,10 @@
+#version 330
+
+flat in vec3 color;
+
+out vec4 frag_color;
+
+void main() {
+    // gamma correction, like the bodies
+    frag_color = vec4(pow(color, vec3(1.0/2.2)), 1.0);
+}
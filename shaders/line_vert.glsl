@@ -0,0 +1,68 @@
+#version 330
+
+// Paths taken, widened on screen: vertices 2i and 2i + 1 of the triangle strip of a path are its point i pushed
+// to either side, across the direction from point i - 1 to point i + 1, by half of line_width pixels. Every
+// path is drawn at once, path p starts at vertex 2 * max_points * p.
+
+uniform mat4 view_proj;
+uniform vec2 viewport;
+uniform float line_width;
+
+// path p draws up to max_points points, all but the last from ring_size * p, a circular buffer of two texels
+// per point: the position relative to the anchor and the position of the anchor
+uniform samplerBuffer points;
+uniform int max_points;
+uniform int ring_size;
+// four texels per path, from paths_offset (the region of this frame): path_start, num_points, dist_scale,
+// anchor_dist_scale, the color and the last point, in the same two texels as in points
+uniform samplerBuffer paths;
+uniform int paths_offset;
+
+flat out vec3 color;
+
+int path;
+int path_start;
+int num_points;
+float dist_scale;
+float anchor_dist_scale;
+
+vec4 project(int i) {
+    i = clamp(i, 0, num_points - 1);
+    vec3 relative, anchor;
+    if (i == num_points - 1) {
+        relative = texelFetch(paths, 4 * (paths_offset + path) + 2).xyz;
+        anchor = texelFetch(paths, 4 * (paths_offset + path) + 3).xyz;
+    } else {
+        int slot = ring_size * path + (path_start + i) % ring_size;
+        relative = texelFetch(points, 2 * slot).xyz;
+        anchor = texelFetch(points, 2 * slot + 1).xyz;
+    }
+    return view_proj * vec4(anchor * anchor_dist_scale + relative * dist_scale, 1.0);
+}
+
+vec2 to_screen(vec4 p) {
+    return p.xy / max(p.w, 1e-6) * viewport;
+}
+
+void main() {
+    path = gl_VertexID / (2 * max_points);
+    vec4 range = texelFetch(paths, 4 * (paths_offset + path));
+    path_start = int(range.x);
+    num_points = int(range.y);
+    dist_scale = range.z;
+    anchor_dist_scale = range.w;
+    color = texelFetch(paths, 4 * (paths_offset + path) + 1).rgb;
+
+    int i = (gl_VertexID - 2 * max_points * path) / 2;
+    float side = gl_VertexID % 2 == 0 ? 1.0 : -1.0;
+
+    vec4 position = project(i);
+    vec2 direction = to_screen(project(i + 1)) - to_screen(project(i - 1));
+    if (dot(direction, direction) < 1e-12) direction = vec2(1.0, 0.0);
+    direction = normalize(direction);
+    vec2 normal = vec2(-direction.y, direction.x);
+
+    // pixels to clip space, undoing the perspective divide
+    position.xy += normal * side * line_width / viewport * position.w;
+    gl_Position = position;
+}
@@ -0,0 +1,645 @@
+#include "simulation.h"
+#include "barnes_hut.h"
+#include "fmm.h"
+#include "thread_pool.h"
+#include "dopri5.h"
+#include "block_timestep.h"
+#include "ephemeris.h"
+#include "spk.h"
+#include "trajectory.h"
+#include "lagrange.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/ext.hpp>
+
+void init_body_arrays(BodyArrays *bodies) {
+    *bodies = { };
+}
+
+void destroy_body_arrays(BodyArrays *bodies) {
+    double **arrays[] = { &bodies->x, &bodies->y, &bodies->z, &bodies->vx, &bodies->vy, &bodies->vz,
+                          &bodies->mass, &bodies->ax, &bodies->ay, &bodies->az };
+    for (double **array : arrays) {
+        free(*array);
+        *array = NULL;
+    }
+    bodies->count = 0;
+    bodies->capacity = 0;
+}
+
+void reserve_body_arrays(BodyArrays *bodies, int capacity) {
+    if (capacity <= bodies->capacity)
+        return;
+
+    // keep the capacity a multiple of a cache line worth of doubles so that aligned_alloc is happy
+    int doubles_per_line = BODY_ARRAY_ALIGNMENT / sizeof(double);
+    capacity = (capacity + doubles_per_line - 1) / doubles_per_line * doubles_per_line;
+
+    double **arrays[] = { &bodies->x, &bodies->y, &bodies->z, &bodies->vx, &bodies->vy, &bodies->vz,
+                          &bodies->mass, &bodies->ax, &bodies->ay, &bodies->az };
+    for (double **array : arrays) {
+        double *grown = (double *) aligned_alloc(BODY_ARRAY_ALIGNMENT, capacity * sizeof(double));
+        if (grown == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for %d bodies.\n", capacity);
+            exit(-1);
+        }
+        if (*array) {
+            memcpy(grown, *array, bodies->count * sizeof(double));
+            free(*array);
+        }
+        memset(grown + bodies->count, 0, (capacity - bodies->count) * sizeof(double));
+        *array = grown;
+    }
+    bodies->capacity = capacity;
+}
+
+void init_simulation(Simulation *sim, double gravitational_constant, double physics_step) {
+    *sim = { };
+    init_body_arrays(&sim->bodies);
+    init_body_arrays(&sim->test_particles);
+    sim->gravitational_constant = gravitational_constant;
+    sim->physics_step = physics_step;
+    sim->force_mode = FORCE_DIRECT;
+    sim->opening_angle = DEFAULT_OPENING_ANGLE;
+    sim->fmm_order = DEFAULT_FMM_ORDER;
+    sim->simd_level = detect_simd_level();
+    sim->integrator = INTEGRATOR_EULER;
+    sim->tolerance = DEFAULT_DOPRI5_TOLERANCE;
+    sim->block_max_step = DEFAULT_BLOCK_MAX_STEP;
+    sim->wh_coordinates = WH_DEMOCRATIC_HELIOCENTRIC;
+    sim->record_interval = 1;
+}
+
+void set_simulation_threads(Simulation *sim, int num_threads) {
+    destroy_thread_pool(&sim->thread_pool);
+    if (num_threads != 1) {
+        sim->thread_pool = create_thread_pool(num_threads);
+    }
+}
+
+// NOTE: the path_taken of every body must be destroyed by whoever created it before calling this
+void destroy_simulation(Simulation *sim) {
+    destroy_body_arrays(&sim->bodies);
+    destroy_body_arrays(&sim->test_particles);
+    free(sim->celestial_bodies);
+    destroy_barnes_hut_tree(&sim->barnes_hut_tree);
+    destroy_fmm_tree(&sim->fmm_tree);
+    destroy_thread_pool(&sim->thread_pool);
+    destroy_dopri5(&sim->dopri5);
+    destroy_block_timesteps(&sim->block_timesteps);
+    destroy_wisdom_holman(&sim->wisdom_holman);
+    free(sim->symmetric_buffers);
+    free(sim->spk_states);
+    free(sim->spk_segments);
+    sim->celestial_bodies = NULL;
+    sim->spk_states = NULL;
+    sim->spk_segments = NULL;
+    sim->spk_scratch_capacity = 0;
+    sim->symmetric_buffers = NULL;
+    sim->symmetric_buffers_size = 0;
+}
+
+void reserve_celestial_bodies(Simulation *sim, int capacity) {
+    if (capacity <= sim->bodies.capacity)
+        return;
+
+    reserve_body_arrays(&sim->bodies, capacity);
+    sim->celestial_bodies = (CelestialBody *) realloc(sim->celestial_bodies, sim->bodies.capacity * sizeof(CelestialBody));
+    if (sim->celestial_bodies == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for %d celestial bodies.\n", capacity);
+        exit(-1);
+    }
+}
+
+int add_celestial_body(Simulation *sim, glm::dvec3 position, glm::dvec3 velocity, float mass, float size, glm::vec3 color,
+                       double minified_size_scale, double minified_dist_scale, int anchor) {
+    BodyArrays *bodies = &sim->bodies;
+    if (bodies->count == bodies->capacity) {
+        reserve_celestial_bodies(sim, bodies->capacity ? bodies->capacity * 2 : 64);
+    }
+
+    int i = bodies->count++;
+    set_position(bodies, i, position);
+    set_velocity(bodies, i, velocity);
+    bodies->mass[i] = mass;
+    sim->accelerations_current = false;
+    sim->test_particle_accelerations_current = false;
+
+    CelestialBody *c = &sim->celestial_bodies[i];
+    c->size = size;
+    c->color = color;
+    c->path_taken = NULL; // the renderer attaches a path if it wants one
+    c->minified_dist_scale = minified_dist_scale;
+    c->minified_size_scale = minified_size_scale;
+    c->anchor = anchor;
+    c->naif_id = 0;
+    c->lagrange_primary = -1;
+
+    return i;
+}
+
+// speed of a circular orbit of body around center
+static double circular_speed(Simulation *sim, int center, int body) {
+    const BodyArrays *bodies = &sim->bodies;
+    return std::sqrt((sim->gravitational_constant * bodies->mass[center]) / (glm::length(get_position(bodies, center) - get_position(bodies, body))));
+}
+
+static void scale_velocity(Simulation *sim, int body, double scale) {
+    set_velocity(&sim->bodies, body, get_velocity(&sim->bodies, body) * scale);
+}
+
+void create_solar_system(Simulation *sim) {
+    // initialize celestial bodies
+    /*
+     * In real life, the gravitational constant is approximately 6*10^(-11).
+     * We can change this in our simulation to get a stronger gravity effect,
+     * since we don't want to wait a whole year for the earth to go around the
+     * sun once.
+     */
+#define SUN_SIZE_SCALE 25.0
+#define ROCKY_SIZE_SCALE 700.0
+#define GASSY_SIZE_SCALE 125.0
+#define SUN_DIST_SCALE 1.0
+#define ROCKY_DIST_SCALE 0.35
+#define MOON_DIST_SCALE 20.0
+#define GASSY_DIST_SCALE 0.155
+    int sun = add_celestial_body(sim, glm::dvec3(0.0), glm::dvec3(0.0), 333000.0, 0.0164 * 100, glm::vec3(0.97f, 0.45f, 0.1f), SUN_SIZE_SCALE, SUN_DIST_SCALE, -1);
+    // TODO: figure out why the game breaks if I put the same distance for two planets (i.e. 382.0)
+    int mercury = add_celestial_body(sim, glm::dvec3(382.0 * 0.4164, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.055, 0.0164 * 0.3829, glm::vec3(0.8f, 0.4f, 0.35f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
+    int venus = add_celestial_body(sim, glm::dvec3(279.48, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.81494, 0.0164 * 0.9499, glm::vec3(0.8f, 0.8f, 0.6f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
+    int earth = add_celestial_body(sim, glm::dvec3(382.0, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 1.0, 0.0164, glm::vec3(0.02f, 0.05f, 1.0f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
+    int moon = add_celestial_body(sim, glm::dvec3(383.0, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.0123, 0.0164 / 3.5, glm::vec3(0.8f, 0.8f, 0.8f), ROCKY_SIZE_SCALE, MOON_DIST_SCALE, earth);
+    int mars = add_celestial_body(sim, glm::dvec3(581.4, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 0.107, 0.0164 * 0.532, glm::vec3(0.95f, 0.25f, 0.2f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, sun);
+    int jupiter = add_celestial_body(sim, glm::dvec3(1938.65, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 317.81, 0.0164 * 10.97, glm::vec3(0.75f, 0.85f, 0.5f), GASSY_SIZE_SCALE, GASSY_DIST_SCALE, sun);
+    int saturn = add_celestial_body(sim, glm::dvec3(382.0 * 10.07, 0.0, 0.0), glm::dvec3(0.0, 0.0, 1.0), 95.159, 0.0164 * 9.1402, glm::vec3(0.75f, 0.85f, 0.5f), GASSY_SIZE_SCALE, GASSY_DIST_SCALE * 0.7, sun);
+    scale_velocity(sim, mercury, circular_speed(sim, sun, mercury) * (3.2/3.0));
+    scale_velocity(sim, venus, circular_speed(sim, sun, venus));
+    scale_velocity(sim, earth, circular_speed(sim, sun, earth));
+    // Why does this work? Sounds like a such a coincidence.
+    scale_velocity(sim, moon, circular_speed(sim, earth, moon) + circular_speed(sim, sun, moon));
+    scale_velocity(sim, mars, circular_speed(sim, sun, mars) * (3.1 / 3.0));
+    scale_velocity(sim, jupiter, circular_speed(sim, sun, jupiter));
+    scale_velocity(sim, saturn, circular_speed(sim, sun, saturn));
+    // the markers go where the sun and the earth put them now that the earth moves
+    add_lagrange_marker(sim, sun, earth, LAGRANGE_L2);
+    add_lagrange_marker(sim, sun, earth, LAGRANGE_L4);
+
+    // so that set_bodies_from_spk can replace all of the above with a real epoch
+    sim->celestial_bodies[sun].naif_id = NAIF_SUN;
+    sim->celestial_bodies[mercury].naif_id = NAIF_MERCURY_BARYCENTER;
+    sim->celestial_bodies[venus].naif_id = NAIF_VENUS_BARYCENTER;
+    sim->celestial_bodies[earth].naif_id = NAIF_EARTH;
+    sim->celestial_bodies[moon].naif_id = NAIF_MOON;
+    sim->celestial_bodies[mars].naif_id = NAIF_MARS_BARYCENTER;
+    sim->celestial_bodies[jupiter].naif_id = NAIF_JUPITER_BARYCENTER;
+    sim->celestial_bodies[saturn].naif_id = NAIF_SATURN_BARYCENTER;
+}
+
+int add_lagrange_marker(Simulation *sim, int primary, int secondary, LagrangePoint point) {
+    glm::dvec3 position, velocity;
+    compute_lagrange_point(sim, primary, secondary, point, &position, &velocity);
+    // L1 and L2 hug the secondary, minified they are drawn around it like a moon
+    bool near_secondary = point == LAGRANGE_L1 || point == LAGRANGE_L2;
+    double minified_dist_scale = near_secondary ? MOON_DIST_SCALE * 0.5 : sim->celestial_bodies[secondary].minified_dist_scale;
+    int marker = add_celestial_body(sim, position, velocity, 0.00001, 0.0164 / 3.5, glm::vec3(0.0f, 1.0f, 0.0f), ROCKY_SIZE_SCALE,
+                                    minified_dist_scale, near_secondary ? secondary : primary);
+    CelestialBody *c = &sim->celestial_bodies[marker];
+    c->lagrange_primary = primary;
+    c->lagrange_secondary = secondary;
+    c->lagrange_point = point;
+    return marker;
+}
+
+void place_lagrange_markers(Simulation *sim) {
+    for (int i = 0; i < sim->bodies.count; i++) {
+        const CelestialBody *c = &sim->celestial_bodies[i];
+        if (c->lagrange_primary == -1) continue;
+        glm::dvec3 position, velocity;
+        compute_lagrange_point(sim, c->lagrange_primary, c->lagrange_secondary, c->lagrange_point, &position, &velocity);
+        set_position(&sim->bodies, i, position);
+        set_velocity(&sim->bodies, i, velocity);
+    }
+    sim->accelerations_current = false;
+    sim->test_particle_accelerations_current = false;
+}
+
+// xorshift64*, good enough for scattering bodies around and reproducible across platforms
+static double random_double(unsigned long long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// a random circular orbit around the first body (the sun), nearly in the orbital plane
+static void random_belt_orbit(Simulation *sim, double inner_radius, double outer_radius, unsigned long long *state,
+                              glm::dvec3 *position, glm::dvec3 *velocity) {
+    int sun = 0;
+    double radius = inner_radius + (outer_radius - inner_radius) * random_double(state);
+    double angle = glm::two_pi<double>() * random_double(state);
+    double height = (random_double(state) - 0.5) * 0.02 * radius;
+
+    glm::dvec3 offset(radius * cos(angle), height, radius * sin(angle));
+    double orbital_velocity_mag = std::sqrt((sim->gravitational_constant * sim->bodies.mass[sun]) / glm::length(offset));
+    *position = get_position(&sim->bodies, sun) + offset;
+    *velocity = get_velocity(&sim->bodies, sun) + glm::cross(glm::normalize(offset), glm::dvec3(0.0, 1.0, 0.0)) * orbital_velocity_mag;
+}
+
+void add_asteroid_belt(Simulation *sim, int num_asteroids, double inner_radius, double outer_radius, unsigned long long seed) {
+    assert(sim->bodies.count > 0);
+    unsigned long long state = seed ? seed : 1;
+
+    reserve_celestial_bodies(sim, sim->bodies.count + num_asteroids);
+
+    for (int i = 0; i < num_asteroids; i++) {
+        glm::dvec3 position, velocity;
+        random_belt_orbit(sim, inner_radius, outer_radius, &state, &position, &velocity);
+        add_celestial_body(sim, position, velocity, 1e-9, 0.0164 / 20.0,
+                           glm::vec3(0.5f, 0.5f, 0.5f), ROCKY_SIZE_SCALE, ROCKY_DIST_SCALE, 0);
+    }
+}
+
+int add_test_particle(Simulation *sim, glm::dvec3 position, glm::dvec3 velocity) {
+    BodyArrays *particles = &sim->test_particles;
+    if (particles->count == particles->capacity) {
+        reserve_body_arrays(particles, particles->capacity ? particles->capacity * 2 : 64);
+    }
+
+    int i = particles->count++;
+    set_position(particles, i, position);
+    set_velocity(particles, i, velocity);
+    particles->mass[i] = 0.0;
+    sim->test_particle_accelerations_current = false;
+    return i;
+}
+
+void add_test_particle_belt(Simulation *sim, int num_particles, double inner_radius, double outer_radius, unsigned long long seed) {
+    assert(sim->bodies.count > 0);
+    unsigned long long state = seed ? seed : 1;
+
+    if (sim->test_particles.count + num_particles > sim->test_particles.capacity) {
+        reserve_body_arrays(&sim->test_particles, sim->test_particles.count + num_particles);
+    }
+
+    for (int i = 0; i < num_particles; i++) {
+        glm::dvec3 position, velocity;
+        random_belt_orbit(sim, inner_radius, outer_radius, &state, &position, &velocity);
+        add_test_particle(sim, position, velocity);
+    }
+}
+
+const char *force_mode_name(ForceMode mode) {
+    switch (mode) {
+    case FORCE_DIRECT: return "direct";
+    case FORCE_SYMMETRIC: return "symmetric";
+    case FORCE_BARNES_HUT: return "barnes-hut";
+    case FORCE_FMM: return "fmm";
+    }
+    return "unknown";
+}
+
+bool parse_force_mode(const char *name, ForceMode *mode) {
+    if (!strcmp(name, "direct")) *mode = FORCE_DIRECT;
+    else if (!strcmp(name, "symmetric")) *mode = FORCE_SYMMETRIC;
+    else if (!strcmp(name, "barnes-hut")) *mode = FORCE_BARNES_HUT;
+    else if (!strcmp(name, "fmm")) *mode = FORCE_FMM;
+    else return false;
+    return true;
+}
+
+// sum of the pulls of bodies [first, last) on the point (x_i, y_i, z_i), written so that it vectorizes
+static inline void accumulate_direct(const BodyArrays *bodies, int first, int last, double x_i, double y_i, double z_i,
+                                     double gravitational_constant, double *ax, double *ay, double *az) {
+    const double *x = bodies->x, *y = bodies->y, *z = bodies->z, *mass = bodies->mass;
+    double sum_x = 0.0, sum_y = 0.0, sum_z = 0.0;
+
+    for (int j = first; j < last; j++) {
+        double dx = x[j] - x_i;
+        double dy = y[j] - y_i;
+        double dz = z[j] - z_i;
+        double distance_squared = dx * dx + dy * dy + dz * dz;
+        double distance = sqrt(distance_squared);
+        double factor = gravitational_constant * mass[j] / ((distance_squared + GRAVITY_EPSILON) * distance);
+        sum_x += dx * factor;
+        sum_y += dy * factor;
+        sum_z += dz * factor;
+    }
+
+    *ax += sum_x;
+    *ay += sum_y;
+    *az += sum_z;
+}
+
+// naive n-body simulation using particle-based Newton's laws of motion, for the bodies in [first, last)
+static void compute_direct_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    BodyArrays *bodies = &sim->bodies;
+
+    if (sim->simd_level != SIMD_SCALAR) {
+        compute_direct_accelerations_simd(bodies, sim->gravitational_constant, GRAVITY_EPSILON, sim->simd_level, first, last);
+        return;
+    }
+
+    for (int i = first; i < last; i++) {
+        double ax = 0.0, ay = 0.0, az = 0.0;
+        // a celestial body isn't affected by its own gravity, so skip j == i by splitting the loop in two
+        accumulate_direct(bodies, 0, i, bodies->x[i], bodies->y[i], bodies->z[i], sim->gravitational_constant, &ax, &ay, &az);
+        accumulate_direct(bodies, i + 1, bodies->count, bodies->x[i], bodies->y[i], bodies->z[i], sim->gravitational_constant, &ax, &ay, &az);
+        bodies->ax[i] = ax;
+        bodies->ay[i] = ay;
+        bodies->az[i] = az;
+    }
+}
+
+// the pulls between body i and every body after it, added to both sides (Newton's third law)
+// the stores to ax[j] don't depend on each other so this still vectorizes
+static inline void accumulate_symmetric(const BodyArrays *bodies, int i, double gravitational_constant,
+                                        double *__restrict ax, double *__restrict ay, double *__restrict az) {
+    const double *x = bodies->x, *y = bodies->y, *z = bodies->z, *mass = bodies->mass;
+    double x_i = x[i], y_i = y[i], z_i = z[i], mass_i = mass[i];
+    double sum_x = 0.0, sum_y = 0.0, sum_z = 0.0;
+    int count = bodies->count; // or it gets reloaded after every store to ax
+
+    for (int j = i + 1; j < count; j++) {
+        double dx = x[j] - x_i;
+        double dy = y[j] - y_i;
+        double dz = z[j] - z_i;
+        double distance_squared = dx * dx + dy * dy + dz * dz;
+        double distance = sqrt(distance_squared);
+        double factor = gravitational_constant / ((distance_squared + GRAVITY_EPSILON) * distance);
+        double factor_i = factor * mass[j];
+        double factor_j = factor * mass_i;
+        sum_x += dx * factor_i;
+        sum_y += dy * factor_i;
+        sum_z += dz * factor_i;
+        ax[j] -= dx * factor_j;
+        ay[j] -= dy * factor_j;
+        az[j] -= dz * factor_j;
+    }
+
+    ax[i] += sum_x;
+    ay[i] += sum_y;
+    az[i] += sum_z;
+}
+
+// thread 0 accumulates straight into the bodies, the others into their buffer
+static void get_symmetric_buffer(Simulation *sim, int thread_index, double **ax, double **ay, double **az) {
+    if (thread_index == 0) {
+        *ax = sim->bodies.ax;
+        *ay = sim->bodies.ay;
+        *az = sim->bodies.az;
+    } else {
+        double *buffer = sim->symmetric_buffers + (size_t) (thread_index - 1) * 3 * sim->bodies.capacity;
+        *ax = buffer;
+        *ay = buffer + sim->bodies.capacity;
+        *az = buffer + 2 * sim->bodies.capacity;
+    }
+}
+
+static void clear_symmetric_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    for (int t = 0; t < thread_pool_size(sim->thread_pool); t++) {
+        double *ax, *ay, *az;
+        get_symmetric_buffer(sim, t, &ax, &ay, &az);
+        memset(ax + first, 0, (last - first) * sizeof(double));
+        memset(ay + first, 0, (last - first) * sizeof(double));
+        memset(az + first, 0, (last - first) * sizeof(double));
+    }
+}
+
+static void compute_symmetric_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    double *ax, *ay, *az;
+    get_symmetric_buffer(sim, thread_index, &ax, &ay, &az);
+    for (int i = first; i < last; i++) {
+        accumulate_symmetric(&sim->bodies, i, sim->gravitational_constant, ax, ay, az);
+    }
+}
+
+static void reduce_symmetric_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    BodyArrays *bodies = &sim->bodies;
+    for (int t = 1; t < thread_pool_size(sim->thread_pool); t++) {
+        double *ax, *ay, *az;
+        get_symmetric_buffer(sim, t, &ax, &ay, &az);
+        for (int i = first; i < last; i++) {
+            bodies->ax[i] += ax[i];
+            bodies->ay[i] += ay[i];
+            bodies->az[i] += az[i];
+        }
+    }
+}
+
+static void compute_symmetric_accelerations(Simulation *sim) {
+    int num_threads = thread_pool_size(sim->thread_pool);
+    int count = sim->bodies.count;
+
+    size_t buffers_size = (size_t) (num_threads - 1) * 3 * sim->bodies.capacity;
+    if (buffers_size > sim->symmetric_buffers_size) {
+        free(sim->symmetric_buffers);
+        sim->symmetric_buffers = (double *) aligned_alloc(BODY_ARRAY_ALIGNMENT, buffers_size * sizeof(double));
+        if (sim->symmetric_buffers == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the symmetric force buffers.\n");
+            exit(-1);
+        }
+        sim->symmetric_buffers_size = buffers_size;
+    }
+
+    // a thread can get rows from anywhere in the triangle, so every buffer has to start at zero
+    parallel_for_tiles(sim->thread_pool, count, FORCE_TILE_SIZE, clear_symmetric_tile, sim);
+    // the first rows are the longest ones, stealing evens that out
+    parallel_for_tiles(sim->thread_pool, count, FORCE_TILE_SIZE, compute_symmetric_tile, sim);
+    if (num_threads > 1) {
+        parallel_for_tiles(sim->thread_pool, count, FORCE_TILE_SIZE, reduce_symmetric_tile, sim);
+    }
+}
+
+static void compute_barnes_hut_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    compute_barnes_hut_accelerations(sim->barnes_hut_tree, &sim->bodies, sim->gravitational_constant, GRAVITY_EPSILON, first, last);
+}
+
+static void compute_fmm_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    compute_fmm_leaf_accelerations(sim->fmm_tree, &sim->bodies, sim->gravitational_constant, GRAVITY_EPSILON, first, last);
+}
+
+static void compute_test_particle_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    BodyArrays *particles = &sim->test_particles;
+
+    for (int i = first; i < last; i++) {
+        double ax = 0.0, ay = 0.0, az = 0.0;
+        accumulate_direct(&sim->bodies, 0, sim->bodies.count, particles->x[i], particles->y[i], particles->z[i],
+                          sim->gravitational_constant, &ax, &ay, &az);
+        particles->ax[i] = ax;
+        particles->ay[i] = ay;
+        particles->az[i] = az;
+    }
+}
+
+static void compute_test_particle_tree_tile(void *data, int first, int last, int thread_index) {
+    Simulation *sim = (Simulation *) data;
+    compute_barnes_hut_point_accelerations(sim->barnes_hut_tree, &sim->bodies, &sim->test_particles, sim->gravitational_constant,
+                                           GRAVITY_EPSILON, first, last);
+}
+
+void compute_test_particle_accelerations(Simulation *sim) {
+    if (sim->force_mode == FORCE_BARNES_HUT || sim->force_mode == FORCE_FMM) {
+        // the fmm tree only evaluates at its own bodies, so both walk a barnes-hut tree of the bodies where they are now,
+        // the integrator may have moved them since it last built one
+        if (!sim->barnes_hut_tree) sim->barnes_hut_tree = create_barnes_hut_tree();
+        build_barnes_hut_tree(sim->barnes_hut_tree, &sim->bodies, sim->opening_angle, BARNES_HUT_LEAF_SIZE);
+        parallel_for_tiles(sim->thread_pool, sim->test_particles.count, FORCE_TILE_SIZE, compute_test_particle_tree_tile, sim);
+    } else {
+        parallel_for_tiles(sim->thread_pool, sim->test_particles.count, FORCE_TILE_SIZE, compute_test_particle_tile, sim);
+    }
+    sim->test_particle_accelerations_current = true;
+}
+
+void compute_accelerations(Simulation *sim) {
+    switch (sim->force_mode) {
+    case FORCE_DIRECT:
+        parallel_for_tiles(sim->thread_pool, sim->bodies.count, FORCE_TILE_SIZE, compute_direct_tile, sim);
+        break;
+    case FORCE_SYMMETRIC:
+        compute_symmetric_accelerations(sim);
+        break;
+    case FORCE_BARNES_HUT:
+        if (!sim->barnes_hut_tree) sim->barnes_hut_tree = create_barnes_hut_tree();
+        // the build is serial, only the walks run on the pool
+        build_barnes_hut_tree(sim->barnes_hut_tree, &sim->bodies, sim->opening_angle, BARNES_HUT_LEAF_SIZE);
+        parallel_for_tiles(sim->thread_pool, sim->bodies.count, FORCE_TILE_SIZE, compute_barnes_hut_tile, sim);
+        break;
+    case FORCE_FMM:
+        if (!sim->fmm_tree) sim->fmm_tree = create_fmm_tree();
+        // the tree, the expansions and the M2L are serial, the L2P and direct sums of every leaf run on the pool
+        prepare_fmm_accelerations(sim->fmm_tree, &sim->bodies, sim->fmm_order, sim->opening_angle, sim->gravitational_constant);
+        parallel_for_tiles(sim->thread_pool, sim->fmm_tree->num_leaves, 1, compute_fmm_tile, sim);
+        break;
+    default:
+        fprintf(stderr, "Error: Invalid force mode.\n");
+        exit(-1);
+    }
+}
+
+double compute_total_energy(const Simulation *sim) {
+    const BodyArrays *bodies = &sim->bodies;
+    double kinetic = 0.0, potential = 0.0;
+    for (int i = 0; i < bodies->count; i++) {
+        kinetic += 0.5 * bodies->mass[i] * (bodies->vx[i] * bodies->vx[i] + bodies->vy[i] * bodies->vy[i] + bodies->vz[i] * bodies->vz[i]);
+        for (int j = i + 1; j < bodies->count; j++) {
+            double dx = bodies->x[j] - bodies->x[i];
+            double dy = bodies->y[j] - bodies->y[i];
+            double dz = bodies->z[j] - bodies->z[i];
+            potential -= sim->gravitational_constant * bodies->mass[i] * bodies->mass[j] / sqrt(dx * dx + dy * dy + dz * dz);
+        }
+    }
+    return kinetic + potential;
+}
+
+// The bodies with a naif id go where the kernel says (read_spk_states already read it) and the lagrange
+// markers onto their points for that, the others move in their field with kick-drift-kick leapfrog like the
+// test particles, whatever sim->integrator is. They pull each other too, but not the ones the kernel moves.
+static inline bool follows_spk(const CelestialBody *c) {
+    return c->naif_id != 0 || c->lagrange_primary != -1;
+}
+
+static void follow_spk(Simulation *sim, double delta_time) {
+    BodyArrays *bodies = &sim->bodies;
+    bool free_bodies = false;
+    for (int i = 0; i < bodies->count && !free_bodies; i++) {
+        free_bodies = !follows_spk(&sim->celestial_bodies[i]);
+    }
+    if (!free_bodies) {
+        apply_spk_states(sim);
+        place_lagrange_markers(sim);
+        return;
+    }
+
+    if (!sim->accelerations_current) compute_accelerations(sim);
+    for (int i = 0; i < bodies->count; i++) {
+        if (follows_spk(&sim->celestial_bodies[i])) continue;
+        bodies->vx[i] += bodies->ax[i] * 0.5 * delta_time;
+        bodies->vy[i] += bodies->ay[i] * 0.5 * delta_time;
+        bodies->vz[i] += bodies->az[i] * 0.5 * delta_time;
+        bodies->x[i] += bodies->vx[i] * delta_time;
+        bodies->y[i] += bodies->vy[i] * delta_time;
+        bodies->z[i] += bodies->vz[i] * delta_time;
+    }
+    apply_spk_states(sim);
+    place_lagrange_markers(sim);
+    compute_accelerations(sim);
+    for (int i = 0; i < bodies->count; i++) {
+        if (follows_spk(&sim->celestial_bodies[i])) continue;
+        bodies->vx[i] += bodies->ax[i] * 0.5 * delta_time;
+        bodies->vy[i] += bodies->ay[i] * 0.5 * delta_time;
+        bodies->vz[i] += bodies->az[i] * 0.5 * delta_time;
+    }
+    sim->accelerations_current = true;
+}
+
+// moves the bodies to sim->time + delta_time, from the ephemeris or the SPK kernel if there is one that covers it
+static void advance_bodies(Simulation *sim, double delta_time) {
+    double t = sim->time + delta_time;
+    if (sim->ephemeris && evaluate_ephemeris(sim->ephemeris, t, &sim->bodies)) {
+        sim->accelerations_current = false;
+    } else if (sim->spk && read_spk_states(sim, sim->spk, sim->spk_epoch + t * spk_seconds_per_time_unit(sim))) {
+        follow_spk(sim, delta_time);
+    } else {
+        integrate_step(sim, delta_time);
+    }
+}
+
+static void single_step(Simulation *sim, double delta_time) {
+    BodyArrays *particles = &sim->test_particles;
+
+    if (particles->count == 0) {
+        advance_bodies(sim, delta_time);
+    } else {
+        // leapfrog for the test particles, the bodies are at the start of the step for the first kick
+        // and at the end for the second one, whatever the integrator does in between
+        if (!sim->test_particle_accelerations_current) compute_test_particle_accelerations(sim);
+        kick_bodies(particles, 0.5 * delta_time);
+        advance_bodies(sim, delta_time);
+        drift_bodies(particles, delta_time);
+        compute_test_particle_accelerations(sim);
+        kick_bodies(particles, 0.5 * delta_time);
+    }
+    sim->time += delta_time;
+    sim->num_steps++;
+
+    if (sim->recorder && sim->num_steps % sim->record_interval == 0) {
+        record_trajectory_sample(sim->recorder, sim);
+    }
+}
+
+void step_simulation(Simulation *sim, long long num_steps) {
+    for (long long step = 0; step < num_steps; step++) {
+        single_step(sim, sim->physics_step);
+    }
+}
+
+long long advance_simulation_to(Simulation *sim, double t) {
+    if (t <= sim->time)
+        return 0;
+
+    // the tiny slack keeps accumulated rounding in sim->time from dropping the last step
+    long long num_steps = (long long) floor((t - sim->time) / sim->physics_step + 1e-9);
+    step_simulation(sim, num_steps);
+    return num_steps;
+}
+
+void advance_simulation_exactly_to(Simulation *sim, double t) {
+    advance_simulation_to(sim, t);
+    if (t > sim->time) {
+        single_step(sim, t - sim->time);
+        sim->time = t;
+    }
+}
@@ -0,0 +1,195 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <glm/glm.hpp>
+
+#include "force_simd.h"
+#include "integrator.h"
+#include "wisdom_holman.h"
+#include "lagrange.h"
+
+// fixed physics step, in simulation seconds
+#define PHYSICS_STEP (1 / 300.0f)
+
+// the epsilon is used to avoid the gravity going to infinity when distance goes too close to zero
+// TODO: this doesn't seem to help much, maybe we have to choose a bigger epsilon, but we don't want to break the simulation
+#define GRAVITY_EPSILON 0.000001
+
+#define DEFAULT_OPENING_ANGLE 0.5
+
+// how many bodies a thread evaluates forces for before it goes back to the pool for more
+#define FORCE_TILE_SIZE 64
+
+// alignment of every body array, a cache line (and a full AVX-512 register)
+#define BODY_ARRAY_ALIGNMENT 64
+
+struct LinePath; // owned by the renderer, the simulation never touches it
+struct BarnesHutTree;
+struct FmmTree;
+struct ThreadPool;
+struct Dopri5;
+struct BlockTimesteps;
+struct Ephemeris;
+struct SpkFile;
+struct SpkSegment;
+struct TrajectoryRecorder;
+
+enum ForceMode {
+    FORCE_DIRECT,     // every pair, O(N^2)
+    FORCE_SYMMETRIC,  // every pair too, but each one is only visited once (Newton's third law), O(N^2 / 2)
+    FORCE_BARNES_HUT, // octree with an opening angle, O(N log N)
+    FORCE_FMM,        // fast multipole method, O(N)
+};
+
+// The state the force loops stream through, as a structure of arrays so that every field of consecutive
+// bodies is contiguous in memory. Body i is (x[i], y[i], z[i]) and so on.
+struct BodyArrays {
+    double *x, *y, *z;
+    double *vx, *vy, *vz;
+    double *mass;
+    double *ax, *ay, *az; // output of the force evaluation
+    int count;
+    int capacity;
+};
+
+// Everything about a body that the physics doesn't need, stored at the same index as its BodyArrays entry.
+struct CelestialBody {
+    double size;
+    glm::vec3 color;
+
+    LinePath* path_taken;
+    // LinePath path_prediction; TODO
+
+    // used for RENDER_MINIFIED
+    double minified_dist_scale;
+    double minified_size_scale;
+    int anchor; // index of the body this one is drawn relative to, -1 for none
+    int naif_id; // which body of an SPK kernel this is, 0 for none
+    // the point this body marks if add_lagrange_marker made it, lagrange_primary is -1 for the other bodies
+    int lagrange_primary;
+    int lagrange_secondary;
+    LagrangePoint lagrange_point;
+};
+
+struct Simulation {
+    BodyArrays bodies;
+    CelestialBody *celestial_bodies;
+    double gravitational_constant;
+    double physics_step;
+    double time;
+    long long num_steps;
+
+    Integrator integrator;
+    // bodies.ax/ay/az belong to the current positions, the integrators reuse them for the next step.
+    // Clear it after moving bodies by hand.
+    bool accelerations_current;
+    Dopri5 *dopri5; // state of INTEGRATOR_DOPRI5
+    double tolerance; // per step error of INTEGRATOR_DOPRI5
+    BlockTimesteps *block_timesteps; // state of INTEGRATOR_BLOCK
+    double block_max_step; // the longest step INTEGRATOR_BLOCK gives a body, the others are this over a power of two
+    WisdomHolman *wisdom_holman; // scratch of INTEGRATOR_WISDOM_HOLMAN
+    WhCoordinates wh_coordinates;
+    // not owned, while it covers sim->time the bodies are read from it instead of integrated
+    const Ephemeris *ephemeris;
+    // not owned either, the same for the bodies with a naif id, spk_epoch is the ET (TDB seconds past J2000)
+    // of sim->time 0. The ephemeris wins if there are both.
+    const SpkFile *spk;
+    double spk_epoch;
+    // scratch of the SPK updates, as big as the bodies: the kernel states of the bodies with a naif id, and
+    // the segments along their chain of centers that covered the last time asked for
+    glm::dvec3 *spk_states; // position and velocity of each body
+    const SpkSegment **spk_segments; // SPK_CACHED_LINKS per body
+    int spk_scratch_capacity;
+
+    TrajectoryRecorder *recorder; // not owned, gets the state after every record_interval-th step
+    int record_interval;
+
+    ForceMode force_mode;
+    double opening_angle; // used by FORCE_BARNES_HUT and FORCE_FMM
+    int fmm_order; // expansion order, only used by FORCE_FMM
+    SimdLevel simd_level; // instruction set of the FORCE_DIRECT kernel, defaults to the best one the CPU has
+    BarnesHutTree *barnes_hut_tree;
+    FmmTree *fmm_tree;
+
+    // Massless tracers (spacecraft, dust, ...), pulled by the bodies but not pulling anything themselves, so they
+    // cost O(bodies * test particles). Their mass array is unused. They always move with kick-drift-kick leapfrog
+    // around whatever step sim->integrator gives the bodies.
+    BodyArrays test_particles;
+    bool test_particle_accelerations_current;
+
+    ThreadPool *thread_pool; // NULL runs the forces on the calling thread only
+    // FORCE_SYMMETRIC on several threads: each thread but the first adds into its own ax/ay/az copy,
+    // thread_pool_size - 1 of them, 3 arrays of bodies.capacity each, summed into bodies.ax/ay/az at the end
+    double *symmetric_buffers;
+    size_t symmetric_buffers_size; // in doubles
+};
+
+inline glm::dvec3 get_position(const BodyArrays *bodies, int i) {
+    return glm::dvec3(bodies->x[i], bodies->y[i], bodies->z[i]);
+}
+
+inline glm::dvec3 get_velocity(const BodyArrays *bodies, int i) {
+    return glm::dvec3(bodies->vx[i], bodies->vy[i], bodies->vz[i]);
+}
+
+inline void set_position(BodyArrays *bodies, int i, glm::dvec3 position) {
+    bodies->x[i] = position.x;
+    bodies->y[i] = position.y;
+    bodies->z[i] = position.z;
+}
+
+inline void set_velocity(BodyArrays *bodies, int i, glm::dvec3 velocity) {
+    bodies->vx[i] = velocity.x;
+    bodies->vy[i] = velocity.y;
+    bodies->vz[i] = velocity.z;
+}
+
+void init_body_arrays(BodyArrays *bodies);
+void destroy_body_arrays(BodyArrays *bodies);
+// grows every array to hold at least capacity bodies, keeping their contents
+void reserve_body_arrays(BodyArrays *bodies, int capacity);
+
+void init_simulation(Simulation *sim, double gravitational_constant, double physics_step);
+void destroy_simulation(Simulation *sim);
+// evaluates forces on num_threads threads (counting the caller), 0 for one per core, 1 to stay single threaded
+void set_simulation_threads(Simulation *sim, int num_threads);
+// returns the index of the new body
+int add_celestial_body(Simulation *sim, glm::dvec3 position, glm::dvec3 velocity, float mass, float size, glm::vec3 color,
+                       double minified_size_scale, double minified_dist_scale, int anchor);
+
+// grows sim->bodies and sim->celestial_bodies together, the cold per-body data is always as big as the body arrays
+void reserve_celestial_bodies(Simulation *sim, int capacity);
+// returns the index of the new test particle
+int add_test_particle(Simulation *sim, glm::dvec3 position, glm::dvec3 velocity);
+
+// sets up the sun, the planets and the lagrange point markers
+void create_solar_system(Simulation *sim);
+// a small marker body at point of the pair, co-rotating with it, returns its index
+int add_lagrange_marker(Simulation *sim, int primary, int secondary, LagrangePoint point);
+// puts every marker back on its point, for where its pair is now
+void place_lagrange_markers(Simulation *sim);
+// scatters tiny bodies on circular orbits around the first body (the sun) in the orbital plane
+void add_asteroid_belt(Simulation *sim, int num_asteroids, double inner_radius, double outer_radius, unsigned long long seed);
+// the same, but as test particles
+void add_test_particle_belt(Simulation *sim, int num_particles, double inner_radius, double outer_radius, unsigned long long seed);
+
+const char *force_mode_name(ForceMode mode);
+bool parse_force_mode(const char *name, ForceMode *mode);
+
+// fills sim->bodies.ax/ay/az for the current positions using sim->force_mode
+void compute_accelerations(Simulation *sim);
+// fills sim->test_particles.ax/ay/az from the current positions of the bodies, walking a barnes-hut tree of them
+// with the tree force modes and a direct sum otherwise
+void compute_test_particle_accelerations(Simulation *sim);
+
+// kinetic plus potential energy of every body, O(N^2), for measuring how well an integrator conserves it
+double compute_total_energy(const Simulation *sim);
+
+// advances the simulation by exactly num_steps fixed steps
+void step_simulation(Simulation *sim, long long num_steps);
+// takes as many fixed steps as fit before time t, returns how many were taken
+long long advance_simulation_to(Simulation *sim, double t);
+// the same followed by one shorter step so that sim->time ends up exactly at t
+void advance_simulation_exactly_to(Simulation *sim, double t);
+
+#endif
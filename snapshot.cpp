@@ -0,0 +1,326 @@
+#include "snapshot.h"
+#include "simulation.h"
+#include "fmm.h"
+#include "dopri5.h"
+#include "block_timestep.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <thread>
+
+static_assert(sizeof(SnapshotHeader) % SNAPSHOT_ALIGNMENT == 0, "the snapshot header is part of the file format");
+static_assert(sizeof(SnapshotBody) == 56, "the snapshot bodies are part of the file format");
+
+#define SNAPSHOT_BODY_ARRAYS 7 // x, y, z, vx, vy, vz, mass
+#define SNAPSHOT_TEST_PARTICLE_ARRAYS 6 // the same without the mass
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+static int32_t array_stride(int count) {
+    int doubles_per_line = SNAPSHOT_ALIGNMENT / sizeof(double);
+    return (count + doubles_per_line - 1) / doubles_per_line * doubles_per_line;
+}
+
+// fills in everything about the simulation and where every section goes
+static void fill_snapshot_header(SnapshotHeader *header, const Simulation *sim, size_t user_data_size) {
+    *header = { };
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header->version = SNAPSHOT_VERSION;
+    header->header_size = sizeof(SnapshotHeader);
+
+    header->num_bodies = sim->bodies.count;
+    header->num_test_particles = sim->test_particles.count;
+    header->body_stride = array_stride(sim->bodies.count);
+    header->test_particle_stride = array_stride(sim->test_particles.count);
+    header->integrator = sim->integrator;
+    header->force_mode = sim->force_mode;
+    header->wh_coordinates = sim->wh_coordinates;
+    header->fmm_order = sim->fmm_order;
+
+    header->gravitational_constant = sim->gravitational_constant;
+    header->physics_step = sim->physics_step;
+    header->time = sim->time;
+    header->num_steps = sim->num_steps;
+    header->opening_angle = sim->opening_angle;
+    header->tolerance = sim->tolerance;
+    header->block_max_step = sim->block_max_step;
+
+    header->bodies_offset = sizeof(SnapshotHeader);
+    header->celestial_bodies_offset = align_offset(header->bodies_offset + (uint64_t) SNAPSHOT_BODY_ARRAYS * header->body_stride * sizeof(double));
+    header->test_particles_offset = align_offset(header->celestial_bodies_offset + (uint64_t) header->num_bodies * sizeof(SnapshotBody));
+    header->user_data_offset = align_offset(header->test_particles_offset + (uint64_t) SNAPSHOT_TEST_PARTICLE_ARRAYS * header->test_particle_stride * sizeof(double));
+    header->user_data_size = user_data_size;
+    header->file_size = header->user_data_offset + user_data_size;
+}
+
+static bool section_fits(uint64_t offset, uint64_t size, uint64_t file_size) {
+    return offset % SNAPSHOT_ALIGNMENT == 0 && offset <= file_size && size <= file_size - offset;
+}
+
+Snapshot *load_snapshot(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: can't open '%s'.\n", path);
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Error: '%s' is not a snapshot.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) file_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map '%s'.\n", path);
+        return NULL;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *) mapping;
+    const char *bytes = (const char *) mapping;
+    bool valid = false;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a snapshot.\n", path);
+    } else if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(SnapshotHeader)) {
+        fprintf(stderr, "Error: '%s' is version %u of the snapshot format, only %d is supported.\n", path, header->version, SNAPSHOT_VERSION);
+    } else if (header->file_size != size || header->num_bodies < 0 || header->num_test_particles < 0 ||
+               header->body_stride < header->num_bodies || header->test_particle_stride < header->num_test_particles ||
+               header->body_stride % (SNAPSHOT_ALIGNMENT / sizeof(double)) != 0 ||
+               header->test_particle_stride % (SNAPSHOT_ALIGNMENT / sizeof(double)) != 0 ||
+               header->integrator < 0 || header->integrator > INTEGRATOR_WISDOM_HOLMAN ||
+               header->force_mode < 0 || header->force_mode > FORCE_FMM ||
+               header->wh_coordinates < 0 || header->wh_coordinates > WH_DEMOCRATIC_HELIOCENTRIC ||
+               header->fmm_order < 1 || header->fmm_order > FMM_MAX_ORDER ||
+               !section_fits(header->bodies_offset, (uint64_t) SNAPSHOT_BODY_ARRAYS * header->body_stride * sizeof(double), size) ||
+               !section_fits(header->celestial_bodies_offset, (uint64_t) header->num_bodies * sizeof(SnapshotBody), size) ||
+               !section_fits(header->test_particles_offset, (uint64_t) SNAPSHOT_TEST_PARTICLE_ARRAYS * header->test_particle_stride * sizeof(double), size) ||
+               !section_fits(header->user_data_offset, header->user_data_size, size)) {
+        fprintf(stderr, "Error: '%s' is corrupt.\n", path);
+    } else {
+        valid = true;
+        const SnapshotBody *celestial_bodies = (const SnapshotBody *) (bytes + header->celestial_bodies_offset);
+        for (int i = 0; i < header->num_bodies; i++) {
+            const SnapshotBody *saved = &celestial_bodies[i];
+            if (saved->anchor < -1 || saved->anchor >= header->num_bodies) valid = false;
+            if (saved->lagrange_primary != -1 && (saved->lagrange_primary < 0 || saved->lagrange_primary >= header->num_bodies ||
+                                                  saved->lagrange_secondary < 0 || saved->lagrange_secondary >= header->num_bodies ||
+                                                  saved->lagrange_point < LAGRANGE_L1 || saved->lagrange_point > LAGRANGE_L5)) valid = false;
+        }
+        if (!valid) fprintf(stderr, "Error: '%s' is corrupt.\n", path);
+    }
+    if (!valid) {
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    Snapshot *snapshot = (Snapshot *) calloc(1, sizeof(Snapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the snapshot.\n");
+        exit(-1);
+    }
+    snapshot->header = header;
+    snapshot->bodies = (const double *) (bytes + header->bodies_offset);
+    snapshot->celestial_bodies = (const SnapshotBody *) (bytes + header->celestial_bodies_offset);
+    snapshot->test_particles = (const double *) (bytes + header->test_particles_offset);
+    snapshot->user_data = bytes + header->user_data_offset;
+    snapshot->mapping = mapping;
+    snapshot->mapping_size = size;
+    return snapshot;
+}
+
+void destroy_snapshot(Snapshot **snapshot) {
+    if (!snapshot || !(*snapshot))
+        return;
+
+    munmap((*snapshot)->mapping, (*snapshot)->mapping_size);
+    free(*snapshot);
+    *snapshot = NULL;
+}
+
+void restore_snapshot(Simulation *sim, const Snapshot *snapshot) {
+    const SnapshotHeader *header = snapshot->header;
+
+    sim->gravitational_constant = header->gravitational_constant;
+    sim->physics_step = header->physics_step;
+    sim->time = header->time;
+    sim->num_steps = header->num_steps;
+    sim->integrator = (Integrator) header->integrator;
+    sim->force_mode = (ForceMode) header->force_mode;
+    sim->wh_coordinates = (WhCoordinates) header->wh_coordinates;
+    sim->fmm_order = header->fmm_order;
+    sim->opening_angle = header->opening_angle;
+    sim->tolerance = header->tolerance;
+    sim->block_max_step = header->block_max_step;
+    destroy_dopri5(&sim->dopri5);
+    destroy_block_timesteps(&sim->block_timesteps);
+
+    // the arrays are already laid out the way BodyArrays wants them, one copy each
+    BodyArrays *bodies = &sim->bodies;
+    bodies->count = 0;
+    reserve_celestial_bodies(sim, header->num_bodies);
+    double *body_arrays[SNAPSHOT_BODY_ARRAYS] = { bodies->x, bodies->y, bodies->z, bodies->vx, bodies->vy, bodies->vz, bodies->mass };
+    for (int k = 0; k < SNAPSHOT_BODY_ARRAYS; k++) {
+        memcpy(body_arrays[k], snapshot->bodies + (size_t) k * header->body_stride, header->num_bodies * sizeof(double));
+    }
+    bodies->count = header->num_bodies;
+
+    for (int i = 0; i < header->num_bodies; i++) {
+        const SnapshotBody *saved = &snapshot->celestial_bodies[i];
+        CelestialBody *c = &sim->celestial_bodies[i];
+        c->size = saved->size;
+        c->color = glm::vec3(saved->color[0], saved->color[1], saved->color[2]);
+        c->path_taken = NULL;
+        c->minified_dist_scale = saved->minified_dist_scale;
+        c->minified_size_scale = saved->minified_size_scale;
+        c->anchor = saved->anchor;
+        c->naif_id = saved->naif_id;
+        c->lagrange_primary = saved->lagrange_primary;
+        c->lagrange_secondary = saved->lagrange_secondary;
+        c->lagrange_point = (LagrangePoint) saved->lagrange_point;
+    }
+
+    BodyArrays *particles = &sim->test_particles;
+    particles->count = 0;
+    reserve_body_arrays(particles, header->num_test_particles);
+    double *particle_arrays[SNAPSHOT_TEST_PARTICLE_ARRAYS] = { particles->x, particles->y, particles->z, particles->vx, particles->vy, particles->vz };
+    for (int k = 0; k < SNAPSHOT_TEST_PARTICLE_ARRAYS; k++) {
+        memcpy(particle_arrays[k], snapshot->test_particles + (size_t) k * header->test_particle_stride, header->num_test_particles * sizeof(double));
+    }
+    memset(particles->mass, 0, header->num_test_particles * sizeof(double));
+    particles->count = header->num_test_particles;
+
+    sim->accelerations_current = false;
+    sim->test_particle_accelerations_current = false;
+}
+
+struct SnapshotWriter {
+    std::thread thread;
+    bool busy; // the thread is running or hasn't been joined yet
+    bool ok; // how the last one went
+
+    char *buffer; // the whole file
+    size_t buffer_size;
+    size_t buffer_capacity;
+    char *path;
+};
+
+SnapshotWriter *create_snapshot_writer() {
+    SnapshotWriter *writer = new SnapshotWriter();
+    writer->ok = true;
+    return writer;
+}
+
+void destroy_snapshot_writer(SnapshotWriter **writer) {
+    if (!writer || !(*writer))
+        return;
+
+    wait_for_snapshot(*writer);
+    free((*writer)->buffer);
+    free((*writer)->path);
+    delete *writer;
+    *writer = NULL;
+}
+
+bool wait_for_snapshot(SnapshotWriter *writer) {
+    if (writer->busy) {
+        writer->thread.join();
+        writer->busy = false;
+    }
+    return writer->ok;
+}
+
+static void write_snapshot_file(SnapshotWriter *writer) {
+    size_t path_length = strlen(writer->path);
+    char *temporary_path = (char *) malloc(path_length + 5);
+    if (temporary_path == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the snapshot path.\n");
+        exit(-1);
+    }
+    memcpy(temporary_path, writer->path, path_length);
+    memcpy(temporary_path + path_length, ".tmp", 5);
+
+    bool ok = false;
+    FILE *f = fopen(temporary_path, "wb");
+    if (f) {
+        ok = fwrite(writer->buffer, 1, writer->buffer_size, f) == writer->buffer_size;
+        if (fclose(f) != 0) ok = false;
+        // a crash halfway through leaves the previous snapshot alone
+        if (ok) ok = rename(temporary_path, writer->path) == 0;
+        if (!ok) remove(temporary_path);
+    }
+    if (!ok) {
+        fprintf(stderr, "Error: failed to write the snapshot to '%s'.\n", writer->path);
+    }
+    free(temporary_path);
+    writer->ok = ok;
+}
+
+void save_snapshot(SnapshotWriter *writer, const Simulation *sim, const void *user_data, size_t user_data_size, const char *path) {
+    wait_for_snapshot(writer);
+
+    SnapshotHeader header;
+    fill_snapshot_header(&header, sim, user_data_size);
+    if (header.file_size > writer->buffer_capacity) {
+        free(writer->buffer);
+        writer->buffer = (char *) malloc(header.file_size);
+        if (writer->buffer == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the snapshot.\n");
+            exit(-1);
+        }
+        writer->buffer_capacity = header.file_size;
+    }
+    writer->buffer_size = header.file_size;
+    // the padding between the sections too, so that the files come out the same every time
+    memset(writer->buffer, 0, header.file_size);
+    memcpy(writer->buffer, &header, sizeof(header));
+
+    const BodyArrays *bodies = &sim->bodies;
+    const double *body_arrays[SNAPSHOT_BODY_ARRAYS] = { bodies->x, bodies->y, bodies->z, bodies->vx, bodies->vy, bodies->vz, bodies->mass };
+    for (int k = 0; k < SNAPSHOT_BODY_ARRAYS; k++) {
+        memcpy(writer->buffer + header.bodies_offset + (size_t) k * header.body_stride * sizeof(double), body_arrays[k], bodies->count * sizeof(double));
+    }
+    SnapshotBody *saved_bodies = (SnapshotBody *) (writer->buffer + header.celestial_bodies_offset);
+    for (int i = 0; i < bodies->count; i++) {
+        const CelestialBody *c = &sim->celestial_bodies[i];
+        SnapshotBody *saved = &saved_bodies[i];
+        saved->size = c->size;
+        saved->minified_dist_scale = c->minified_dist_scale;
+        saved->minified_size_scale = c->minified_size_scale;
+        saved->color[0] = c->color.x;
+        saved->color[1] = c->color.y;
+        saved->color[2] = c->color.z;
+        saved->anchor = c->anchor;
+        saved->naif_id = c->naif_id;
+        saved->lagrange_primary = c->lagrange_primary;
+        saved->lagrange_secondary = c->lagrange_secondary;
+        saved->lagrange_point = c->lagrange_point;
+    }
+    const BodyArrays *particles = &sim->test_particles;
+    const double *particle_arrays[SNAPSHOT_TEST_PARTICLE_ARRAYS] = { particles->x, particles->y, particles->z, particles->vx, particles->vy, particles->vz };
+    for (int k = 0; k < SNAPSHOT_TEST_PARTICLE_ARRAYS; k++) {
+        memcpy(writer->buffer + header.test_particles_offset + (size_t) k * header.test_particle_stride * sizeof(double), particle_arrays[k], particles->count * sizeof(double));
+    }
+    if (user_data_size) {
+        memcpy(writer->buffer + header.user_data_offset, user_data, user_data_size);
+    }
+
+    free(writer->path);
+    writer->path = strdup(path);
+    if (writer->path == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the snapshot path.\n");
+        exit(-1);
+    }
+
+    writer->busy = true;
+    writer->thread = std::thread(write_snapshot_file, writer);
+}
@@ -0,0 +1,99 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Checkpoints of a simulation. The file is the in-memory layout (native endianness): a SnapshotHeader, then
+// the body arrays x, y, z, vx, vy, vz, mass with body_stride doubles each, a SnapshotBody per body, the
+// test particle arrays x, y, z, vx, vy, vz with test_particle_stride doubles each and whatever the caller
+// wants to keep next to it (the viewer keeps its camera). Every section starts on a 64 byte boundary, so a
+// mapped file is read in place.
+//
+// The per-integrator state (dopri5 step size, block levels) isn't saved, those integrators start over from
+// the restored state. Neither is the ephemeris or the SPK kernel, they belong to the caller.
+
+#define SNAPSHOT_MAGIC "LGSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGNMENT 64
+
+struct Simulation;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t file_size;
+
+    int32_t num_bodies;
+    int32_t num_test_particles;
+    int32_t body_stride;
+    int32_t test_particle_stride;
+    int32_t integrator;
+    int32_t force_mode;
+    int32_t wh_coordinates;
+    int32_t fmm_order;
+
+    double gravitational_constant;
+    double physics_step;
+    double time;
+    int64_t num_steps;
+    double opening_angle;
+    double tolerance;
+    double block_max_step;
+
+    uint64_t bodies_offset;
+    uint64_t celestial_bodies_offset;
+    uint64_t test_particles_offset;
+    uint64_t user_data_offset;
+    uint64_t user_data_size;
+
+    uint8_t padding[40]; // up to SNAPSHOT_ALIGNMENT
+};
+
+// the part of CelestialBody worth keeping, the render paths aren't
+struct SnapshotBody {
+    double size;
+    double minified_dist_scale;
+    double minified_size_scale;
+    float color[3];
+    int32_t anchor;
+    int32_t naif_id;
+    int32_t lagrange_primary; // -1 for everything but the lagrange markers
+    int32_t lagrange_secondary;
+    int32_t lagrange_point;
+};
+
+struct Snapshot {
+    const SnapshotHeader *header;
+    const double *bodies;
+    const SnapshotBody *celestial_bodies;
+    const double *test_particles;
+    const void *user_data;
+
+    void *mapping;
+    size_t mapping_size;
+};
+
+// maps the file and checks it, prints what went wrong and returns NULL
+Snapshot *load_snapshot(const char *path);
+void destroy_snapshot(Snapshot **snapshot);
+
+// replaces the bodies, test particles, time and settings of an initialized simulation. The celestial
+// bodies come back without a path_taken.
+void restore_snapshot(Simulation *sim, const Snapshot *snapshot);
+
+// Writes snapshots on a thread of its own. save_snapshot only copies the state, so the simulation can go on
+// right away, and waits first if the previous one is still being written.
+struct SnapshotWriter;
+
+SnapshotWriter *create_snapshot_writer();
+// waits for the last snapshot
+void destroy_snapshot_writer(SnapshotWriter **writer);
+
+// the file appears under path once it is complete, it's written next to it and renamed
+void save_snapshot(SnapshotWriter *writer, const Simulation *sim, const void *user_data, size_t user_data_size, const char *path);
+// waits for the last snapshot, false if writing it failed
+bool wait_for_snapshot(SnapshotWriter *writer);
+
+#endif
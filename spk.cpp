@@ -0,0 +1,336 @@
+#include "spk.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// DAF layout, the NAIF "DAF Required Reading" has the details
+#define DAF_RECORD_SIZE 1024
+#define DAF_RECORD_DOUBLES (DAF_RECORD_SIZE / 8)
+#define SPK_FRAME_J2000 1
+#define SPK_MAX_CENTER_CHAIN 16
+#define SPK_CACHED_LINKS 4 // of the chain of centers of every body, the first few are all there is for the planets
+
+SpkFile *load_spk(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: can't open '%s'.\n", path);
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < DAF_RECORD_SIZE) {
+        fprintf(stderr, "Error: '%s' is not an SPK kernel.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) file_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map '%s'.\n", path);
+        return NULL;
+    }
+
+    // the file record
+    const char *file_record = (const char *) mapping;
+    int32_t num_doubles, num_ints, first_summary;
+    memcpy(&num_doubles, file_record + 8, 4);
+    memcpy(&num_ints, file_record + 12, 4);
+    memcpy(&first_summary, file_record + 76, 4);
+    if (memcmp(file_record, "DAF/SPK ", 8) != 0 && memcmp(file_record, "NAIF/DAF", 8) != 0) {
+        fprintf(stderr, "Error: '%s' is not an SPK kernel.\n", path);
+        munmap(mapping, size);
+        return NULL;
+    }
+    if (memcmp(file_record + 88, "BIG-IEEE", 8) == 0) {
+        fprintf(stderr, "Error: '%s' is big endian, convert it with toxfr/spacit or bingo first.\n", path);
+        munmap(mapping, size);
+        return NULL;
+    }
+    if (num_doubles != 2 || num_ints != 6) {
+        fprintf(stderr, "Error: '%s' has summaries of %d doubles and %d ints, an SPK kernel has 2 and 6.\n", path, num_doubles, num_ints);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    SpkFile *spk = (SpkFile *) calloc(1, sizeof(SpkFile));
+    if (spk == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the SPK kernel.\n");
+        exit(-1);
+    }
+    spk->mapping = mapping;
+    spk->mapping_size = size;
+
+    const double *words = (const double *) mapping;
+    size_t num_words = size / 8;
+    int max_segments = 0;
+    bool corrupt = false;
+
+    // the summary records form a linked list, each summary is 2 doubles and 6 ints packed into 3 doubles
+    int summary_doubles = num_doubles + (num_ints + 1) / 2;
+    for (int record = first_summary; record != 0 && !corrupt; ) {
+        if (record < 1 || (size_t) record * DAF_RECORD_DOUBLES > num_words) {
+            corrupt = true;
+            break;
+        }
+        const double *summary_record = words + (size_t) (record - 1) * DAF_RECORD_DOUBLES;
+        int next = (int) summary_record[0];
+        int num_summaries = (int) summary_record[2];
+        if (num_summaries < 0 || 3 + num_summaries * summary_doubles > DAF_RECORD_DOUBLES || next == record) {
+            corrupt = true;
+            break;
+        }
+
+        for (int i = 0; i < num_summaries; i++) {
+            const double *summary = summary_record + 3 + i * summary_doubles;
+            int32_t ints[6];
+            memcpy(ints, summary + 2, sizeof(ints));
+
+            SpkSegment segment = { };
+            segment.start_time = summary[0];
+            segment.end_time = summary[1];
+            segment.target = ints[0];
+            segment.center = ints[1];
+            segment.frame = ints[2];
+            segment.type = ints[3];
+            int first_word = ints[4], last_word = ints[5]; // 1 based, inclusive
+            if (segment.type != 2 && segment.type != 3) continue;
+            if (first_word < 1 || last_word < first_word + 3 || (size_t) last_word > num_words) {
+                corrupt = true;
+                break;
+            }
+
+            // the segment ends with the record directory: INIT, INTLEN, RSIZE, N
+            const double *directory = words + last_word - 4;
+            segment.records = words + first_word - 1;
+            segment.first_record_time = directory[0];
+            segment.record_length = directory[1];
+            segment.record_size = (int) directory[2];
+            segment.num_records = (int) directory[3];
+            int components = segment.type == 2 ? 3 : 6;
+            int num_coefficients = (segment.record_size - 2) / components;
+            if (segment.num_records < 1 || !(segment.record_length > 0.0) || num_coefficients < 1 ||
+                num_coefficients > SPK_MAX_DEGREE + 1 || 2 + components * num_coefficients != segment.record_size ||
+                (long long) segment.num_records * segment.record_size + 4 > last_word - first_word + 1) {
+                corrupt = true;
+                break;
+            }
+
+            if (spk->num_segments == max_segments) {
+                max_segments = max_segments ? max_segments * 2 : 32;
+                spk->segments = (SpkSegment *) realloc(spk->segments, max_segments * sizeof(SpkSegment));
+                if (spk->segments == NULL) {
+                    fprintf(stderr, "Error: failed to allocate memory for the SPK segments.\n");
+                    exit(-1);
+                }
+            }
+            spk->segments[spk->num_segments++] = segment;
+        }
+        record = next;
+    }
+
+    if (corrupt) {
+        fprintf(stderr, "Error: '%s' is corrupt.\n", path);
+        destroy_spk(&spk);
+        return NULL;
+    }
+    return spk;
+}
+
+void destroy_spk(SpkFile **spk) {
+    if (!spk || !(*spk))
+        return;
+
+    munmap((*spk)->mapping, (*spk)->mapping_size);
+    free((*spk)->segments);
+    free(*spk);
+    *spk = NULL;
+}
+
+// later segments take precedence over earlier ones, like in SPICE
+static const SpkSegment *find_segment(const SpkFile *spk, int target, double et) {
+    for (int i = spk->num_segments - 1; i >= 0; i--) {
+        const SpkSegment *segment = &spk->segments[i];
+        if (segment->target == target && segment->frame == SPK_FRAME_J2000 &&
+            et >= segment->start_time && et <= segment->end_time) {
+            return segment;
+        }
+    }
+    return NULL;
+}
+
+// adds the state of the segment's target relative to its center
+static void evaluate_segment(const SpkSegment *segment, double et, double position[3], double velocity[3]) {
+    int index = (int) floor((et - segment->first_record_time) / segment->record_length);
+    if (index < 0) index = 0;
+    if (index >= segment->num_records) index = segment->num_records - 1;
+
+    const double *record = segment->records + (size_t) index * segment->record_size;
+    double middle = record[0], radius = record[1];
+    const double *coefficients = record + 2;
+    int components = segment->type == 2 ? 3 : 6;
+    int n = (segment->record_size - 2) / components;
+
+    // T_j(s) and T'_j(s) once for all the components, then every component is a dot product with
+    // contiguous coefficients, which the compiler vectorizes
+    double s = (et - middle) / radius;
+    double polynomials[SPK_MAX_DEGREE + 1];
+    double derivatives[SPK_MAX_DEGREE + 1];
+    polynomials[0] = 1.0;
+    derivatives[0] = 0.0;
+    if (n > 1) {
+        polynomials[1] = s;
+        derivatives[1] = 1.0;
+    }
+    for (int j = 2; j < n; j++) {
+        polynomials[j] = 2.0 * s * polynomials[j - 1] - polynomials[j - 2];
+        derivatives[j] = 2.0 * polynomials[j - 1] + 2.0 * s * derivatives[j - 1] - derivatives[j - 2];
+    }
+
+    for (int axis = 0; axis < 3; axis++) {
+        const double *c = coefficients + axis * n;
+        double p = 0.0, v = 0.0;
+        for (int j = 0; j < n; j++) {
+            p += c[j] * polynomials[j];
+            v += c[j] * derivatives[j];
+        }
+        position[axis] += p;
+        if (segment->type == 2) {
+            velocity[axis] += v / radius;
+        } else {
+            // type 3 fits the velocity separately
+            const double *cv = coefficients + (3 + axis) * n;
+            double fitted = 0.0;
+            for (int j = 0; j < n; j++) {
+                fitted += cv[j] * polynomials[j];
+            }
+            velocity[axis] += fitted;
+        }
+    }
+}
+
+// state relative to the solar system barycenter. cache, when there is one, has the segments of the first
+// SPK_CACHED_LINKS links of the chain that were used last time, they're only looked up again once et leaves them.
+static bool barycentric_state(const SpkFile *spk, int target, double et, double position[3], double velocity[3],
+                              const SpkSegment **cache) {
+    for (int axis = 0; axis < 3; axis++) {
+        position[axis] = 0.0;
+        velocity[axis] = 0.0;
+    }
+    for (int link = 0; target != NAIF_SOLAR_SYSTEM_BARYCENTER; link++) {
+        if (link == SPK_MAX_CENTER_CHAIN)
+            return false;
+        const SpkSegment *segment = cache && link < SPK_CACHED_LINKS ? cache[link] : NULL;
+        if (!segment || segment->target != target || et < segment->start_time || et > segment->end_time) {
+            segment = find_segment(spk, target, et);
+            if (segment == NULL)
+                return false;
+            if (cache && link < SPK_CACHED_LINKS) cache[link] = segment;
+        }
+        evaluate_segment(segment, et, position, velocity);
+        target = segment->center;
+    }
+    return true;
+}
+
+bool spk_state(const SpkFile *spk, int target, int center, double et, double position[3], double velocity[3]) {
+    double center_position[3], center_velocity[3];
+    if (!barycentric_state(spk, target, et, position, velocity, NULL) ||
+        !barycentric_state(spk, center, et, center_position, center_velocity, NULL))
+        return false;
+
+    for (int axis = 0; axis < 3; axis++) {
+        position[axis] -= center_position[axis];
+        velocity[axis] -= center_velocity[axis];
+    }
+    return true;
+}
+
+double spk_seconds_per_time_unit(const Simulation *sim) {
+    int sun = 0;
+    for (int i = 0; i < sim->bodies.count; i++) {
+        if (sim->celestial_bodies[i].naif_id == NAIF_SUN) sun = i;
+    }
+    double km_per_length_unit = SPK_KM_PER_AU / 382.0;
+    double gm_sun = sim->gravitational_constant * sim->bodies.mass[sun];
+    return sqrt(km_per_length_unit * km_per_length_unit * km_per_length_unit * gm_sun / SPK_GM_SUN);
+}
+
+// J2000 equatorial to ecliptic, then ecliptic z becomes y. Swapping two axes mirrors the frame, which is
+// what makes the planets go around the same way as in create_solar_system.
+static glm::dvec3 simulation_frame(const double v[3]) {
+    double c = cos(SPK_OBLIQUITY_J2000), s = sin(SPK_OBLIQUITY_J2000);
+    double ecliptic_y = c * v[1] + s * v[2];
+    double ecliptic_z = -s * v[1] + c * v[2];
+    return glm::dvec3(v[0], ecliptic_z, ecliptic_y);
+}
+
+static void reserve_spk_scratch(Simulation *sim) {
+    if (sim->bodies.count <= sim->spk_scratch_capacity)
+        return;
+
+    int capacity = sim->bodies.capacity;
+    sim->spk_states = (glm::dvec3 *) realloc(sim->spk_states, 2 * capacity * sizeof(glm::dvec3));
+    sim->spk_segments = (const SpkSegment **) realloc(sim->spk_segments, SPK_CACHED_LINKS * capacity * sizeof(const SpkSegment *));
+    if (sim->spk_states == NULL || sim->spk_segments == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the SPK updates.\n");
+        exit(-1);
+    }
+    for (int i = SPK_CACHED_LINKS * sim->spk_scratch_capacity; i < SPK_CACHED_LINKS * capacity; i++) {
+        sim->spk_segments[i] = NULL;
+    }
+    sim->spk_scratch_capacity = capacity;
+}
+
+bool read_spk_states(Simulation *sim, const SpkFile *spk, double et) {
+    reserve_spk_scratch(sim);
+    double length_scale = 382.0 / SPK_KM_PER_AU;
+    double velocity_scale = length_scale * spk_seconds_per_time_unit(sim);
+
+    for (int i = 0; i < sim->bodies.count; i++) {
+        int naif_id = sim->celestial_bodies[i].naif_id;
+        if (naif_id == 0) continue;
+        double position[3], velocity[3];
+        if (!barycentric_state(spk, naif_id, et, position, velocity, sim->spk_segments + SPK_CACHED_LINKS * i))
+            return false;
+        sim->spk_states[2 * i] = simulation_frame(position) * length_scale;
+        sim->spk_states[2 * i + 1] = simulation_frame(velocity) * velocity_scale;
+    }
+    return true;
+}
+
+void apply_spk_states(Simulation *sim) {
+    for (int i = 0; i < sim->bodies.count; i++) {
+        if (sim->celestial_bodies[i].naif_id == 0) continue;
+        set_position(&sim->bodies, i, sim->spk_states[2 * i]);
+        set_velocity(&sim->bodies, i, sim->spk_states[2 * i + 1]);
+    }
+    sim->accelerations_current = false;
+    sim->test_particle_accelerations_current = false;
+}
+
+bool set_bodies_from_spk(Simulation *sim, const SpkFile *spk, double et) {
+    BodyArrays *bodies = &sim->bodies;
+    if (!read_spk_states(sim, spk, et))
+        return false;
+
+    // the lagrange markers are solved again once everything else is in place
+    for (int i = 0; i < bodies->count; i++) {
+        int anchor = sim->celestial_bodies[i].anchor;
+        if (sim->celestial_bodies[i].naif_id != 0 || sim->celestial_bodies[i].lagrange_primary != -1 ||
+            anchor < 0 || sim->celestial_bodies[anchor].naif_id == 0) continue;
+        set_position(bodies, i, get_position(bodies, i) + sim->spk_states[2 * anchor] - get_position(bodies, anchor));
+        set_velocity(bodies, i, get_velocity(bodies, i) + sim->spk_states[2 * anchor + 1] - get_velocity(bodies, anchor));
+    }
+    apply_spk_states(sim);
+    place_lagrange_markers(sim);
+    return true;
+}
@@ -0,0 +1,67 @@
+#ifndef SPK_H
+#define SPK_H
+
+#include <stddef.h>
+
+// Reader for JPL SPK kernels (de440.bsp and friends), which are DAF files holding Chebyshev fits of
+// positions in km against ephemeris time (TDB seconds past J2000). The file is mmapped and the coefficients
+// are read in place. Only segments of type 2 and 3 in the J2000 frame are used, that is what the
+// planetary ephemerides ship, and only little endian files.
+
+// NAIF ids of the bodies create_solar_system makes, barycenters for the ones whose moons we don't simulate
+#define NAIF_SOLAR_SYSTEM_BARYCENTER 0
+#define NAIF_MERCURY_BARYCENTER 1
+#define NAIF_VENUS_BARYCENTER 2
+#define NAIF_MARS_BARYCENTER 4
+#define NAIF_JUPITER_BARYCENTER 5
+#define NAIF_SATURN_BARYCENTER 6
+#define NAIF_SUN 10
+#define NAIF_MOON 301
+#define NAIF_EARTH 399
+
+#define SPK_MAX_DEGREE 63
+#define SPK_KM_PER_AU 149597870.7
+#define SPK_GM_SUN 1.32712440041e11 // km^3/s^2
+#define SPK_OBLIQUITY_J2000 0.40909280422232897 // radians, between the J2000 equator and the ecliptic
+#define J2000_JULIAN_DATE 2451545.0
+
+struct Simulation;
+
+struct SpkSegment {
+    double start_time, end_time; // ET seconds
+    int target, center, frame, type;
+    const double *records;
+    double first_record_time;
+    double record_length;
+    int record_size; // in doubles
+    int num_records;
+};
+
+struct SpkFile {
+    void *mapping;
+    size_t mapping_size;
+    SpkSegment *segments;
+    int num_segments;
+};
+
+// prints what went wrong and returns NULL
+SpkFile *load_spk(const char *path);
+void destroy_spk(SpkFile **spk);
+
+// state of target relative to center in km and km/s in the J2000 frame, following the chain of centers
+// through the solar system barycenter. false if the kernel doesn't cover both at time et.
+bool spk_state(const SpkFile *spk, int target, int center, double et, double position[3], double velocity[3]);
+
+// Simulation units are 382 per AU and whatever time unit makes the sun's G * mass real, about 11 days.
+double spk_seconds_per_time_unit(const Simulation *sim);
+// Reads the state at et of every body with a naif id into sim->spk_states, relative to the solar system
+// barycenter and rotated into the ecliptic with y up. false if some body isn't covered at et. Doesn't touch
+// the bodies, and once the segments of every body are cached it costs a few chebyshev sums per body.
+bool read_spk_states(Simulation *sim, const SpkFile *spk, double et);
+// moves every body with a naif id to what read_spk_states read
+void apply_spk_states(Simulation *sim);
+// Both, for starting a scenario at a real epoch: the lagrange markers are solved again and the other bodies
+// without a naif id are carried along with their anchor. false if some body isn't covered at et, which leaves every body where it was.
+bool set_bodies_from_spk(Simulation *sim, const SpkFile *spk, double et);
+
+#endif
@@ -0,0 +1,182 @@
+#include "thread_pool.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// The tiles a thread still has to run, [first, end) packed into one word so that the owner taking one from
+// the front and a thief taking half from the back can both be a single compare-and-swap.
+struct alignas(64) TileQueue {
+    std::atomic<unsigned long long> range;
+};
+
+static inline unsigned long long pack_range(unsigned int first, unsigned int end) {
+    return (unsigned long long) end << 32 | first;
+}
+
+static inline unsigned int range_first(unsigned long long range) {
+    return (unsigned int) range;
+}
+
+static inline unsigned int range_end(unsigned long long range) {
+    return (unsigned int) (range >> 32);
+}
+
+struct ThreadPool {
+    int num_threads;
+    std::thread *workers; // num_threads - 1 of them, the caller of parallel_for_tiles is thread 0
+    TileQueue *queues;
+
+    std::mutex mutex;
+    std::condition_variable start_condition;
+    std::condition_variable done_condition;
+    unsigned long long generation; // bumped for every parallel_for_tiles
+    int num_running;
+    bool quit;
+
+    // the current loop
+    TileFunction function;
+    void *data;
+    int count;
+    int tile_size;
+};
+
+static bool pop_tile(TileQueue *queue, unsigned int *tile) {
+    unsigned long long range = queue->range.load(std::memory_order_relaxed);
+    while (range_first(range) < range_end(range)) {
+        if (queue->range.compare_exchange_weak(range, pack_range(range_first(range) + 1, range_end(range)))) {
+            *tile = range_first(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+// moves half of some other thread's remaining tiles into our (empty) queue
+static bool steal_tiles(ThreadPool *pool, int thief) {
+    for (int k = 1; k < pool->num_threads; k++) {
+        TileQueue *victim = &pool->queues[(thief + k) % pool->num_threads];
+        unsigned long long range = victim->range.load(std::memory_order_relaxed);
+        while (range_first(range) < range_end(range)) {
+            unsigned int first = range_first(range), end = range_end(range);
+            unsigned int split = end - (end - first + 1) / 2;
+            if (victim->range.compare_exchange_weak(range, pack_range(first, split))) {
+                // tiles are never handed out twice, so nobody can still be holding this exact range value
+                pool->queues[thief].range.store(pack_range(split, end));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void run_tiles(ThreadPool *pool, int thread_index) {
+    for (;;) {
+        unsigned int tile;
+        if (!pop_tile(&pool->queues[thread_index], &tile)) {
+            if (!steal_tiles(pool, thread_index)) return;
+            continue;
+        }
+        int first = tile * pool->tile_size;
+        int last = first + pool->tile_size < pool->count ? first + pool->tile_size : pool->count;
+        pool->function(pool->data, first, last, thread_index);
+    }
+}
+
+static void worker_main(ThreadPool *pool, int thread_index) {
+    unsigned long long seen_generation = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->start_condition.wait(lock, [&] { return pool->quit || pool->generation != seen_generation; });
+            if (pool->quit) return;
+            seen_generation = pool->generation;
+        }
+
+        run_tiles(pool, thread_index);
+
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if (--pool->num_running == 0) pool->done_condition.notify_one();
+    }
+}
+
+ThreadPool *create_thread_pool(int num_threads) {
+    if (num_threads <= 0) {
+        num_threads = (int) std::thread::hardware_concurrency();
+        if (num_threads <= 0) num_threads = 1;
+    }
+
+    // not calloc, the mutex and condition variables need their constructors
+    ThreadPool *pool = new ThreadPool();
+    pool->num_threads = num_threads;
+    pool->queues = new TileQueue[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        pool->queues[i].range.store(0);
+    }
+    pool->workers = new std::thread[num_threads - 1];
+    for (int i = 1; i < num_threads; i++) {
+        pool->workers[i - 1] = std::thread(worker_main, pool, i);
+    }
+    return pool;
+}
+
+void destroy_thread_pool(ThreadPool **pool) {
+    if (!pool || !(*pool))
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock((*pool)->mutex);
+        (*pool)->quit = true;
+    }
+    (*pool)->start_condition.notify_all();
+    for (int i = 0; i < (*pool)->num_threads - 1; i++) {
+        (*pool)->workers[i].join();
+    }
+    delete[] (*pool)->workers;
+    delete[] (*pool)->queues;
+    delete *pool;
+    *pool = NULL;
+}
+
+int thread_pool_size(const ThreadPool *pool) {
+    return pool ? pool->num_threads : 1;
+}
+
+void parallel_for_tiles(ThreadPool *pool, int count, int tile_size, TileFunction function, void *data) {
+    if (count <= 0)
+        return;
+    if (tile_size <= 0) {
+        fprintf(stderr, "Error: tile size must be positive.\n");
+        exit(-1);
+    }
+    if (!pool || pool->num_threads == 1 || count <= tile_size) {
+        function(data, 0, count, 0);
+        return;
+    }
+
+    int num_tiles = (count + tile_size - 1) / tile_size;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->function = function;
+        pool->data = data;
+        pool->count = count;
+        pool->tile_size = tile_size;
+        for (int i = 0; i < pool->num_threads; i++) {
+            unsigned int first = (unsigned int) ((long long) num_tiles * i / pool->num_threads);
+            unsigned int end = (unsigned int) ((long long) num_tiles * (i + 1) / pool->num_threads);
+            pool->queues[i].range.store(pack_range(first, end));
+        }
+        pool->num_running = pool->num_threads - 1;
+        pool->generation++;
+    }
+    pool->start_condition.notify_all();
+
+    run_tiles(pool, 0);
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->done_condition.wait(lock, [&] { return pool->num_running == 0; });
+}
@@ -0,0 +1,25 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Fixed set of worker threads that run parallel loops split into tiles. Every thread starts with an even
+// share of the tiles and idle threads steal half of what's left from the others, so uneven tiles
+// (barnes-hut walks, the triangle of a symmetric pair loop) still balance out.
+
+struct ThreadPool;
+
+// called with a tile [first, last) of the loop, thread_index is in [0, thread_pool_size(pool))
+// and no two tiles run at the same time with the same thread_index
+typedef void (*TileFunction)(void *data, int first, int last, int thread_index);
+
+// num_threads counts the calling thread, 0 means one per hardware thread
+ThreadPool *create_thread_pool(int num_threads);
+void destroy_thread_pool(ThreadPool **pool);
+
+// 1 for a NULL pool
+int thread_pool_size(const ThreadPool *pool);
+
+// runs function over [0, count) in tiles of tile_size and returns once every tile is done,
+// the calling thread works too. A NULL pool runs the whole range as a single tile on the calling thread.
+void parallel_for_tiles(ThreadPool *pool, int count, int tile_size, TileFunction function, void *data);
+
+#endif
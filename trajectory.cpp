@@ -0,0 +1,515 @@
+#include "trajectory.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+static_assert(sizeof(TrajectoryHeader) == 64, "the trajectory header is part of the file format");
+static_assert(sizeof(TrajectoryFrameHeader) == 16, "the trajectory frame header is part of the file format");
+
+#define TRAJECTORY_NUM_CHUNKS 4
+#define TRAJECTORY_CHUNK_BYTES (1 << 20)
+#define TRAJECTORY_VALUES_PER_BODY 6
+// the most bytes a 64 bit value takes as a varint
+#define MAX_VARINT_BYTES 10
+#define TRAJECTORY_WRITE_BYTES (1 << 20) // encoded frames are written out in pieces of about this size
+
+// A chunk is num_samples samples of 1 + 6 * (bodies + test particles) doubles: the time, then x, y, z, vx, vy,
+// vz of each body. They go around a ring, the simulation fills one while the writer empties the full ones.
+struct TrajectoryRecorder {
+    FILE *file;
+    int num_bodies;
+    int num_test_particles;
+    int sample_doubles;
+    int chunk_samples; // samples in a full chunk
+    double position_quantum;
+    double velocity_quantum;
+
+    double *chunks[TRAJECTORY_NUM_CHUNKS];
+    int chunk_counts[TRAJECTORY_NUM_CHUNKS];
+    int fill_chunk; // the one the simulation writes into, owned by it
+    int write_chunk; // the oldest full one
+    int num_full;
+    bool closing;
+    bool closed;
+    bool reported_mismatch;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable full_condition; // a chunk got full, or closing
+    std::condition_variable free_condition; // the writer is done with a chunk
+
+    // only the writer thread touches these
+    int64_t *previous; // the quantized values of the last frame
+    unsigned char *encoded; // room for TRAJECTORY_WRITE_BYTES plus a frame
+    size_t encoded_size;
+    long long num_frames;
+    bool failed;
+
+    std::atomic<long long> samples_written;
+    std::atomic<long long> bytes_written;
+};
+
+static inline unsigned char *put_varint(unsigned char *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char) value;
+    return out;
+}
+
+static inline int64_t quantize(double value, double inverse_quantum) {
+    // anything that flew off far enough to overflow is pinned, it's long gone anyway
+    double q = value * inverse_quantum;
+    if (!(q > -9.0e18)) return q != q ? 0 : (int64_t) -9.0e18;
+    if (q > 9.0e18) return (int64_t) 9.0e18;
+    return llrint(q);
+}
+
+static void flush_encoded(TrajectoryRecorder *recorder) {
+    if (recorder->encoded_size && !recorder->failed &&
+        fwrite(recorder->encoded, 1, recorder->encoded_size, recorder->file) != recorder->encoded_size) {
+        fprintf(stderr, "Error: failed to write the trajectory.\n");
+        recorder->failed = true;
+    }
+    recorder->encoded_size = 0;
+}
+
+static void write_chunk(TrajectoryRecorder *recorder, const double *chunk, int num_samples) {
+    int num_values = (recorder->num_bodies + recorder->num_test_particles) * TRAJECTORY_VALUES_PER_BODY;
+    double inverse_quanta[TRAJECTORY_VALUES_PER_BODY];
+    for (int k = 0; k < TRAJECTORY_VALUES_PER_BODY; k++) {
+        inverse_quanta[k] = 1.0 / (k < 3 ? recorder->position_quantum : recorder->velocity_quantum);
+    }
+
+    for (int s = 0; s < num_samples; s++) {
+        const double *sample = chunk + (size_t) s * recorder->sample_doubles;
+        const double *values = sample + 1;
+        bool keyframe = recorder->num_frames % TRAJECTORY_KEYFRAME_INTERVAL == 0;
+        int64_t *previous = recorder->previous;
+
+        unsigned char *frame_start = recorder->encoded + recorder->encoded_size;
+        unsigned char *out = frame_start + sizeof(TrajectoryFrameHeader);
+        for (int i = 0; i < num_values; i += TRAJECTORY_VALUES_PER_BODY) {
+            for (int k = 0; k < TRAJECTORY_VALUES_PER_BODY; k++) {
+                int64_t value = quantize(values[i + k], inverse_quanta[k]);
+                int64_t delta = keyframe ? value : (int64_t) ((uint64_t) value - (uint64_t) previous[i + k]);
+                previous[i + k] = value;
+                out = put_varint(out, ((uint64_t) delta << 1) ^ (uint64_t) (delta >> 63));
+            }
+        }
+
+        TrajectoryFrameHeader frame = { };
+        frame.frame_size = (uint32_t) (out - frame_start - sizeof(TrajectoryFrameHeader));
+        frame.flags = keyframe ? TRAJECTORY_FRAME_KEYFRAME : 0;
+        frame.time = sample[0];
+        memcpy(frame_start, &frame, sizeof(frame));
+
+        size_t size = out - frame_start;
+        recorder->encoded_size += size;
+        recorder->num_frames++;
+        recorder->samples_written.fetch_add(1, std::memory_order_relaxed);
+        recorder->bytes_written.fetch_add(size, std::memory_order_relaxed);
+        if (recorder->encoded_size >= TRAJECTORY_WRITE_BYTES) flush_encoded(recorder);
+    }
+}
+
+static void writer_main(TrajectoryRecorder *recorder) {
+    for (;;) {
+        int chunk;
+        {
+            std::unique_lock<std::mutex> lock(recorder->mutex);
+            recorder->full_condition.wait(lock, [&] { return recorder->num_full > 0 || recorder->closing; });
+            if (recorder->num_full == 0) {
+                flush_encoded(recorder);
+                return;
+            }
+            chunk = recorder->write_chunk;
+        }
+
+        write_chunk(recorder, recorder->chunks[chunk], recorder->chunk_counts[chunk]);
+
+        std::lock_guard<std::mutex> lock(recorder->mutex);
+        recorder->chunk_counts[chunk] = 0;
+        recorder->write_chunk = (chunk + 1) % TRAJECTORY_NUM_CHUNKS;
+        recorder->num_full--;
+        recorder->free_condition.notify_one();
+    }
+}
+
+TrajectoryRecorder *create_trajectory_recorder(const char *path, const Simulation *sim, double position_quantum, double velocity_quantum) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: can't open '%s' for writing.\n", path);
+        return NULL;
+    }
+
+    // not calloc, the thread, mutex and condition variables need their constructors
+    TrajectoryRecorder *recorder = new TrajectoryRecorder();
+    recorder->file = file;
+    recorder->num_bodies = sim->bodies.count;
+    recorder->num_test_particles = sim->test_particles.count;
+    recorder->position_quantum = position_quantum;
+    recorder->velocity_quantum = velocity_quantum;
+    int num_values = (recorder->num_bodies + recorder->num_test_particles) * TRAJECTORY_VALUES_PER_BODY;
+    recorder->sample_doubles = 1 + num_values;
+    recorder->chunk_samples = TRAJECTORY_CHUNK_BYTES / (recorder->sample_doubles * sizeof(double));
+    if (recorder->chunk_samples < 1) recorder->chunk_samples = 1;
+
+    for (int c = 0; c < TRAJECTORY_NUM_CHUNKS; c++) {
+        recorder->chunks[c] = (double *) malloc((size_t) recorder->chunk_samples * recorder->sample_doubles * sizeof(double));
+        if (recorder->chunks[c] == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the trajectory recorder.\n");
+            exit(-1);
+        }
+    }
+    recorder->previous = (int64_t *) calloc(num_values > 0 ? num_values : 1, sizeof(int64_t));
+    recorder->encoded = (unsigned char *) malloc(TRAJECTORY_WRITE_BYTES + sizeof(TrajectoryFrameHeader) + (size_t) num_values * MAX_VARINT_BYTES);
+    if (recorder->previous == NULL || recorder->encoded == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the trajectory recorder.\n");
+        exit(-1);
+    }
+
+    TrajectoryHeader header = { };
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+    header.version = TRAJECTORY_VERSION;
+    header.num_bodies = recorder->num_bodies;
+    header.num_test_particles = recorder->num_test_particles;
+    header.keyframe_interval = TRAJECTORY_KEYFRAME_INTERVAL;
+    header.position_quantum = position_quantum;
+    header.velocity_quantum = velocity_quantum;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fprintf(stderr, "Error: failed to write the trajectory.\n");
+        recorder->failed = true;
+    }
+    recorder->bytes_written.store(sizeof(header));
+
+    recorder->writer = std::thread(writer_main, recorder);
+    return recorder;
+}
+
+static void append_body_arrays(double *out, const BodyArrays *bodies) {
+    for (int i = 0; i < bodies->count; i++) {
+        out[0] = bodies->x[i];
+        out[1] = bodies->y[i];
+        out[2] = bodies->z[i];
+        out[3] = bodies->vx[i];
+        out[4] = bodies->vy[i];
+        out[5] = bodies->vz[i];
+        out += TRAJECTORY_VALUES_PER_BODY;
+    }
+}
+
+// hands the chunk being filled to the writer, waiting for a free one to go on with
+static void submit_chunk(TrajectoryRecorder *recorder) {
+    std::unique_lock<std::mutex> lock(recorder->mutex);
+    recorder->num_full++;
+    recorder->full_condition.notify_one();
+    recorder->free_condition.wait(lock, [&] { return recorder->num_full < TRAJECTORY_NUM_CHUNKS; });
+    recorder->fill_chunk = (recorder->fill_chunk + 1) % TRAJECTORY_NUM_CHUNKS;
+}
+
+void record_trajectory_sample(TrajectoryRecorder *recorder, const Simulation *sim) {
+    if (recorder->closed)
+        return;
+    if (sim->bodies.count != recorder->num_bodies || sim->test_particles.count != recorder->num_test_particles) {
+        if (!recorder->reported_mismatch) {
+            fprintf(stderr, "Error: the number of bodies changed, the trajectory stops at t = %f.\n", sim->time);
+            recorder->reported_mismatch = true;
+        }
+        return;
+    }
+
+    int chunk = recorder->fill_chunk;
+    double *sample = recorder->chunks[chunk] + (size_t) recorder->chunk_counts[chunk] * recorder->sample_doubles;
+    sample[0] = sim->time;
+    append_body_arrays(sample + 1, &sim->bodies);
+    append_body_arrays(sample + 1 + recorder->num_bodies * TRAJECTORY_VALUES_PER_BODY, &sim->test_particles);
+
+    if (++recorder->chunk_counts[chunk] == recorder->chunk_samples) {
+        submit_chunk(recorder);
+    }
+}
+
+bool close_trajectory_recorder(TrajectoryRecorder *recorder) {
+    if (!recorder->closed) {
+        if (recorder->chunk_counts[recorder->fill_chunk] > 0) {
+            submit_chunk(recorder);
+        }
+        {
+            std::lock_guard<std::mutex> lock(recorder->mutex);
+            recorder->closing = true;
+        }
+        recorder->full_condition.notify_one();
+        recorder->writer.join();
+
+        if (fclose(recorder->file) != 0 && !recorder->failed) {
+            fprintf(stderr, "Error: failed to write the trajectory.\n");
+            recorder->failed = true;
+        }
+        recorder->file = NULL;
+        recorder->closed = true;
+    }
+    return !recorder->failed;
+}
+
+void destroy_trajectory_recorder(TrajectoryRecorder **recorder) {
+    if (!recorder || !(*recorder))
+        return;
+
+    close_trajectory_recorder(*recorder);
+    for (int c = 0; c < TRAJECTORY_NUM_CHUNKS; c++) {
+        free((*recorder)->chunks[c]);
+    }
+    free((*recorder)->previous);
+    free((*recorder)->encoded);
+    delete *recorder;
+    *recorder = NULL;
+}
+
+long long trajectory_samples_written(const TrajectoryRecorder *recorder) {
+    return recorder->samples_written.load(std::memory_order_relaxed);
+}
+
+long long trajectory_bytes_written(const TrajectoryRecorder *recorder) {
+    return recorder->bytes_written.load(std::memory_order_relaxed);
+}
+
+TrajectoryReader *open_trajectory(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: can't open '%s'.\n", path);
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(TrajectoryHeader)) {
+        fprintf(stderr, "Error: '%s' is not a trajectory.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) file_stat.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: failed to map '%s'.\n", path);
+        return NULL;
+    }
+
+    const TrajectoryHeader *header = (const TrajectoryHeader *) mapping;
+    if (memcmp(header->magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a trajectory.\n", path);
+        munmap(mapping, size);
+        return NULL;
+    }
+    if (header->version != TRAJECTORY_VERSION || header->num_bodies < 0 || header->num_test_particles < 0 ||
+        header->keyframe_interval < 1 || !(header->position_quantum > 0.0) || !(header->velocity_quantum > 0.0)) {
+        fprintf(stderr, "Error: '%s' is version %u of the trajectory format or corrupt, only %d is supported.\n", path, header->version, TRAJECTORY_VERSION);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    // only the frame headers, to find where every frame starts
+    const unsigned char *bytes = (const unsigned char *) mapping;
+    size_t offset = sizeof(TrajectoryHeader);
+    int num_frames = 0, max_frames = 0;
+    const unsigned char **frames = NULL;
+    uint32_t *frame_sizes = NULL;
+    double *times = NULL;
+    while (offset + sizeof(TrajectoryFrameHeader) <= size) {
+        TrajectoryFrameHeader frame;
+        memcpy(&frame, bytes + offset, sizeof(frame));
+        if (frame.frame_size > size - offset - sizeof(TrajectoryFrameHeader))
+            break;
+        bool keyframe = num_frames % header->keyframe_interval == 0;
+        if (keyframe != ((frame.flags & TRAJECTORY_FRAME_KEYFRAME) != 0) || (num_frames && frame.time < times[num_frames - 1]))
+            break;
+
+        if (num_frames == max_frames) {
+            max_frames = max_frames ? max_frames * 2 : 1024;
+            frames = (const unsigned char **) realloc(frames, max_frames * sizeof(*frames));
+            frame_sizes = (uint32_t *) realloc(frame_sizes, max_frames * sizeof(*frame_sizes));
+            times = (double *) realloc(times, max_frames * sizeof(*times));
+            if (frames == NULL || frame_sizes == NULL || times == NULL) {
+                fprintf(stderr, "Error: failed to allocate memory for the trajectory index.\n");
+                exit(-1);
+            }
+        }
+        frames[num_frames] = bytes + offset + sizeof(TrajectoryFrameHeader);
+        frame_sizes[num_frames] = frame.frame_size;
+        times[num_frames] = frame.time;
+        num_frames++;
+        offset += sizeof(TrajectoryFrameHeader) + frame.frame_size;
+    }
+    if (num_frames == 0) {
+        fprintf(stderr, "Error: '%s' has no frames.\n", path);
+        free(frames);
+        free(frame_sizes);
+        free(times);
+        munmap(mapping, size);
+        return NULL;
+    }
+
+    TrajectoryReader *reader = (TrajectoryReader *) calloc(1, sizeof(TrajectoryReader));
+    int num_values = (header->num_bodies + header->num_test_particles) * TRAJECTORY_VALUES_PER_BODY;
+    size_t num_allocated = num_values > 0 ? num_values : 1;
+    if (reader == NULL ||
+        (reader->values = (int64_t *) calloc(num_allocated, sizeof(int64_t))) == NULL ||
+        (reader->before = (double *) calloc(num_allocated, sizeof(double))) == NULL ||
+        (reader->after = (double *) calloc(num_allocated, sizeof(double))) == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the trajectory reader.\n");
+        exit(-1);
+    }
+    reader->mapping = mapping;
+    reader->mapping_size = size;
+    reader->header = header;
+    reader->num_frames = num_frames;
+    reader->frames = frames;
+    reader->frame_sizes = frame_sizes;
+    reader->times = times;
+    reader->decoded_frame = -1;
+    reader->before_frame = -1;
+    reader->after_frame = -1;
+    return reader;
+}
+
+void destroy_trajectory_reader(TrajectoryReader **reader) {
+    if (!reader || !(*reader))
+        return;
+
+    munmap((*reader)->mapping, (*reader)->mapping_size);
+    free((*reader)->frames);
+    free((*reader)->frame_sizes);
+    free((*reader)->times);
+    free((*reader)->values);
+    free((*reader)->before);
+    free((*reader)->after);
+    free(*reader);
+    *reader = NULL;
+}
+
+double trajectory_start_time(const TrajectoryReader *reader) {
+    return reader->times[0];
+}
+
+double trajectory_end_time(const TrajectoryReader *reader) {
+    return reader->times[reader->num_frames - 1];
+}
+
+// applies frame to reader->values, which has to hold the frame before it unless it's a keyframe
+static void decode_frame(TrajectoryReader *reader, int frame) {
+    const unsigned char *in = reader->frames[frame];
+    const unsigned char *end = in + reader->frame_sizes[frame];
+    bool keyframe = frame % reader->header->keyframe_interval == 0;
+    int num_values = (reader->header->num_bodies + reader->header->num_test_particles) * TRAJECTORY_VALUES_PER_BODY;
+
+    for (int i = 0; i < num_values; i++) {
+        uint64_t zigzag = 0;
+        for (int shift = 0; in < end && shift < 64; shift += 7) {
+            unsigned char byte = *in++;
+            zigzag |= (uint64_t) (byte & 0x7f) << shift;
+            if (byte < 0x80) break;
+        }
+        int64_t delta = (int64_t) (zigzag >> 1) ^ -(int64_t) (zigzag & 1);
+        reader->values[i] = keyframe ? delta : (int64_t) ((uint64_t) reader->values[i] + (uint64_t) delta);
+    }
+    reader->decoded_frame = frame;
+}
+
+// dequantized state of frame into out
+static void frame_state(TrajectoryReader *reader, int frame, double *out) {
+    int keyframe = frame / reader->header->keyframe_interval * reader->header->keyframe_interval;
+    if (reader->decoded_frame > frame || reader->decoded_frame < keyframe) {
+        decode_frame(reader, keyframe);
+    }
+    while (reader->decoded_frame < frame) {
+        decode_frame(reader, reader->decoded_frame + 1);
+    }
+
+    int num_values = (reader->header->num_bodies + reader->header->num_test_particles) * TRAJECTORY_VALUES_PER_BODY;
+    for (int i = 0; i < num_values; i++) {
+        double quantum = i % TRAJECTORY_VALUES_PER_BODY < 3 ? reader->header->position_quantum : reader->header->velocity_quantum;
+        out[i] = reader->values[i] * quantum;
+    }
+}
+
+static void interpolate_body_arrays(BodyArrays *bodies, const double *before, const double *after, double h, double u) {
+    // cubic hermite basis functions and their derivatives (over u, not time)
+    double u2 = u * u, u3 = u2 * u;
+    double h00 = 2.0 * u3 - 3.0 * u2 + 1.0, h10 = u3 - 2.0 * u2 + u, h01 = -2.0 * u3 + 3.0 * u2, h11 = u3 - u2;
+    double d00 = 6.0 * u2 - 6.0 * u, d10 = 3.0 * u2 - 4.0 * u + 1.0, d01 = -d00, d11 = 3.0 * u2 - 2.0 * u;
+
+    double *positions[3] = { bodies->x, bodies->y, bodies->z };
+    double *velocities[3] = { bodies->vx, bodies->vy, bodies->vz };
+    for (int i = 0; i < bodies->count; i++) {
+        const double *a = before + i * TRAJECTORY_VALUES_PER_BODY;
+        const double *b = after + i * TRAJECTORY_VALUES_PER_BODY;
+        for (int axis = 0; axis < 3; axis++) {
+            double p0 = a[axis], v0 = a[3 + axis], p1 = b[axis], v1 = b[3 + axis];
+            if (h > 0.0) {
+                positions[axis][i] = h00 * p0 + h10 * h * v0 + h01 * p1 + h11 * h * v1;
+                velocities[axis][i] = (d00 * p0 + d10 * h * v0 + d01 * p1 + d11 * h * v1) / h;
+            } else {
+                positions[axis][i] = p0;
+                velocities[axis][i] = v0;
+            }
+        }
+    }
+}
+
+bool read_trajectory_state(TrajectoryReader *reader, double t, BodyArrays *bodies, BodyArrays *test_particles) {
+    const TrajectoryHeader *header = reader->header;
+    if (bodies && bodies->count != header->num_bodies)
+        return false;
+    if (test_particles && test_particles->count != header->num_test_particles)
+        return false;
+
+    // the last frame at or before t, and the one after it
+    int low = 0, high = reader->num_frames - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (reader->times[middle] <= t) low = middle;
+        else high = middle - 1;
+    }
+    int frame = low;
+    int next = frame + 1 < reader->num_frames ? frame + 1 : frame;
+
+    // playing forward the old after is the new before, playing backward the other way around
+    if (reader->after_frame == frame || reader->before_frame == next) {
+        double *swap = reader->before;
+        reader->before = reader->after;
+        reader->after = swap;
+        int swap_frame = reader->before_frame;
+        reader->before_frame = reader->after_frame;
+        reader->after_frame = swap_frame;
+    }
+    if (reader->before_frame != frame) {
+        frame_state(reader, frame, reader->before);
+        reader->before_frame = frame;
+    }
+    if (reader->after_frame != next) {
+        frame_state(reader, next, reader->after);
+        reader->after_frame = next;
+    }
+
+    double h = reader->times[next] - reader->times[frame];
+    double u = h > 0.0 ? (t - reader->times[frame]) / h : 0.0;
+    if (u < 0.0) u = 0.0;
+    if (u > 1.0) u = 1.0;
+    int particle_offset = header->num_bodies * TRAJECTORY_VALUES_PER_BODY;
+    if (bodies) interpolate_body_arrays(bodies, reader->before, reader->after, h, u);
+    if (test_particles) interpolate_body_arrays(test_particles, reader->before + particle_offset, reader->after + particle_offset, h, u);
+    return true;
+}
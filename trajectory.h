@@ -0,0 +1,91 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Records the state of every body and test particle to a file as the simulation runs. The simulation thread
+// only copies the raw state into a chunk, a writer thread of its own quantizes, delta encodes and writes it.
+//
+// File layout (native endianness): a TrajectoryHeader, then one frame per sample, each a TrajectoryFrameHeader
+// followed by frame_size bytes: for every body and then every test particle x, y, z, vx, vy, vz, each
+// quantized to a multiple of its quantum and stored as a zigzag LEB128 varint of the difference from the same
+// value in the previous frame. Keyframes, every keyframe_interval frames, store the values themselves, so
+// reading can start at any of them. Quantizing is the only loss, errors don't build up along the file.
+
+#define TRAJECTORY_MAGIC "LGTRAJ"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_KEYFRAME_INTERVAL 256
+#define DEFAULT_TRAJECTORY_POSITION_QUANTUM 1e-6
+#define DEFAULT_TRAJECTORY_VELOCITY_QUANTUM 1e-6
+#define TRAJECTORY_FRAME_KEYFRAME 1 // TrajectoryFrameHeader::flags
+
+struct Simulation;
+struct BodyArrays;
+
+struct TrajectoryHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t num_bodies;
+    int32_t num_test_particles;
+    int32_t keyframe_interval;
+    double position_quantum;
+    double velocity_quantum;
+    uint8_t padding[24];
+};
+
+struct TrajectoryFrameHeader {
+    uint32_t frame_size; // bytes after this header
+    uint32_t flags;
+    double time;
+};
+
+struct TrajectoryRecorder;
+
+// records the bodies and test particles sim has now, prints what went wrong and returns NULL if the file
+// can't be created
+TrajectoryRecorder *create_trajectory_recorder(const char *path, const Simulation *sim, double position_quantum, double velocity_quantum);
+// waits for everything to be written if close_trajectory_recorder wasn't called
+void destroy_trajectory_recorder(TrajectoryRecorder **recorder);
+
+// copies the current state. Blocks only if the writer is a few chunks behind. Samples of a simulation whose
+// number of bodies changed since the recorder was created are dropped.
+void record_trajectory_sample(TrajectoryRecorder *recorder, const Simulation *sim);
+// writes out what's left and closes the file, false if any write failed
+bool close_trajectory_recorder(TrajectoryRecorder *recorder);
+
+// only final once the recorder is closed
+long long trajectory_samples_written(const TrajectoryRecorder *recorder);
+long long trajectory_bytes_written(const TrajectoryRecorder *recorder);
+
+// Plays a recorded file back. It's mmapped and only the frame headers are read up front, frames are decoded
+// on demand from the nearest keyframe, so jumping anywhere or stepping backward costs at most
+// keyframe_interval frames and playing forward one frame at a time costs one.
+struct TrajectoryReader {
+    void *mapping;
+    size_t mapping_size;
+    const TrajectoryHeader *header;
+    int num_frames; // a frame cut short at the end of the file (a recording that crashed) is left out
+    const unsigned char **frames; // the payload of each frame
+    uint32_t *frame_sizes;
+    double *times;
+
+    int64_t *values; // quantized values of decoded_frame
+    int decoded_frame; // -1 for none
+    // the two frames around the last time asked for, dequantized
+    double *before, *after;
+    int before_frame, after_frame;
+};
+
+// prints what went wrong and returns NULL
+TrajectoryReader *open_trajectory(const char *path);
+void destroy_trajectory_reader(TrajectoryReader **reader);
+
+double trajectory_start_time(const TrajectoryReader *reader);
+double trajectory_end_time(const TrajectoryReader *reader);
+// Writes the state at time t, clamped to the recording, into bodies and test_particles (which can be NULL),
+// interpolating between the two frames around it with cubic hermite splines on the recorded positions and
+// velocities. false if the arrays don't have as many bodies as the recording.
+bool read_trajectory_state(TrajectoryReader *reader, double t, BodyArrays *bodies, BodyArrays *test_particles);
+
+#endif
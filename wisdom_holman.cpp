@@ -0,0 +1,321 @@
+#include "wisdom_holman.h"
+#include "simulation.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define KEPLER_MAX_ITERATIONS 50
+
+// every double array of WisdomHolman, in declaration order
+#define WH_NUM_ARRAYS 10
+
+WisdomHolman *create_wisdom_holman() {
+    WisdomHolman *wh = (WisdomHolman *) calloc(1, sizeof(WisdomHolman));
+    if (wh == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the wisdom-holman integrator.\n");
+        exit(-1);
+    }
+    return wh;
+}
+
+void destroy_wisdom_holman(WisdomHolman **wh) {
+    if (!wh || !(*wh))
+        return;
+
+    free((*wh)->x); // every array lives in this one block
+    free(*wh);
+    *wh = NULL;
+}
+
+static void reserve_wisdom_holman(WisdomHolman *wh, int num_bodies) {
+    if (num_bodies <= wh->capacity)
+        return;
+
+    int capacity = (num_bodies + 7) / 8 * 8;
+    free(wh->x);
+    double *arrays = (double *) aligned_alloc(BODY_ARRAY_ALIGNMENT, WH_NUM_ARRAYS * (size_t) capacity * sizeof(double));
+    if (arrays == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the wisdom-holman integrator.\n");
+        exit(-1);
+    }
+
+    double **pointers[WH_NUM_ARRAYS] = { &wh->x, &wh->y, &wh->z, &wh->vx, &wh->vy, &wh->vz, &wh->ax, &wh->ay, &wh->az, &wh->interior_mass };
+    for (int k = 0; k < WH_NUM_ARRAYS; k++) {
+        *pointers[k] = arrays + (size_t) k * capacity;
+    }
+    wh->capacity = capacity;
+}
+
+const char *wh_coordinates_name(WhCoordinates coordinates) {
+    switch (coordinates) {
+    case WH_JACOBI: return "jacobi";
+    case WH_DEMOCRATIC_HELIOCENTRIC: return "democratic-heliocentric";
+    }
+    return "unknown";
+}
+
+bool parse_wh_coordinates(const char *name, WhCoordinates *coordinates) {
+    if (!strcmp(name, "jacobi")) *coordinates = WH_JACOBI;
+    else if (!strcmp(name, "democratic-heliocentric") || !strcmp(name, "dh")) *coordinates = WH_DEMOCRATIC_HELIOCENTRIC;
+    else return false;
+    return true;
+}
+
+// c_k(z) = sum over n of (-z)^n / (k + 2n)!
+static void stumpff(double z, double *c0, double *c1, double *c2, double *c3) {
+    if (fabs(z) < 0.1) {
+        // the closed forms cancel badly near zero
+        *c3 = 1.0 / 6.0 - z * (1.0 / 120.0 - z * (1.0 / 5040.0 - z * (1.0 / 362880.0 - z * (1.0 / 39916800.0 - z / 6227020800.0))));
+        *c2 = 1.0 / 2.0 - z * (1.0 / 24.0 - z * (1.0 / 720.0 - z * (1.0 / 40320.0 - z * (1.0 / 3628800.0 - z / 479001600.0))));
+    } else if (z > 0.0) {
+        double s = sqrt(z);
+        *c2 = (1.0 - cos(s)) / z;
+        *c3 = (1.0 - sin(s) / s) / z;
+    } else {
+        double s = sqrt(-z);
+        *c2 = (1.0 - cosh(s)) / z;
+        *c3 = (1.0 - sinh(s) / s) / z;
+    }
+    *c1 = 1.0 - z * *c3;
+    *c0 = 1.0 - z * *c2;
+}
+
+void kepler_drift(double mu, double *p, double *v, double dt) {
+    double r0 = sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    double v2 = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+    double eta0 = p[0] * v[0] + p[1] * v[1] + p[2] * v[2];
+    double beta = 2.0 * mu / r0 - v2; // positive for bound orbits
+    double zeta0 = mu - beta * r0;
+
+    // solve kepler's equation in the universal variable s with newton, r is dt/ds so it's also the derivative
+    double s = dt / r0;
+    double c0, c1, c2, c3, g1, g2, g3, r;
+    for (int iteration = 0; iteration < KEPLER_MAX_ITERATIONS; iteration++) {
+        stumpff(beta * s * s, &c0, &c1, &c2, &c3);
+        g1 = s * c1;
+        g2 = s * s * c2;
+        g3 = s * s * s * c3;
+        r = r0 + eta0 * g1 + zeta0 * g2;
+        double ds = (r0 * s + eta0 * g2 + zeta0 * g3 - dt) / r;
+        s -= ds;
+        if (fabs(ds) <= 1e-15 * fabs(s)) break;
+    }
+    stumpff(beta * s * s, &c0, &c1, &c2, &c3);
+    g1 = s * c1;
+    g2 = s * s * c2;
+    g3 = s * s * s * c3;
+    r = r0 + eta0 * g1 + zeta0 * g2;
+
+    // gauss' f and g functions
+    double f = 1.0 - mu * g2 / r0;
+    double g = dt - mu * g3;
+    double f_dot = -mu * g1 / (r0 * r);
+    double g_dot = 1.0 - mu * g2 / r;
+    for (int k = 0; k < 3; k++) {
+        double position = f * p[k] + g * v[k];
+        v[k] = f_dot * p[k] + g_dot * v[k];
+        p[k] = position;
+    }
+}
+
+// inertial to jacobi for one component, out[0] is the center of mass
+static void to_jacobi(const double *mass, const double *interior_mass, const double *in, double *out, int n) {
+    double weighted = mass[0] * in[0];
+    for (int i = 1; i < n; i++) {
+        out[i] = in[i] - weighted / interior_mass[i - 1];
+        weighted += mass[i] * in[i];
+    }
+    out[0] = weighted / interior_mass[n - 1];
+}
+
+static void from_jacobi(const double *mass, const double *interior_mass, const double *in, double *out, int n) {
+    // walk the centers of mass of bodies 0..i back down from the whole system's
+    double center = in[0];
+    for (int i = n - 1; i > 0; i--) {
+        center -= mass[i] / interior_mass[i] * in[i];
+        out[i] = in[i] + center;
+    }
+    out[0] = center;
+}
+
+// inertial to democratic heliocentric: positions relative to the sun, velocities relative to the center of mass
+static void to_democratic_heliocentric(const double *mass, double total_mass, const double *position, const double *velocity,
+                                       double *q, double *u, int n) {
+    double center = 0.0, center_velocity = 0.0;
+    for (int i = 0; i < n; i++) {
+        center += mass[i] * position[i];
+        center_velocity += mass[i] * velocity[i];
+    }
+    center /= total_mass;
+    center_velocity /= total_mass;
+
+    for (int i = 1; i < n; i++) {
+        q[i] = position[i] - position[0];
+        u[i] = velocity[i] - center_velocity;
+    }
+    q[0] = center;
+    u[0] = center_velocity;
+}
+
+static void from_democratic_heliocentric(const double *mass, double total_mass, const double *q, const double *u,
+                                         double *position, double *velocity, int n) {
+    double weighted_q = 0.0, momentum = 0.0;
+    for (int i = 1; i < n; i++) {
+        weighted_q += mass[i] * q[i];
+        momentum += mass[i] * u[i];
+    }
+    position[0] = q[0] - weighted_q / total_mass;
+    velocity[0] = u[0] - momentum / mass[0];
+    for (int i = 1; i < n; i++) {
+        position[i] = q[i] + position[0];
+        velocity[i] = u[i] + u[0];
+    }
+}
+
+static void to_coordinates(WisdomHolman *wh, const BodyArrays *bodies, double total_mass, WhCoordinates coordinates) {
+    int n = bodies->count;
+    const double *positions[3] = { bodies->x, bodies->y, bodies->z };
+    const double *velocities[3] = { bodies->vx, bodies->vy, bodies->vz };
+    double *q[3] = { wh->x, wh->y, wh->z };
+    double *u[3] = { wh->vx, wh->vy, wh->vz };
+    for (int k = 0; k < 3; k++) {
+        if (coordinates == WH_JACOBI) {
+            to_jacobi(bodies->mass, wh->interior_mass, positions[k], q[k], n);
+            to_jacobi(bodies->mass, wh->interior_mass, velocities[k], u[k], n);
+        } else {
+            to_democratic_heliocentric(bodies->mass, total_mass, positions[k], velocities[k], q[k], u[k], n);
+        }
+    }
+}
+
+static void from_coordinates(WisdomHolman *wh, BodyArrays *bodies, double total_mass, WhCoordinates coordinates) {
+    int n = bodies->count;
+    double *positions[3] = { bodies->x, bodies->y, bodies->z };
+    double *velocities[3] = { bodies->vx, bodies->vy, bodies->vz };
+    const double *q[3] = { wh->x, wh->y, wh->z };
+    const double *u[3] = { wh->vx, wh->vy, wh->vz };
+    for (int k = 0; k < 3; k++) {
+        if (coordinates == WH_JACOBI) {
+            from_jacobi(bodies->mass, wh->interior_mass, q[k], positions[k], n);
+            from_jacobi(bodies->mass, wh->interior_mass, u[k], velocities[k], n);
+        } else {
+            from_democratic_heliocentric(bodies->mass, total_mass, q[k], u[k], positions[k], velocities[k], n);
+        }
+    }
+}
+
+// the interaction part of the accelerations (everything but the kepler problem the drift solves),
+// from the inertial accelerations in the body arrays
+static void compute_kick(WisdomHolman *wh, const Simulation *sim, WhCoordinates coordinates) {
+    const BodyArrays *bodies = &sim->bodies;
+    int n = bodies->count;
+    double gm_sun = sim->gravitational_constant * bodies->mass[0];
+
+    if (coordinates == WH_JACOBI) {
+        to_jacobi(bodies->mass, wh->interior_mass, bodies->ax, wh->ax, n);
+        to_jacobi(bodies->mass, wh->interior_mass, bodies->ay, wh->ay, n);
+        to_jacobi(bodies->mass, wh->interior_mass, bodies->az, wh->az, n);
+        for (int i = 1; i < n; i++) {
+            // add back the jacobi kepler term, mu_i = G m_0 eta_i / eta_(i-1)
+            double mu = gm_sun * wh->interior_mass[i] / wh->interior_mass[i - 1];
+            double r2 = wh->x[i] * wh->x[i] + wh->y[i] * wh->y[i] + wh->z[i] * wh->z[i];
+            double factor = mu / (r2 * sqrt(r2));
+            wh->ax[i] += wh->x[i] * factor;
+            wh->ay[i] += wh->y[i] * factor;
+            wh->az[i] += wh->z[i] * factor;
+        }
+    } else {
+        for (int i = 1; i < n; i++) {
+            // take out the sun's pull, written like the direct solver so that it cancels exactly
+            double dx = bodies->x[0] - bodies->x[i];
+            double dy = bodies->y[0] - bodies->y[i];
+            double dz = bodies->z[0] - bodies->z[i];
+            double distance_squared = dx * dx + dy * dy + dz * dz;
+            double factor = gm_sun / ((distance_squared + GRAVITY_EPSILON) * sqrt(distance_squared));
+            wh->ax[i] = bodies->ax[i] - dx * factor;
+            wh->ay[i] = bodies->ay[i] - dy * factor;
+            wh->az[i] = bodies->az[i] - dz * factor;
+        }
+    }
+    // the center of mass moves in a straight line
+    wh->ax[0] = wh->ay[0] = wh->az[0] = 0.0;
+}
+
+static void kick(WisdomHolman *wh, int n, double h) {
+    for (int i = 0; i < n; i++) {
+        wh->vx[i] += wh->ax[i] * h;
+        wh->vy[i] += wh->ay[i] * h;
+        wh->vz[i] += wh->az[i] * h;
+    }
+}
+
+// democratic heliocentric only, the sun's share of the kinetic energy moves every heliocentric position
+static void jump(WisdomHolman *wh, const double *mass, int n, double h) {
+    double px = 0.0, py = 0.0, pz = 0.0;
+    for (int i = 1; i < n; i++) {
+        px += mass[i] * wh->vx[i];
+        py += mass[i] * wh->vy[i];
+        pz += mass[i] * wh->vz[i];
+    }
+    double factor = h / mass[0];
+    for (int i = 1; i < n; i++) {
+        wh->x[i] += px * factor;
+        wh->y[i] += py * factor;
+        wh->z[i] += pz * factor;
+    }
+}
+
+static void drift(WisdomHolman *wh, const Simulation *sim, double h, WhCoordinates coordinates) {
+    int n = sim->bodies.count;
+    double gm_sun = sim->gravitational_constant * sim->bodies.mass[0];
+
+    wh->x[0] += wh->vx[0] * h;
+    wh->y[0] += wh->vy[0] * h;
+    wh->z[0] += wh->vz[0] * h;
+    for (int i = 1; i < n; i++) {
+        double mu = coordinates == WH_JACOBI ? gm_sun * wh->interior_mass[i] / wh->interior_mass[i - 1] : gm_sun;
+        double p[3] = { wh->x[i], wh->y[i], wh->z[i] };
+        double v[3] = { wh->vx[i], wh->vy[i], wh->vz[i] };
+        kepler_drift(mu, p, v, h);
+        wh->x[i] = p[0]; wh->y[i] = p[1]; wh->z[i] = p[2];
+        wh->vx[i] = v[0]; wh->vy[i] = v[1]; wh->vz[i] = v[2];
+    }
+}
+
+void wisdom_holman_step(WisdomHolman *wh, Simulation *sim, double delta_time, WhCoordinates coordinates) {
+    BodyArrays *bodies = &sim->bodies;
+    int n = bodies->count;
+    if (n < 2 || bodies->mass[0] <= 0.0) {
+        fprintf(stderr, "Error: wisdom-holman needs a massive body 0 and something orbiting it.\n");
+        exit(-1);
+    }
+
+    reserve_wisdom_holman(wh, n);
+    double total_mass = 0.0;
+    for (int i = 0; i < n; i++) {
+        total_mass += bodies->mass[i];
+        wh->interior_mass[i] = total_mass;
+    }
+
+    if (!sim->accelerations_current) {
+        compute_accelerations(sim);
+    }
+
+    to_coordinates(wh, bodies, total_mass, coordinates);
+    compute_kick(wh, sim, coordinates);
+    kick(wh, n, 0.5 * delta_time);
+    if (coordinates == WH_DEMOCRATIC_HELIOCENTRIC) jump(wh, bodies->mass, n, 0.5 * delta_time);
+    drift(wh, sim, delta_time, coordinates);
+    if (coordinates == WH_DEMOCRATIC_HELIOCENTRIC) jump(wh, bodies->mass, n, 0.5 * delta_time);
+
+    // the second kick needs the forces at the new positions
+    from_coordinates(wh, bodies, total_mass, coordinates);
+    compute_accelerations(sim);
+    compute_kick(wh, sim, coordinates);
+    kick(wh, n, 0.5 * delta_time);
+    from_coordinates(wh, bodies, total_mass, coordinates);
+
+    sim->accelerations_current = true;
+}
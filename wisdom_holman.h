@@ -0,0 +1,40 @@
+#ifndef WISDOM_HOLMAN_H
+#define WISDOM_HOLMAN_H
+
+// Wisdom-Holman map for systems dominated by one central body (body 0, the sun): each step is an exact
+// kepler drift around the sun sandwiched between two kicks from everything else, so the step only has to
+// resolve the perturbations, not the orbits themselves.
+//
+// The kicks come from compute_accelerations() minus the part of the sun's pull the drift already took care of,
+// so any force mode works, but the subtraction is only as accurate as the forces (direct is the safe choice).
+
+enum WhCoordinates {
+    WH_JACOBI,                    // each body relative to the center of mass of the ones before it (Wisdom & Holman 1991)
+    WH_DEMOCRATIC_HELIOCENTRIC,   // heliocentric positions, barycentric velocities (Duncan, Levison & Lee 1998)
+};
+
+struct Simulation;
+
+struct WisdomHolman {
+    int capacity;
+    // positions and velocities in WhCoordinates, index 0 is the center of mass of the whole system
+    double *x, *y, *z;
+    double *vx, *vy, *vz;
+    double *ax, *ay, *az; // the kick, in the same coordinates
+    double *interior_mass; // jacobi only, eta_i = the mass of bodies 0..i
+};
+
+WisdomHolman *create_wisdom_holman();
+void destroy_wisdom_holman(WisdomHolman **wh);
+
+const char *wh_coordinates_name(WhCoordinates coordinates);
+bool parse_wh_coordinates(const char *name, WhCoordinates *coordinates);
+
+// one kick-drift-kick step of delta_time, leaves the accelerations of the new positions in the body arrays
+void wisdom_holman_step(WisdomHolman *wh, Simulation *sim, double delta_time, WhCoordinates coordinates);
+
+// moves a body with position p and velocity v along its two body orbit around a mass of gravitational
+// parameter mu (G * M) for dt, in place. Works for elliptic and hyperbolic orbits (universal variables).
+void kepler_drift(double mu, double *p, double *v, double dt);
+
+#endif